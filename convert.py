@@ -1,12 +1,144 @@
+import re
 import sys
 from tensorflow import keras
 import tensorflow as tf
+import numpy as np
 import gguf
 
+ENCODER_CONV = re.compile(r"conv(\d+)_block(\d+)_(\d+)_conv$")
+
+def inbound_layers(layer):
+    nodes = layer._inbound_nodes
+    if not nodes:
+        return []
+    inbound = nodes[0].inbound_layers
+    return inbound if isinstance(inbound, list) else [inbound]
+
+def same_pads(size, k, s):
+    # TensorFlow 'same': the odd pixel of the total padding goes to the end
+    total = max(k - s, 0) if size % s == 0 else max(k - size % s, 0)
+    return total // 2, total - total // 2
+
+def conv_pads(layer):
+    # (top, bottom, left, right), 'valid' takes an explicit ZeroPadding2D in front
+    if layer.padding == "same":
+        (kh, kw), (sh, sw) = layer.kernel_size, layer.strides
+        _, h, w, _ = layer.input_shape
+        if (sh > 1 or sw > 1) and (h is None or w is None):
+            raise ValueError(f"{layer.name}: 'same' padding with stride {sh} needs a fixed input size")
+        return same_pads(h or 0, kh, sh) + same_pads(w or 0, kw, sw)
+    for src in inbound_layers(layer):
+        if isinstance(src, keras.layers.ZeroPadding2D):
+            (top, bottom), (left, right) = src.padding
+            return top, bottom, left, right
+    return 0, 0, 0, 0
+
+def conv_padding(layer):
+    # the part of the padding on every side, the C++ side pads the rest at the end
+    return min(conv_pads(layer))
+
+def conv_norms(model):
+    # conv name -> name of the batch norm that follows it
+    norms = {}
+    for layer in model.layers:
+        if isinstance(layer, keras.layers.BatchNormalization):
+            for src in inbound_layers(layer):
+                norms[src.name] = layer.name
+    return norms
+
+def decoder_skips(model, stages, blocks):
+    # the encoder output each Concatenate of the decoder takes, in decoder order:
+    # 0 is the stem activation and k the output of stage k. The graph concatenates
+    # the upsampled decoder path first and the tap second
+    taps = {"conv1_relu": 0}
+    for k, stage in enumerate(stages):
+        taps[f"conv{stage}_block{blocks[stage]}_out"] = k + 1
+    skips = []
+    for layer in model.layers:
+        if not isinstance(layer, keras.layers.Concatenate):
+            continue
+        inbound = inbound_layers(layer)
+        if len(inbound) != 2 or not isinstance(inbound[0], keras.layers.UpSampling2D) or inbound[1].name not in taps:
+            names = [src.name for src in inbound]
+            raise ValueError(f"{layer.name}: expected the upsampled decoder path and a stage output, got {names}")
+        skips.append(taps[inbound[1].name])
+    return skips
+
+def write_architecture(model, gguf_writer):
+    # the C++ side builds the layer table and the graph from these keys:
+    #   encoder conv<s>_block<b>_<k>_conv (k = 0 is the projection shortcut),
+    #   decoder convs in order (one per skip, then the full-resolution conv and the head)
+    convs = [layer for layer in model.layers if isinstance(layer, keras.layers.Conv2D)]
+    norms = conv_norms(model)
+
+    blocks = {}
+    bottleneck = False
+    decoder = []
+    for layer in convs:
+        m = ENCODER_CONV.match(layer.name)
+        if m:
+            stage, block, k = int(m.group(1)), int(m.group(2)), int(m.group(3))
+            blocks[stage] = max(blocks.get(stage, 0), block)
+            bottleneck = bottleneck or k == 3
+        elif layer.name != "conv1_conv":
+            decoder.append(layer.name)
+
+    stages = sorted(blocks)
+    skips = decoder_skips(model, stages, blocks)
+
+    print(f"  encoder: {'bottleneck' if bottleneck else 'basic'} blocks {[blocks[s] for s in stages]}, skips {skips}, decoder: {decoder}")
+    if len(decoder) != len(skips) + 2:
+        raise ValueError(f"{len(decoder)} decoder convs for {len(skips)} skips, expected one per skip plus two")
+
+    gguf_writer.add_uint32("unet.input_width", model.input_shape[2])
+    gguf_writer.add_uint32("unet.input_height", model.input_shape[1])
+    gguf_writer.add_string("unet.encoder.block", "bottleneck" if bottleneck else "basic")
+    gguf_writer.add_array("unet.encoder.blocks", [blocks[s] for s in stages])
+    gguf_writer.add_array("unet.decoder.skips", skips)
+    gguf_writer.add_array("unet.decoder.convs", decoder)
+    gguf_writer.add_array("unet.conv.names", [layer.name for layer in convs])
+    gguf_writer.add_array("unet.conv.strides", [layer.strides[0] for layer in convs])
+    gguf_writer.add_array("unet.conv.paddings", [conv_padding(layer) for layer in convs])
+    gguf_writer.add_array("unet.conv.pads", [p for layer in convs for p in conv_pads(layer)])
+    gguf_writer.add_array("unet.conv.norms", [norms.get(layer.name, "") for layer in convs])
+
+# F(2x2,3x3) kernel transform U = G g G^T
+WINO_G = np.array([[1.0, 0.0, 0.0], [0.5, 0.5, 0.5], [0.5, -0.5, 0.5], [0.0, 0.0, 1.0]], dtype=np.float32)
+
+def write_repacked(model, gguf_writer):
+    # the kernels load_repacked_kernels() would otherwise compute per process:
+    # mapped from the file, every worker of a --manifest job shares them
+    norms = conv_norms(model)
+    n_wino = 0
+    for layer in model.layers:
+        if not isinstance(layer, keras.layers.Conv2D) or not layer.use_bias:
+            continue
+        kernel, bias = layer.kernel.numpy(), layer.bias.numpy()
+        n_out = kernel.shape[3]
+
+        # x*scale + shift folds the bias and the batch norm, as in the C++ loader
+        scale = np.ones(n_out, dtype=np.float32)
+        shift = bias.astype(np.float32)
+        if layer.name in norms:
+            bn = model.get_layer(norms[layer.name])
+            gamma, beta, mean, var = [w.numpy() for w in bn.weights]
+            scale = gamma/np.sqrt(var)
+            shift = (shift - mean)*scale + beta
+        gguf_writer.add_tensor(layer.name + "/epilogue", np.stack([scale, shift]).reshape(2, n_out, 1, 1).astype(np.float32))
+
+        if kernel.shape[:2] == (3, 3) and layer.strides[0] == 1 and conv_pads(layer) == (1, 1, 1, 1):
+            # [oc][ic][3][3] as in the GGUF, transformed to [16][ic][oc]
+            g = kernel.T.astype(np.float32)
+            u = WINO_G @ g @ WINO_G.T
+            gguf_writer.add_tensor(layer.name + "/kernel_wino", np.ascontiguousarray(u.transpose(2, 3, 1, 0).reshape(16, g.shape[1], g.shape[0])))
+            n_wino += 1
+    print(f"  repacked: {n_wino} Winograd kernels, folded epilogues")
+
 def convert(model_name):
     model = keras.models.load_model(model_name, compile=False)
     gguf_model_name = model_name + ".gguf"
     gguf_writer = gguf.GGUFWriter(gguf_model_name, "Unet")
+    write_architecture(model, gguf_writer)
     for layer in model.layers:      
         # export layers with weights
         if layer.weights:
@@ -20,6 +152,7 @@ def convert(model_name):
                     weight_data = weight_data.reshape(1, 1, -1, 1)
                     print(f"  after transpose: [{weight.name}] {weight_data.shape} {weight.dtype}")
                 gguf_writer.add_tensor(weight.name, weight_data.T)
+    write_repacked(model, gguf_writer)
 
     gguf_writer.write_header_to_file()
     gguf_writer.write_kv_data_to_file()
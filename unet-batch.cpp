@@ -0,0 +1,268 @@
+#include "unet-batch.h"
+#include "unet-cache.h"
+#include "unet-stats.h"
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// the state file starts with a fixed-size header naming the job (item count,
+// chunk size and a hash of the manifest), then one byte per chunk
+#define UNET_BATCH_HEADER 64
+
+enum {
+    UNET_CHUNK_PENDING = 0,
+    UNET_CHUNK_DONE    = 1,
+};
+
+bool unet_batch_read_manifest(unet_batch & batch, const std::string & fname, const std::string & out_dir)
+{
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+
+    batch.items.clear();
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        unet_batch_item item;
+        const size_t tab = line.find('\t');
+        item.input = line.substr(0, tab);
+        if (tab != std::string::npos) {
+            item.output = line.substr(tab + 1);
+            const size_t tab_model = item.output.find('\t');
+            if (tab_model != std::string::npos) {
+                item.model = item.output.substr(tab_model + 1);
+                item.output.resize(tab_model);
+            }
+        }
+        if (item.output.empty()) {
+            std::string stem = item.input.substr(item.input.find_last_of("/\\") + 1);
+            stem = stem.substr(0, stem.find_last_of('.'));
+            item.output = out_dir + "/" + stem + ".jpg";
+        }
+        batch.items.push_back(item);
+    }
+
+    batch.n_chunks = (batch.items.size() + batch.chunk - 1)/batch.chunk;
+    return true;
+}
+
+#if defined(_WIN32)
+
+bool unet_batch_open(unet_batch & batch, const std::string & fname_state)
+{
+    GGML_UNUSED(batch);
+    fprintf(stderr, "%s: '%s': batch mode needs POSIX file locks\n", __func__, fname_state.c_str());
+    return false;
+}
+
+void unet_batch_close(unet_batch & batch)
+{
+    GGML_UNUSED(batch);
+}
+
+bool unet_batch_claim(unet_batch & batch, int & begin, int & end)
+{
+    GGML_UNUSED(batch);
+    begin = end = 0;
+    return false;
+}
+
+void unet_batch_complete(unet_batch & batch)
+{
+    GGML_UNUSED(batch);
+}
+
+int unet_batch_n_done(unet_batch & batch)
+{
+    GGML_UNUSED(batch);
+    return 0;
+}
+
+#else
+
+// locks of a process are dropped when it exits, however it exits
+static bool unet_lock_byte(int fd, off_t offset, int type, bool wait)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = offset;
+    fl.l_len    = 1;
+    return fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == 0;
+}
+
+bool unet_batch_open(unet_batch & batch, const std::string & fname_state)
+{
+    batch.fd = open(fname_state.c_str(), O_RDWR | O_CREAT, 0644);
+    if (batch.fd < 0) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname_state.c_str());
+        return false;
+    }
+
+    // inputs, outputs and models as read, another manifest of the same length does not match
+    std::string manifest;
+    for (const auto & item : batch.items) {
+        manifest += item.input + '\t' + item.output + '\t' + item.model + '\n';
+    }
+    const uint64_t hash = unet_hash_bytes((const uint8_t *) manifest.data(), manifest.size());
+
+    char header[UNET_BATCH_HEADER];
+    memset(header, ' ', sizeof(header));
+    const int n = snprintf(header, sizeof(header), "unet-batch items=%d chunk=%d hash=%016llx", (int) batch.items.size(), batch.chunk,
+            (unsigned long long) hash);
+    header[std::min(n, (int) sizeof(header) - 1)] = ' ';
+    header[sizeof(header) - 1] = '\n';
+
+    // the first worker writes the header, the others check it
+    unet_lock_byte(batch.fd, 0, F_WRLCK, true);
+    char existing[UNET_BATCH_HEADER];
+    const ssize_t n_read = pread(batch.fd, existing, sizeof(existing), 0);
+    bool ok = true;
+    if (n_read <= 0) {
+        ok = pwrite(batch.fd, header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+             ftruncate(batch.fd, UNET_BATCH_HEADER + batch.n_chunks) == 0;
+        if (!ok) {
+            fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_state.c_str());
+        }
+    } else if (n_read != (ssize_t) sizeof(existing) || memcmp(existing, header, sizeof(header)) != 0) {
+        fprintf(stderr, "%s: '%s' belongs to a different manifest or chunk size, remove it to start over\n", __func__, fname_state.c_str());
+        ok = false;
+    }
+    unet_lock_byte(batch.fd, 0, F_UNLCK, false);
+
+    if (!ok) {
+        unet_batch_close(batch);
+        return false;
+    }
+    batch.state.resize(batch.n_chunks);
+    return true;
+}
+
+void unet_batch_close(unet_batch & batch)
+{
+    if (batch.fd >= 0) {
+        close(batch.fd);
+    }
+    batch.fd = -1;
+    batch.claimed = -1;
+}
+
+static bool unet_batch_read_state(unet_batch & batch)
+{
+    return pread(batch.fd, batch.state.data(), batch.n_chunks, UNET_BATCH_HEADER) == batch.n_chunks;
+}
+
+bool unet_batch_claim(unet_batch & batch, int & begin, int & end)
+{
+    GGML_ASSERT(batch.claimed < 0);
+    if (!unet_batch_read_state(batch)) {
+        return false;
+    }
+    for (int c = batch.shard; c < batch.n_chunks; c += batch.n_shards) {
+        if (batch.state[c] != UNET_CHUNK_PENDING) {
+            continue;
+        }
+        // taken by a running worker
+        if (!unet_lock_byte(batch.fd, UNET_BATCH_HEADER + c, F_WRLCK, false)) {
+            continue;
+        }
+        // completed between the scan and the lock
+        char state = UNET_CHUNK_DONE;
+        if (pread(batch.fd, &state, 1, UNET_BATCH_HEADER + c) != 1 || state != UNET_CHUNK_PENDING) {
+            unet_lock_byte(batch.fd, UNET_BATCH_HEADER + c, F_UNLCK, false);
+            continue;
+        }
+        batch.claimed = c;
+        begin = c*batch.chunk;
+        end   = std::min<int>(begin + batch.chunk, batch.items.size());
+        return true;
+    }
+    return false;
+}
+
+void unet_batch_complete(unet_batch & batch)
+{
+    GGML_ASSERT(batch.claimed >= 0);
+    const char state = UNET_CHUNK_DONE;
+    if (pwrite(batch.fd, &state, 1, UNET_BATCH_HEADER + batch.claimed) != 1) {
+        fprintf(stderr, "%s: failed to mark chunk %d done\n", __func__, batch.claimed);
+    }
+    unet_lock_byte(batch.fd, UNET_BATCH_HEADER + batch.claimed, F_UNLCK, false);
+    batch.claimed = -1;
+}
+
+int unet_batch_n_done(unet_batch & batch)
+{
+    if (!unet_batch_read_state(batch)) {
+        return 0;
+    }
+    int n_done = 0;
+    for (char state : batch.state) {
+        n_done += state == UNET_CHUNK_DONE;
+    }
+    return n_done;
+}
+
+#endif
+
+FILE * unet_batch_open_results(const unet_batch & batch, const std::string & prefix)
+{
+    GGML_ASSERT(batch.claimed >= 0);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%06d.jsonl", batch.claimed);
+    const std::string fname = prefix + suffix;
+    FILE * f = fopen(fname.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+    }
+    return f;
+}
+
+bool unet_batch_close_results(FILE * f)
+{
+    bool ok = fflush(f) == 0;
+#if !defined(_WIN32)
+    // a chunk marked done must not lose its results to a crash
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write the results\n", __func__);
+    }
+    return ok;
+}
+
+void unet_batch_write_result(FILE * f, int index, const unet_batch_item & item, int n_defect, float max_score)
+{
+    fprintf(f, "{\"index\": %d, \"image\": ", index);
+    unet_write_json_string(f, item.input.c_str());
+    fprintf(f, ", \"output\": ");
+    unet_write_json_string(f, item.output.c_str());
+    fprintf(f, ", \"defect_pixels\": %d, \"max_score\": %.4f}\n", n_defect, max_score);
+}
+
+void unet_batch_write_error(FILE * f, int index, const unet_batch_item & item, const char * error)
+{
+    fprintf(f, "{\"index\": %d, \"image\": ", index);
+    unet_write_json_string(f, item.input.c_str());
+    fprintf(f, ", \"error\": ");
+    unet_write_json_string(f, error);
+    fprintf(f, "}\n");
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// offline batch mode: the inputs come from a manifest, one image per line with
+// an optional tab-separated output path and model name. The manifest is split into chunks and
+// a state file next to it holds one byte per chunk. A worker claims a chunk by
+// locking its byte and marks it done before unlocking, so any number of worker
+// processes on one host share the job, a killed worker releases its claim and
+// a restarted job skips the chunks that are done
+
+struct unet_batch_item {
+    std::string input;
+    std::string output;
+    std::string model;  // with several models resident, empty for the first
+};
+
+struct unet_batch {
+    std::vector<unet_batch_item> items;
+    int chunk    = 16;  // images per chunk
+    int n_chunks = 0;
+    int shard    = 0;   // with n_shards > 1 only chunks c with c % n_shards == shard
+    int n_shards = 1;
+
+    int fd      = -1;
+    int claimed = -1;
+    std::vector<char> state;
+};
+
+// reads the manifest, outputs without a path go to out_dir under the input file name
+bool unet_batch_read_manifest(unet_batch & batch, const std::string & fname, const std::string & out_dir);
+
+// opens or creates the state file, fails when it belongs to a different manifest or chunk size
+bool unet_batch_open(unet_batch & batch, const std::string & fname_state);
+void unet_batch_close(unet_batch & batch);
+
+// claims the next chunk that is neither done nor claimed by another worker,
+// returns false when there is none left
+bool unet_batch_claim(unet_batch & batch, int & begin, int & end);
+// marks the claimed chunk done and releases it
+void unet_batch_complete(unet_batch & batch);
+
+// the results of the claimed chunk go to "<prefix>.<chunk>.jsonl", truncated
+// on open so a redone chunk replaces the lines of a worker that was killed
+FILE * unet_batch_open_results(const unet_batch & batch, const std::string & prefix);
+// flushes the results to disk and closes the file, before unet_batch_complete
+bool unet_batch_close_results(FILE * f);
+
+// number of chunks marked done
+int unet_batch_n_done(unet_batch & batch);
+
+// one JSON line per image, the same line whichever worker processed it
+void unet_batch_write_result(FILE * f, int index, const unet_batch_item & item, int n_defect, float max_score);
+void unet_batch_write_error(FILE * f, int index, const unet_batch_item & item, const char * error);
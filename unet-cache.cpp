@@ -0,0 +1,181 @@
+#include "unet-cache.h"
+
+#include <cstring>
+#include <iterator>
+
+static uint64_t unet_mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t unet_hash_bytes(const uint8_t * data, size_t size)
+{
+    // four independent lanes of 8 bytes keep the multiplier pipelined
+    uint64_t lanes[4] = { 0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t w;
+            memcpy(&w, data + i + 8*k, 8);
+            lanes[k] = (lanes[k] ^ w)*0x9e3779b97f4a7c15ULL;
+            lanes[k] ^= lanes[k] >> 29;
+        }
+    }
+    uint64_t h = size;
+    for (int k = 0; k < 4; k++) {
+        h = unet_mix64(h ^ lanes[k]);
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i])*0x100000001b3ULL;
+    }
+    return unet_mix64(h);
+}
+
+uint64_t unet_perceptual_hash(const unet_image & sized)
+{
+    const int gw = 9;
+    const int gh = 8;
+    float grid[gh][gw];
+    for (int gy = 0; gy < gh; gy++) {
+        const int y0 = gy*sized.h/gh;
+        const int y1 = (gy + 1)*sized.h/gh;
+        for (int gx = 0; gx < gw; gx++) {
+            const int x0 = gx*sized.w/gw;
+            const int x1 = (gx + 1)*sized.w/gw;
+            float sum = 0.0f;
+            for (int k = 0; k < sized.c; k++) {
+                for (int y = y0; y < y1; y++) {
+                    const float * row = &sized.data[(k*sized.h + y)*sized.w];
+                    for (int x = x0; x < x1; x++) {
+                        sum += row[x];
+                    }
+                }
+            }
+            grid[gy][gx] = sum/((x1 - x0)*(y1 - y0));
+        }
+    }
+    uint64_t h = 0;
+    for (int gy = 0; gy < gh; gy++) {
+        for (int gx = 0; gx + 1 < gw; gx++) {
+            h = (h << 1) | (grid[gy][gx] > grid[gy][gx + 1]);
+        }
+    }
+    return h;
+}
+
+static int unet_popcount64(uint64_t x)
+{
+    int n = 0;
+    for (; x; x &= x - 1) {
+        n++;
+    }
+    return n;
+}
+
+static size_t unet_cache_entry_bytes(const unet_cache_entry & entry)
+{
+    return sizeof(entry) + entry.mask.data.size();
+}
+
+static const unet_cache_entry * unet_cache_touch(unet_cache & cache, std::list<unet_cache_entry>::iterator it)
+{
+    cache.entries.splice(cache.entries.begin(), cache.entries, it);
+    return &*it;
+}
+
+const unet_cache_entry * unet_cache_find_raw(unet_cache & cache, uint64_t raw)
+{
+    auto it = cache.by_raw.find(raw);
+    if (it == cache.by_raw.end()) {
+        return NULL;
+    }
+    cache.n_hits_raw++;
+    return unet_cache_touch(cache, it->second);
+}
+
+const unet_cache_entry * unet_cache_find_perceptual(unet_cache & cache, uint64_t phash)
+{
+    auto it = cache.by_phash.find(phash);
+    if (it != cache.by_phash.end()) {
+        cache.n_hits_phash++;
+        return unet_cache_touch(cache, it->second);
+    }
+    if (cache.phash_dist <= 0) {
+        return NULL;
+    }
+    // nearest key within the distance, the cache is small enough to scan
+    auto best = cache.entries.end();
+    int best_dist = cache.phash_dist + 1;
+    for (auto e = cache.entries.begin(); e != cache.entries.end(); ++e) {
+        if (!e->has_phash) {
+            continue;
+        }
+        const int dist = unet_popcount64(e->phash ^ phash);
+        if (dist < best_dist) {
+            best = e;
+            best_dist = dist;
+        }
+    }
+    if (best == cache.entries.end()) {
+        return NULL;
+    }
+    cache.n_hits_phash++;
+    return unet_cache_touch(cache, best);
+}
+
+static void unet_cache_erase(unet_cache & cache, std::list<unet_cache_entry>::iterator it)
+{
+    auto raw = cache.by_raw.find(it->raw);
+    if (it->has_raw && raw != cache.by_raw.end() && raw->second == it) {
+        cache.by_raw.erase(raw);
+    }
+    auto phash = cache.by_phash.find(it->phash);
+    if (it->has_phash && phash != cache.by_phash.end() && phash->second == it) {
+        cache.by_phash.erase(phash);
+    }
+    cache.n_bytes -= unet_cache_entry_bytes(*it);
+    cache.entries.erase(it);
+}
+
+void unet_cache_insert(unet_cache & cache, const unet_cache_entry & entry)
+{
+    cache.n_misses++;
+    if (cache.max_entries <= 0 || unet_cache_entry_bytes(entry) > cache.max_bytes) {
+        return;
+    }
+
+    // a newer result replaces the entries under the same keys
+    if (entry.has_raw && cache.by_raw.count(entry.raw)) {
+        unet_cache_erase(cache, cache.by_raw[entry.raw]);
+    }
+    if (entry.has_phash && cache.by_phash.count(entry.phash)) {
+        unet_cache_erase(cache, cache.by_phash[entry.phash]);
+    }
+
+    while (!cache.entries.empty() && ((int) cache.entries.size() >= cache.max_entries ||
+            cache.n_bytes + unet_cache_entry_bytes(entry) > cache.max_bytes)) {
+        unet_cache_erase(cache, std::prev(cache.entries.end()));
+        cache.n_evicted++;
+    }
+
+    cache.entries.push_front(entry);
+    cache.n_bytes += unet_cache_entry_bytes(entry);
+    if (entry.has_raw) {
+        cache.by_raw[entry.raw] = cache.entries.begin();
+    }
+    if (entry.has_phash) {
+        cache.by_phash[entry.phash] = cache.entries.begin();
+    }
+}
+
+void unet_cache_write_summary(FILE * f, const unet_cache & cache)
+{
+    fprintf(f, "{\"cache\": {\"entries\": %d, \"bytes\": %zu, \"hits_raw\": %d, \"hits_perceptual\": %d, \"misses\": %d, \"evicted\": %d}}\n",
+            (int) cache.entries.size(), cache.n_bytes, cache.n_hits_raw, cache.n_hits_phash, cache.n_misses, cache.n_evicted);
+    fflush(f);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "unet-image.h"
+
+#include <cstdio>
+#include <list>
+#include <unordered_map>
+
+// results of recent frames keyed by a hash of the raw file bytes and, with
+// perceptual keys, by a difference hash of the letterboxed network input so
+// near-identical frames hit as well. Bounded by entries and bytes, least
+// recently used entries go first
+
+struct unet_cache_entry {
+    uint64_t raw = 0;
+    uint64_t phash = 0;
+    bool has_raw = false;
+    bool has_phash = false;
+    int n_defect = 0;
+    float max_score = 0.0f;
+    unet_image_u8 mask;
+};
+
+struct unet_cache {
+    int max_entries = 0;                // 0 disables the cache
+    size_t max_bytes = 64u << 20;
+    bool perceptual = false;
+    int phash_dist = 0;                 // bits a perceptual key may differ by
+
+    std::list<unet_cache_entry> entries;  // most recently used first
+    std::unordered_map<uint64_t, std::list<unet_cache_entry>::iterator> by_raw;
+    std::unordered_map<uint64_t, std::list<unet_cache_entry>::iterator> by_phash;
+    size_t n_bytes = 0;
+
+    int n_hits_raw = 0;
+    int n_hits_phash = 0;
+    int n_misses = 0;
+    int n_evicted = 0;
+};
+
+uint64_t unet_hash_bytes(const uint8_t * data, size_t size);
+// 64 bit difference hash of the gray levels on a 9x8 grid
+uint64_t unet_perceptual_hash(const unet_image & sized);
+
+// NULL on a miss, a hit becomes the most recently used entry
+const unet_cache_entry * unet_cache_find_raw(unet_cache & cache, uint64_t raw);
+const unet_cache_entry * unet_cache_find_perceptual(unet_cache & cache, uint64_t phash);
+
+// counts a miss and stores the result, evicting entries past the bounds
+void unet_cache_insert(unet_cache & cache, const unet_cache_entry & entry);
+
+void unet_cache_write_summary(FILE * f, const unet_cache & cache);
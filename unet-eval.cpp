@@ -0,0 +1,520 @@
+#include "unet.h"
+
+#include <filesystem>
+
+// accuracy and throughput evaluation over a directory of images and ground-truth masks
+
+struct unet_eval_params {
+    std::string model     = "modelunet.gguf";
+    std::string dir_inp;
+    std::string dir_mask;
+    std::string dir_ref;
+    std::string dir_save_ref;
+    std::vector<float> thresholds = { 0.05f, 0.15f, 0.30f, 0.50f, 0.70f };
+    float ref_tol         = 1e-3f;
+    int threads           = 4;
+    int batch             = 1;
+    bool winograd         = true;
+    bool int8             = false;
+    enum ggml_type wtype  = GGML_TYPE_F32;
+    std::string conv_engine;
+    std::string fname_conv_tune;
+    bool sparse           = false;
+    float sparse_margin   = 2.0f;
+    int panel_tile        = 0;
+};
+
+// pixel counts for one threshold, accumulated over the dataset
+struct unet_eval_counts {
+    int64_t tp = 0;
+    int64_t fp = 0;
+    int64_t fn = 0;
+    double  iou_sum = 0.0;  // sum of per-image IoU
+};
+
+static void unet_eval_print_usage(char ** argv, const unet_eval_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -m FNAME, --model FNAME\n");
+    fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -i DIR, --inp DIR     directory of input images\n");
+    fprintf(stderr, "  -g DIR, --masks DIR   directory of ground-truth masks, matched by file stem\n");
+    fprintf(stderr, "  -th LIST, --thresh LIST\n");
+    fprintf(stderr, "                        comma-separated thresholds to score (default: 0.05,0.15,0.30,0.50,0.70)\n");
+    fprintf(stderr, "  -t N, --threads N     number of threads (default: %d)\n", params.threads);
+    fprintf(stderr, "  -b N, --batch N       images per graph evaluation (default: %d)\n", params.batch);
+    fprintf(stderr, "  -p T, --precision T   conv kernel precision, f32 or f16 (default: f32)\n");
+    fprintf(stderr, "  -nw, --no-winograd    use im2col for 3x3 convolutions instead of Winograd\n");
+    fprintf(stderr, "  --conv-engine E       im2col, winograd or direct for every conv layer that supports it, or auto (default)\n");
+    fprintf(stderr, "  --conv-tune FNAME     per-layer engines, read when it exists and written by auto (default: MODEL.conv-tune)\n");
+    fprintf(stderr, "  --int8                run the calibrated conv layers in INT8 and compare the masks with F32\n");
+    fprintf(stderr, "  --sparse              also run the region-sparse decoder and compare its masks with the dense ones\n");
+    fprintf(stderr, "  --sparse-margin F     logit margin below the threshold for selecting tiles (default: %.1f)\n", params.sparse_margin);
+    fprintf(stderr, "  --panel N             also run the images as NxN panel tiles and compare the stitched masks with\n");
+    fprintf(stderr, "                        the dense ones\n");
+    fprintf(stderr, "  --ref DIR             compare with reference probability maps in DIR\n");
+    fprintf(stderr, "  --ref-tol T           max abs difference allowed vs. the reference (default: %g)\n", params.ref_tol);
+    fprintf(stderr, "  --save-ref DIR        write the probability maps to DIR as the new reference\n");
+    fprintf(stderr, "\n");
+}
+
+static bool unet_eval_params_parse(int argc, char ** argv, unet_eval_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (i + 1 >= argc && arg != "-h" && arg != "--help" && arg != "-nw" && arg != "--no-winograd" && arg != "--int8" && arg != "--sparse") {
+            fprintf(stderr, "error: missing value for argument: %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") {
+            params.model = argv[++i];
+        } else if (arg == "-i" || arg == "--inp") {
+            params.dir_inp = argv[++i];
+        } else if (arg == "-g" || arg == "--masks") {
+            params.dir_mask = argv[++i];
+        } else if (arg == "-th" || arg == "--thresh") {
+            params.thresholds.clear();
+            std::string list = argv[++i];
+            size_t pos = 0;
+            while (pos < list.size()) {
+                size_t end = list.find(',', pos);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                params.thresholds.push_back(std::stof(list.substr(pos, end - pos)));
+                pos = end + 1;
+            }
+        } else if (arg == "-t" || arg == "--threads") {
+            params.threads = std::stoi(argv[++i]);
+        } else if (arg == "-b" || arg == "--batch") {
+            params.batch = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "-p" || arg == "--precision") {
+            std::string precision = argv[++i];
+            if (precision == "f32") {
+                params.wtype = GGML_TYPE_F32;
+            } else if (precision == "f16") {
+                params.wtype = GGML_TYPE_F16;
+            } else {
+                fprintf(stderr, "error: unknown precision: %s\n", precision.c_str());
+                return false;
+            }
+        } else if (arg == "-nw" || arg == "--no-winograd") {
+            params.winograd = false;
+        } else if (arg == "--conv-engine") {
+            params.conv_engine = argv[++i];
+        } else if (arg == "--conv-tune") {
+            params.fname_conv_tune = argv[++i];
+        } else if (arg == "--int8") {
+            params.int8 = true;
+        } else if (arg == "--sparse") {
+            params.sparse = true;
+        } else if (arg == "--sparse-margin") {
+            params.sparse_margin = std::stof(argv[++i]);
+        } else if (arg == "--panel") {
+            params.panel_tile = std::stoi(argv[++i]);
+        } else if (arg == "--ref") {
+            params.dir_ref = argv[++i];
+        } else if (arg == "--ref-tol") {
+            params.ref_tol = std::stof(argv[++i]);
+        } else if (arg == "--save-ref") {
+            params.dir_save_ref = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            unet_eval_print_usage(argv, params);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            unet_eval_print_usage(argv, params);
+            return false;
+        }
+    }
+    if (params.dir_inp.empty() || params.dir_mask.empty()) {
+        fprintf(stderr, "error: both --inp and --masks are required\n");
+        unet_eval_print_usage(argv, params);
+        return false;
+    }
+    return true;
+}
+
+static bool is_image_file(const std::filesystem::path & path)
+{
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".bmp";
+}
+
+// the mask of "img.jpg" is the first image in dir_mask with stem "img" or "img_mask"
+static std::string find_mask(const std::string & dir_mask, const std::filesystem::path & image)
+{
+    const std::string stem = image.stem().string();
+    for (const char * suffix : { "", "_mask" }) {
+        for (const char * ext : { ".png", ".bmp", ".jpg", ".jpeg" }) {
+            std::filesystem::path path = std::filesystem::path(dir_mask) / (stem + suffix + ext);
+            if (std::filesystem::exists(path)) {
+                return path.string();
+            }
+        }
+    }
+    return "";
+}
+
+static bool load_ref(const std::string & fname, std::vector<float> & probs)
+{
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        return false;
+    }
+    fin.read((char *) probs.data(), probs.size()*sizeof(float));
+    return (size_t) fin.gcount() == probs.size()*sizeof(float);
+}
+
+static bool save_ref(const std::string & fname, const std::vector<float> & probs)
+{
+    std::ofstream fout(fname, std::ios::binary);
+    fout.write((const char *) probs.data(), probs.size()*sizeof(float));
+    return (bool) fout;
+}
+
+int main(int argc, char ** argv)
+{
+    ggml_time_init();
+    unet_model model;
+
+    unet_eval_params params;
+    if (!unet_eval_params_parse(argc, argv, params)) {
+        return 1;
+    }
+    unet_set_verbose(false);
+
+    std::vector<std::filesystem::path> images;
+    for (const auto & entry : std::filesystem::directory_iterator(params.dir_inp)) {
+        if (entry.is_regular_file() && is_image_file(entry.path())) {
+            images.push_back(entry.path());
+        }
+    }
+    std::sort(images.begin(), images.end());
+    if (images.empty()) {
+        fprintf(stderr, "%s: no images found in '%s'\n", __func__, params.dir_inp.c_str());
+        return 1;
+    }
+
+    if (!load_model(params.model, model, params.threads, params.winograd, params.wtype)) {
+        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+
+    if (!unet_setup_conv_engines(model, params.model, params.conv_engine, params.fname_conv_tune)) {
+        return 1;
+    }
+
+    // the F32 baseline of --int8 shares the weights of model, a shallow copy
+    // taken before the INT8 layers are set up and never freed on its own
+    const unet_model model_f32 = model;
+    if (params.int8 && !unet_prepare_int8(model)) {
+        return 1;
+    }
+
+    // the raw logits are read back so every threshold is scored from one inference
+    unet_context uctx;
+    if (!init_context(uctx, model, params.batch, /*keep_logits =*/ true)) {
+        return 1;
+    }
+    unet_context uctx_f32;
+    if (params.int8 && !init_context(uctx_f32, model_f32, params.batch, /*keep_logits =*/ true)) {
+        return 1;
+    }
+    // --sparse and --panel run every image once more per threshold through
+    // detect_defect, their masks are scored against the dense logits of uctx
+    const bool approx = params.sparse || params.panel_tile > 0;
+    const char * approx_name = params.panel_tile > 0 ? (params.sparse ? "panel+sparse" : "panel") : "sparse";
+    unet_context uctx_approx;
+    if (approx) {
+        uctx_approx.sparse_requested = params.sparse;
+        uctx_approx.sparse_margin = params.sparse_margin;
+        if (!init_context(uctx_approx, model)) {
+            return 1;
+        }
+    }
+    struct ggml_cgraph * gf     = uctx.gf;
+    struct ggml_tensor * input  = ggml_graph_get_tensor(gf, "input");
+    struct ggml_tensor * logits = ggml_graph_get_tensor(gf, "logits");
+
+    // only the CPU graphs threshold on-graph
+    const float logit_thresh = unet_logit(0.5f);
+    for (struct ggml_cgraph * g : { gf, uctx_f32.gf }) {
+        struct ggml_tensor * thresh_input = g ? ggml_graph_get_tensor(g, "logit_thresh") : NULL;
+        if (thresh_input) {
+            ggml_backend_tensor_set(thresh_input, &logit_thresh, 0, sizeof(float));
+        }
+    }
+
+    const int n_pixels = model.width*model.height;
+    const int n_thresh = params.thresholds.size();
+
+    std::vector<unet_eval_counts> counts(n_thresh);
+    // INT8 masks scored against the F32 masks instead of the ground truth
+    std::vector<unet_eval_counts> counts_f32(n_thresh);
+    // approximate masks scored against the ground truth and against the dense masks
+    std::vector<unet_eval_counts> counts_approx(n_thresh);
+    std::vector<unet_eval_counts> counts_dense(n_thresh);
+    std::vector<float> batch_logits_f32;
+    std::vector<float> batch_input((size_t)n_pixels*3*params.batch, 0.0f);
+    std::vector<float> batch_logits((size_t)n_pixels*params.batch);
+    std::vector<std::vector<uint8_t>> batch_masks(params.batch);
+    std::vector<std::string> batch_names(params.batch);
+    std::vector<std::string> batch_files(params.batch);
+    std::vector<float> probs(n_pixels);
+    std::vector<float> ref(n_pixels);
+    unet_image_u8 mask;
+    unet_image sized_mask;
+    unet_image sized_approx;
+
+    int n_images = 0;
+    int n_skipped = 0;
+    int n_ref = 0;
+    int n_ref_fail = 0;
+    float ref_max_diff = 0.0f;
+    int64_t t_infer_us = 0;
+    int64_t t_infer_f32_us = 0;
+    int64_t t_approx_us = 0;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    for (size_t idx = 0; idx < images.size(); ) {
+        // gather a batch of letterboxed images and their masks
+        int n_batch = 0;
+        for (; idx < images.size() && n_batch < params.batch; idx++) {
+            const std::string fname_mask = find_mask(params.dir_mask, images[idx]);
+            unet_image_u8 & img = uctx.pool.decoded;
+            if (fname_mask.empty() || !load_unet_image(images[idx].string().c_str(), img, &uctx.pool) || !load_unet_image(fname_mask.c_str(), mask, &uctx.pool)) {
+                fprintf(stderr, "%s: skipping '%s' (image or mask not readable)\n", __func__, images[idx].string().c_str());
+                n_skipped++;
+                continue;
+            }
+
+            letterbox_image_unet(img, uctx.sized, model.width, model.height, uctx.pool);
+            std::copy(uctx.sized.data.begin(), uctx.sized.data.end(), batch_input.begin() + (size_t)n_batch*n_pixels*3);
+
+            // the mask is letterboxed like the input, the padding counts as background
+            letterbox_image_unet(mask, sized_mask, model.width, model.height, uctx.pool);
+            batch_masks[n_batch].resize(n_pixels);
+            for (int i = 0; i < n_pixels; i++) {
+                batch_masks[n_batch][i] = sized_mask.data[i] > 127.5f;
+            }
+            batch_names[n_batch] = images[idx].stem().string();
+            batch_files[n_batch] = images[idx].string();
+            n_batch++;
+        }
+        if (n_batch == 0) {
+            continue;
+        }
+
+        const int64_t t_infer_start_us = ggml_time_us();
+        ggml_backend_tensor_set(input, batch_input.data(), 0, ggml_nbytes(input));
+        if (ggml_backend_graph_compute(model.backend, gf) != GGML_STATUS_SUCCESS) {
+            fprintf(stderr, "%s: ggml_backend_graph_compute() failed\n", __func__);
+            return 1;
+        }
+        ggml_backend_tensor_get(logits, batch_logits.data(), 0, ggml_nbytes(logits));
+        t_infer_us += ggml_time_us() - t_infer_start_us;
+
+        if (params.int8) {
+            const int64_t t_f32_start_us = ggml_time_us();
+            ggml_backend_tensor_set(ggml_graph_get_tensor(uctx_f32.gf, "input"), batch_input.data(), 0, ggml_nbytes(input));
+            if (ggml_backend_graph_compute(model.backend, uctx_f32.gf) != GGML_STATUS_SUCCESS) {
+                fprintf(stderr, "%s: ggml_backend_graph_compute() failed\n", __func__);
+                return 1;
+            }
+            batch_logits_f32.resize(batch_logits.size());
+            ggml_backend_tensor_get(ggml_graph_get_tensor(uctx_f32.gf, "logits"), batch_logits_f32.data(), 0, ggml_nbytes(logits));
+            t_infer_f32_us += ggml_time_us() - t_f32_start_us;
+        }
+
+        for (int b = 0; b < n_batch; b++) {
+            const float * l = batch_logits.data() + (size_t)b*n_pixels;
+            for (int i = 0; i < n_pixels; i++) {
+                probs[i] = 1.0f/(1.0f + std::exp(-l[i]));
+            }
+
+            for (int k = 0; k < n_thresh; k++) {
+                const float t = params.thresholds[k];
+                int64_t tp = 0, fp = 0, fn = 0;
+                for (int i = 0; i < n_pixels; i++) {
+                    const bool pred  = probs[i] >= t;
+                    const bool truth = batch_masks[b][i];
+                    tp += pred && truth;
+                    fp += pred && !truth;
+                    fn += !pred && truth;
+                }
+                counts[k].tp += tp;
+                counts[k].fp += fp;
+                counts[k].fn += fn;
+                // an empty prediction of an empty mask is a perfect match
+                counts[k].iou_sum += tp + fp + fn > 0 ? (double) tp/(tp + fp + fn) : 1.0;
+            }
+
+            if (params.int8) {
+                // logits compare like probabilities, the sigmoid is monotonic
+                const float * l_f32 = batch_logits_f32.data() + (size_t)b*n_pixels;
+                for (int k = 0; k < n_thresh; k++) {
+                    const float lt = unet_logit(params.thresholds[k]);
+                    int64_t tp = 0, fp = 0, fn = 0;
+                    for (int i = 0; i < n_pixels; i++) {
+                        const bool pred  = l[i] >= lt;
+                        const bool truth = l_f32[i] >= lt;
+                        tp += pred && truth;
+                        fp += pred && !truth;
+                        fn += !pred && truth;
+                    }
+                    counts_f32[k].tp += tp;
+                    counts_f32[k].fp += fp;
+                    counts_f32[k].fn += fn;
+                    counts_f32[k].iou_sum += tp + fp + fn > 0 ? (double) tp/(tp + fp + fn) : 1.0;
+                }
+            }
+
+            if (approx) {
+                unet_image_u8 & frame = uctx_approx.pool.decoded;
+                if (params.panel_tile == 0 && !load_unet_image(batch_files[b].c_str(), frame, &uctx_approx.pool)) {
+                    fprintf(stderr, "%s: failed to reload '%s'\n", __func__, batch_files[b].c_str());
+                    return 1;
+                }
+                for (int k = 0; k < n_thresh; k++) {
+                    const int64_t t_approx_start_us = ggml_time_us();
+                    if (params.panel_tile > 0) {
+                        unet_result res;
+                        if (!detect_defect_panel(uctx_approx, model, batch_files[b].c_str(), params.panel_tile, params.thresholds[k], res)) {
+                            fprintf(stderr, "%s: failed to run '%s' as a panel\n", __func__, batch_files[b].c_str());
+                            return 1;
+                        }
+                        t_approx_us += ggml_time_us() - t_approx_start_us;
+                        // the stitched mask has the aspect of the image, letterboxed like the ground truth
+                        letterbox_image_unet(uctx_approx.panel, sized_approx, model.width, model.height, uctx_approx.pool);
+                    } else {
+                        detect_defect(uctx_approx, model, frame, params.thresholds[k]);
+                        t_approx_us += ggml_time_us() - t_approx_start_us;
+                        sized_approx.resize(model.width, model.height, 1);
+                        std::copy(uctx_approx.result.data.begin(), uctx_approx.result.data.end(), sized_approx.data.begin());
+                    }
+
+                    const float lt = unet_logit(params.thresholds[k]);
+                    int64_t tp = 0, fp = 0, fn = 0;
+                    int64_t tp_d = 0, fp_d = 0, fn_d = 0;
+                    for (int i = 0; i < n_pixels; i++) {
+                        const bool pred  = sized_approx.data[i] > 127.5f;
+                        const bool truth = batch_masks[b][i];
+                        const bool dense = l[i] >= lt;
+                        tp += pred && truth;
+                        fp += pred && !truth;
+                        fn += !pred && truth;
+                        tp_d += pred && dense;
+                        fp_d += pred && !dense;
+                        fn_d += !pred && dense;
+                    }
+                    counts_approx[k].tp += tp;
+                    counts_approx[k].fp += fp;
+                    counts_approx[k].fn += fn;
+                    counts_approx[k].iou_sum += tp + fp + fn > 0 ? (double) tp/(tp + fp + fn) : 1.0;
+                    counts_dense[k].tp += tp_d;
+                    counts_dense[k].fp += fp_d;
+                    counts_dense[k].fn += fn_d;
+                    counts_dense[k].iou_sum += tp_d + fp_d + fn_d > 0 ? (double) tp_d/(tp_d + fp_d + fn_d) : 1.0;
+                }
+            }
+
+            if (!params.dir_ref.empty()) {
+                const std::string fname_ref = (std::filesystem::path(params.dir_ref) / (batch_names[b] + ".bin")).string();
+                if (!load_ref(fname_ref, ref)) {
+                    fprintf(stderr, "%s: missing reference '%s'\n", __func__, fname_ref.c_str());
+                    n_ref_fail++;
+                } else {
+                    float max_diff = 0.0f;
+                    for (int i = 0; i < n_pixels; i++) {
+                        max_diff = std::max(max_diff, std::fabs(probs[i] - ref[i]));
+                    }
+                    ref_max_diff = std::max(ref_max_diff, max_diff);
+                    if (max_diff > params.ref_tol) {
+                        fprintf(stderr, "%s: '%s' differs from the reference by %g\n", __func__, batch_names[b].c_str(), max_diff);
+                        n_ref_fail++;
+                    }
+                    n_ref++;
+                }
+            }
+
+            if (!params.dir_save_ref.empty()) {
+                const std::string fname_ref = (std::filesystem::path(params.dir_save_ref) / (batch_names[b] + ".bin")).string();
+                if (!save_ref(fname_ref, probs)) {
+                    fprintf(stderr, "%s: failed to write reference '%s'\n", __func__, fname_ref.c_str());
+                    return 1;
+                }
+            }
+
+            n_images++;
+        }
+    }
+
+    const int64_t t_total_us = ggml_time_us() - t_start_us;
+
+    printf("\n");
+    printf("images: %d (skipped %d), threads: %d, batch: %d, precision: %s, winograd: %s\n",
+            n_images, n_skipped, params.threads, params.batch, params.int8 ? "int8" : params.wtype == GGML_TYPE_F16 ? "f16" : "f32", params.winograd ? "on" : "off");
+    printf("\n");
+    printf("thresh   precision   recall      IoU     Dice   mean IoU\n");
+    for (int k = 0; k < n_thresh; k++) {
+        const unet_eval_counts & c = counts[k];
+        const double precision = c.tp + c.fp > 0 ? (double) c.tp/(c.tp + c.fp) : 1.0;
+        const double recall    = c.tp + c.fn > 0 ? (double) c.tp/(c.tp + c.fn) : 1.0;
+        const double iou       = c.tp + c.fp + c.fn > 0 ? (double) c.tp/(c.tp + c.fp + c.fn) : 1.0;
+        const double dice      = c.tp + c.fp + c.fn > 0 ? (double) 2*c.tp/(2*c.tp + c.fp + c.fn) : 1.0;
+        const double mean_iou  = n_images > 0 ? c.iou_sum/n_images : 0.0;
+        printf("%6.2f   %9.4f   %6.4f   %6.4f   %6.4f   %8.4f\n", params.thresholds[k], precision, recall, iou, dice, mean_iou);
+    }
+    printf("\n");
+    printf("inference: %.2f images/sec (%.2f ms/image)\n", n_images*1e6/std::max<int64_t>(t_infer_us, 1), t_infer_us/1000.0/std::max(n_images, 1));
+    printf("end-to-end: %.2f images/sec\n", n_images*1e6/std::max<int64_t>(t_total_us, 1));
+
+    if (!params.dir_ref.empty()) {
+        printf("reference: %d compared, %d failed, max abs diff %g (tolerance %g)\n", n_ref, n_ref_fail, ref_max_diff, params.ref_tol);
+    }
+
+    if (params.int8) {
+        printf("\n");
+        printf("int8 vs f32 masks (%s kernel):\n", unet_conv_2d_int8_kernel_name());
+        printf("thresh      IoU   mean IoU\n");
+        for (int k = 0; k < n_thresh; k++) {
+            const unet_eval_counts & c = counts_f32[k];
+            const double iou      = c.tp + c.fp + c.fn > 0 ? (double) c.tp/(c.tp + c.fp + c.fn) : 1.0;
+            const double mean_iou = n_images > 0 ? c.iou_sum/n_images : 0.0;
+            printf("%6.2f   %6.4f   %8.4f\n", params.thresholds[k], iou, mean_iou);
+        }
+        printf("f32 inference: %.2f ms/image, int8 speedup %.2fx\n", t_infer_f32_us/1000.0/std::max(n_images, 1),
+                (double) t_infer_f32_us/std::max<int64_t>(t_infer_us, 1));
+    }
+
+    if (approx) {
+        printf("\n");
+        printf("%s vs dense masks:\n", approx_name);
+        printf("thresh   IoU (truth)   IoU (dense)   mean IoU (dense)\n");
+        for (int k = 0; k < n_thresh; k++) {
+            const unet_eval_counts & a = counts_approx[k];
+            const unet_eval_counts & d = counts_dense[k];
+            const double iou       = a.tp + a.fp + a.fn > 0 ? (double) a.tp/(a.tp + a.fp + a.fn) : 1.0;
+            const double iou_dense = d.tp + d.fp + d.fn > 0 ? (double) d.tp/(d.tp + d.fp + d.fn) : 1.0;
+            const double mean_iou  = n_images > 0 ? d.iou_sum/n_images : 0.0;
+            printf("%6.2f   %11.4f   %11.4f   %16.4f\n", params.thresholds[k], iou, iou_dense, mean_iou);
+        }
+        printf("%s inference: %.2f ms/image per threshold (dense %.2f ms/image)\n", approx_name,
+                t_approx_us/1000.0/std::max(n_images*n_thresh, 1), t_infer_us/1000.0/std::max(n_images, 1));
+        free_context(uctx_approx);
+    }
+
+    if (params.int8) {
+        free_context(uctx_f32);
+    }
+    free_context(uctx);
+    free_model(model);
+
+    return n_ref_fail > 0 ? 2 : 0;
+}
@@ -1,20 +1,89 @@
+#include "unet-image.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+// stb_image allocations go to the arena of the pool that is currently loading
+static thread_local unet_image_pool * g_stbi_pool = NULL;
+
+static bool unet_stbi_in_arena(const void * p)
+{
+    return g_stbi_pool && p >= (const void *) g_stbi_pool->arena.data() && p < (const void *) (g_stbi_pool->arena.data() + g_stbi_pool->arena.size());
+}
+
+static void * unet_stbi_malloc(size_t size)
+{
+    if (!g_stbi_pool) {
+        return malloc(size);
+    }
+    unet_image_pool & pool = *g_stbi_pool;
+    const size_t offset = (pool.arena_used + 15) & ~(size_t)15;
+    pool.arena_used = offset + size;
+    pool.arena_peak = std::max(pool.arena_peak, pool.arena_used);
+    if (pool.arena_used > pool.arena.size()) {
+        // the arena grows to the peak on the next load
+        return malloc(size);
+    }
+    return pool.arena.data() + offset;
+}
+
+static void * unet_stbi_realloc(void * p, size_t old_size, size_t new_size)
+{
+    if (!p) {
+        return unet_stbi_malloc(new_size);
+    }
+    if (!unet_stbi_in_arena(p)) {
+        if (g_stbi_pool) {
+            g_stbi_pool->arena_peak = std::max(g_stbi_pool->arena_peak, g_stbi_pool->arena_used + new_size);
+        }
+        return realloc(p, new_size);
+    }
+    void * q = unet_stbi_malloc(new_size);
+    if (q) {
+        memcpy(q, p, std::min(old_size, new_size));
+    }
+    return q;
+}
+
+static void unet_stbi_free(void * p)
+{
+    if (!unet_stbi_in_arena(p)) {
+        free(p);
+    }
+}
+
+#define STBI_MALLOC(size)                         unet_stbi_malloc(size)
+#define STBI_REALLOC_SIZED(p, old_size, new_size) unet_stbi_realloc(p, old_size, new_size)
+#define STBI_FREE(p)                              unet_stbi_free(p)
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-#include "unet-image.h"
-
-bool save_unet_image(const unet_image & im, const char *name, int quality)
+template <typename T>
+bool save_unet_image(const unet_image_t<T> & im, const char *name, int quality, unet_image_pool * pool)
 {
-    uint8_t *data = (uint8_t*)calloc(im.w*im.h*im.c, sizeof(uint8_t));
-    for (int k = 0; k < im.c; ++k) {
-        for (int i = 0; i < im.w*im.h; ++i) {
-            data[i*im.c+k] = (uint8_t) (im.data[i + k*im.w*im.h]);
+    std::vector<uint8_t> local;
+    std::vector<uint8_t> & interleaved = pool ? pool->interleaved : local;
+
+    const uint8_t * data;
+    if (std::is_same<T, uint8_t>::value && im.c == 1) {
+        // a single plane is already interleaved
+        data = (const uint8_t *) im.data.data();
+    } else {
+        interleaved.resize(im.w*im.h*im.c);
+        for (int k = 0; k < im.c; ++k) {
+            for (int i = 0; i < im.w*im.h; ++i) {
+                interleaved[i*im.c+k] = (uint8_t) (im.data[i + k*im.w*im.h]);
+            }
         }
+        data = interleaved.data();
     }
     int success = stbi_write_jpg(name, im.w, im.h, im.c, data, quality);
-    free(data);
     if (!success) {
         fprintf(stderr, "Failed to write image %s\n", name);
         return false;
@@ -22,35 +91,79 @@ bool save_unet_image(const unet_image & im, const char *name, int quality)
     return true;
 }
 
-bool load_unet_image(const char *fname, unet_image & img)
+// the stb_image result, interleaved 8 bit, to a planar image
+template <typename T>
+static bool unet_image_from_stbi(uint8_t * data, int w, int h, unet_image_t<T> & img)
 {
-    int w, h, c;
-    uint8_t * data = stbi_load(fname, &w, &h, &c, 3);
     if (!data) {
+        g_stbi_pool = NULL;
         return false;
     }
-    c = 3;
-    img.w = w;
-    img.h = h;
-    img.c = c;
-    img.data.resize(w*h*c);
+    int c = 3;
+    img.resize(w, h, c);
     for (int k = 0; k < c; ++k){
         for (int j = 0; j < h; ++j){
             for (int i = 0; i < w; ++i){
                 int dst_index = i + w*j + w*h*k;
                 int src_index = k + c*i + c*w*j;
-                img.data[dst_index] = (float)data[src_index];
+                img.data[dst_index] = (T)data[src_index];
             }
         }
     }
     stbi_image_free(data);
+    g_stbi_pool = NULL;
     return true;
 }
 
-static unet_image resize_image(const unet_image & im, int w, int h)
+static void unet_stbi_begin(unet_image_pool * pool)
+{
+    if (pool) {
+        if (pool->arena.size() < pool->arena_peak) {
+            pool->arena.resize(pool->arena_peak);
+        }
+        pool->arena_used = 0;
+        g_stbi_pool = pool;
+    }
+}
+
+template <typename T>
+bool load_unet_image(const char *fname, unet_image_t<T> & img, unet_image_pool * pool)
+{
+    unet_stbi_begin(pool);
+    int w, h, c;
+    uint8_t * data = stbi_load(fname, &w, &h, &c, 3);
+    return unet_image_from_stbi(data, w, h, img);
+}
+
+template <typename T>
+bool load_unet_image_from_memory(const uint8_t * buf, size_t size, unet_image_t<T> & img, unet_image_pool * pool)
+{
+    unet_stbi_begin(pool);
+    int w, h, c;
+    uint8_t * data = stbi_load_from_memory(buf, (int) size, &w, &h, &c, 3);
+    return unet_image_from_stbi(data, w, h, img);
+}
+
+bool read_unet_file(const char * fname, std::vector<uint8_t> & buf)
+{
+    FILE * f = fopen(fname, "rb");
+    if (!f) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf.resize(size > 0 ? size : 0);
+    const bool ok = size >= 0 && fread(buf.data(), 1, buf.size(), f) == buf.size();
+    fclose(f);
+    return ok;
+}
+
+template <typename T>
+static void resize_image(const unet_image_t<T> & im, unet_image & resized, int w, int h, unet_image & part)
 {
-    unet_image resized(w, h, im.c);
-    unet_image part(w, im.h, im.c);
+    resized.resize(w, h, im.c);
+    part.resize(w, im.h, im.c);
     float w_scale = (float)(im.w - 1) / (w - 1);
     float h_scale = (float)(im.h - 1) / (h - 1);
     for (int k = 0; k < im.c; ++k){
@@ -85,7 +198,6 @@ static unet_image resize_image(const unet_image & im, int w, int h)
             }
         }
     }
-    return resized;
 }
 
 static void embed_image(const unet_image & source, unet_image & dest, int dx, int dy)
@@ -100,7 +212,8 @@ static void embed_image(const unet_image & source, unet_image & dest, int dx, in
     }
 }
 
-unet_image letterbox_image_unet(const unet_image & im, int w, int h)
+template <typename T>
+void letterbox_image_unet(const unet_image_t<T> & im, unet_image & boxed, int w, int h, unet_image_pool & pool)
 {
     int new_w = im.w;
     int new_h = im.h;
@@ -111,9 +224,119 @@ unet_image letterbox_image_unet(const unet_image & im, int w, int h)
         new_h = h;
         new_w = (im.w * h)/im.h;
     }
-    unet_image resized = resize_image(im, new_w, new_h);
-    unet_image boxed(w, h, im.c);
+    resize_image(im, pool.resized, new_w, new_h, pool.part);
+    boxed.resize(w, h, im.c);
     boxed.fill(0.5);
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2);
+    embed_image(pool.resized, boxed, (w-new_w)/2, (h-new_h)/2);
+}
+
+unet_image letterbox_image_unet(const unet_image & im, int w, int h)
+{
+    unet_image_pool pool;
+    unet_image boxed;
+    letterbox_image_unet(im, boxed, w, h, pool);
     return boxed;
-}
\ No newline at end of file
+}
+
+// next header token of a PNM file, skipping whitespace and comments
+static bool unet_pnm_read_int(FILE * f, int & val)
+{
+    int ch = fgetc(f);
+    while (ch == '#' || isspace(ch)) {
+        if (ch == '#') {
+            while (ch != '\n' && ch != EOF) {
+                ch = fgetc(f);
+            }
+        }
+        ch = fgetc(f);
+    }
+    if (!isdigit(ch)) {
+        return false;
+    }
+    val = 0;
+    while (isdigit(ch)) {
+        val = val*10 + (ch - '0');
+        ch = fgetc(f);
+    }
+    // a single whitespace ends the token, the pixel data follows the last one
+    return isspace(ch);
+}
+
+bool unet_image_reader_open(unet_image_reader & reader, const char * fname)
+{
+    unet_image_reader_close(reader);
+
+    reader.f = fopen(fname, "rb");
+    if (!reader.f) {
+        return false;
+    }
+    char magic[2];
+    int maxval = 0;
+    if (fread(magic, 1, 2, reader.f) == 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6') &&
+        unet_pnm_read_int(reader.f, reader.w) && unet_pnm_read_int(reader.f, reader.h) &&
+        unet_pnm_read_int(reader.f, maxval) && maxval == 255 && reader.w > 0 && reader.h > 0) {
+        reader.channels = magic[1] == '6' ? 3 : 1;
+        reader.line.resize((size_t) reader.w*reader.channels);
+        return true;
+    }
+    fclose(reader.f);
+    reader.f = NULL;
+
+    // 16 bit PNM and the formats stb_image decodes in one go
+    int c;
+    reader.decoded = stbi_load(fname, &reader.w, &reader.h, &c, 3);
+    return reader.decoded != NULL;
+}
+
+void unet_image_reader_close(unet_image_reader & reader)
+{
+    if (reader.f) {
+        fclose(reader.f);
+    }
+    if (reader.decoded) {
+        stbi_image_free(reader.decoded);
+    }
+    reader = unet_image_reader();
+}
+
+int unet_image_reader_read(unet_image_reader & reader, unet_image_u8 & strip, int n_rows)
+{
+    n_rows = std::min(n_rows, reader.h - reader.row);
+    if (n_rows <= 0) {
+        return 0;
+    }
+    const size_t plane = (size_t) reader.w*n_rows;
+    strip.resize(reader.w, n_rows, 3);
+    for (int j = 0; j < n_rows; ++j) {
+        const uint8_t * src;
+        int c = 3;
+        if (reader.f) {
+            if (fread(reader.line.data(), 1, reader.line.size(), reader.f) != reader.line.size()) {
+                fprintf(stderr, "%s: unexpected end of file at row %d\n", __func__, reader.row + j);
+                return -1;
+            }
+            src = reader.line.data();
+            c = reader.channels;
+        } else {
+            src = reader.decoded + (size_t) (reader.row + j)*reader.w*3;
+        }
+        for (int k = 0; k < 3; ++k) {
+            uint8_t * dst = strip.data.data() + k*plane + (size_t) j*reader.w;
+            const int ks = c == 3 ? k : 0;
+            for (int i = 0; i < reader.w; ++i) {
+                dst[i] = src[i*c + ks];
+            }
+        }
+    }
+    reader.row += n_rows;
+    return n_rows;
+}
+
+template bool load_unet_image(const char *fname, unet_image & img, unet_image_pool * pool);
+template bool load_unet_image(const char *fname, unet_image_u8 & img, unet_image_pool * pool);
+template bool load_unet_image_from_memory(const uint8_t * buf, size_t size, unet_image & img, unet_image_pool * pool);
+template bool load_unet_image_from_memory(const uint8_t * buf, size_t size, unet_image_u8 & img, unet_image_pool * pool);
+template void letterbox_image_unet(const unet_image & im, unet_image & boxed, int w, int h, unet_image_pool & pool);
+template void letterbox_image_unet(const unet_image_u8 & im, unet_image & boxed, int w, int h, unet_image_pool & pool);
+template bool save_unet_image(const unet_image & im, const char *name, int quality, unet_image_pool * pool);
+template bool save_unet_image(const unet_image_u8 & im, const char *name, int quality, unet_image_pool * pool);
@@ -3,35 +3,94 @@
 #include <string>
 #include <vector>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
 
-struct unet_image {
+// planar image, pixel (x, y, c) is data[c*w*h + y*w + x]
+template <typename T>
+struct unet_image_t {
     int w, h, c;
-    std::vector<float> data;
+    std::vector<T> data;
 
-    unet_image() : w(0), h(0), c(0) {}
-    unet_image(int w, int h, int c) : w(w), h(h), c(c), data(w*h*c) {}
+    unet_image_t() : w(0), h(0), c(0) {}
+    unet_image_t(int w, int h, int c) : w(w), h(h), c(c), data(w*h*c) {}
 
-    float get_pixel(int x, int y, int c) const {
+    T get_pixel(int x, int y, int c) const {
         assert(x >= 0 && x < w && y >= 0 && y < h && c >= 0 && c < this->c);
         return data[c*w*h + y*w + x];
     }
 
-    void set_pixel(int x, int y, int c, float val) {
+    void set_pixel(int x, int y, int c, T val) {
         assert(x >= 0 && x < w && y >= 0 && y < h && c >= 0 && c < this->c);
         data[c*w*h + y*w + x] = val;
     }
 
-    void add_pixel(int x, int y, int c, float val) {
+    void add_pixel(int x, int y, int c, T val) {
         assert(x >= 0 && x < w && y >= 0 && y < h && c >= 0 && c < this->c);
         data[c*w*h + y*w + x] += val;
     }
 
-    void fill(float val) {
+    void fill(T val) {
         std::fill(data.begin(), data.end(), val);
     }
+
+    // keeps the storage, only allocates when the image grows past its capacity
+    void resize(int w, int h, int c) {
+        this->w = w;
+        this->h = h;
+        this->c = c;
+        data.resize(w*h*c);
+    }
 };
 
-bool load_unet_image(const char *fname, unet_image & img);
+typedef unet_image_t<float>   unet_image;
+typedef unet_image_t<uint8_t> unet_image_u8;
+
+// scratch buffers reused across frames, once they have grown to the largest
+// frame the steady state does no heap allocations
+struct unet_image_pool {
+    // bump arena for the stb_image decoder, reset on every load
+    std::vector<uint8_t> arena;
+    size_t arena_used = 0;
+    size_t arena_peak = 0;
+
+    unet_image_u8 decoded;
+    unet_image    part;
+    unet_image    resized;
+    std::vector<uint8_t> interleaved;
+    std::vector<uint8_t> file;  // raw bytes of the input when they are hashed
+};
+
+template <typename T>
+bool load_unet_image(const char *fname, unet_image_t<T> & img, unet_image_pool * pool = NULL);
+template <typename T>
+bool load_unet_image_from_memory(const uint8_t * buf, size_t size, unet_image_t<T> & img, unet_image_pool * pool = NULL);
+bool read_unet_file(const char * fname, std::vector<uint8_t> & buf);
+
+template <typename T>
+void letterbox_image_unet(const unet_image_t<T> & im, unet_image & boxed, int w, int h, unet_image_pool & pool);
 unet_image letterbox_image_unet(const unet_image & im, int w, int h);
-bool save_unet_image(const unet_image & im, const char *name, int quality);
 
+template <typename T>
+bool save_unet_image(const unet_image_t<T> & im, const char *name, int quality, unet_image_pool * pool = NULL);
+
+// reads an image top to bottom in strips of rows. Binary PNM (P5/P6) is
+// streamed from the file so only the strip is in memory, other formats are
+// decoded whole by stb_image and kept interleaved as 8 bit
+struct unet_image_reader {
+    int w = 0;
+    int h = 0;
+    int row = 0;    // next row to read
+
+    FILE * f = NULL;
+    int channels = 0;
+    std::vector<uint8_t> line;
+
+    uint8_t * decoded = NULL;
+};
+
+bool unet_image_reader_open(unet_image_reader & reader, const char * fname);
+void unet_image_reader_close(unet_image_reader & reader);
+
+// reads up to n_rows rows into a planar 3 channel strip, returns the number of rows read, -1 on error
+int unet_image_reader_read(unet_image_reader & reader, unet_image_u8 & strip, int n_rows);
@@ -0,0 +1,1826 @@
+#include "unet.h"
+
+#include <map>
+#include <sstream>
+#include <thread>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool g_verbose = true;
+
+void unet_set_verbose(bool verbose)
+{
+    g_verbose = verbose;
+}
+
+// tensors derived from the loaded weights: Winograd-transformed 3x3 kernels,
+// F16 copies of the remaining kernels and the bias and batch norm folded into
+// a per-channel scale and shift, all kept in model.ctx_repack
+static void load_repacked_kernels(unet_model & model, bool winograd, enum ggml_type wtype, bool fuse)
+{
+    std::vector<unet_conv2d_layer *> layers_wino;
+    std::vector<unet_conv2d_layer *> layers_f16;
+    std::vector<unet_conv2d_layer *> layers_epilogue;
+    // convert.py writes the Winograd kernels and epilogues to the file, mapped
+    // they are shared by all processes. A mapped model without them skips the
+    // private Winograd copies, mapping is for jobs that run many workers
+    int n_wino_file = 0;
+    int n_wino_skipped = 0;
+    for (auto & layer : model.conv2d_layers) {
+        const ggml_tensor * w = layer.weights;
+        if (w && layer.biases) {
+            layer.epilogue = ggml_get_tensor(model.ctx, (layer.name_conv + "/epilogue").c_str());
+            if (layer.epilogue) {
+                layer.fused_epilogue = fuse;
+            } else {
+                layers_epilogue.push_back(&layer);
+            }
+        }
+        if (!w || w->type != GGML_TYPE_F32) {
+            continue;
+        }
+        if (winograd && w->ne[0] == 3 && w->ne[1] == 3 && layer.strike == 1 && layer.padding == 1 && layer.pad_end[0] == 0 && layer.pad_end[1] == 0) {
+            layer.weights_wino = ggml_get_tensor(model.ctx, (layer.name_conv + "/kernel_wino").c_str());
+            if (layer.weights_wino) {
+                n_wino_file++;
+            } else if (model.mapping) {
+                n_wino_skipped++;
+            } else {
+                layers_wino.push_back(&layer);
+            }
+        } else if (wtype == GGML_TYPE_F16) {
+            layers_f16.push_back(&layer);
+        }
+    }
+    if (n_wino_skipped > 0) {
+        fprintf(stderr, "%s: %d layers run im2col, convert the model again to map their Winograd kernels\n", __func__, n_wino_skipped);
+    }
+    if (layers_wino.empty() && layers_f16.empty() && layers_epilogue.empty()) {
+        fprintf(stderr, "%s: %d layers use Winograd F(2x2,3x3) (mapped from the file)\n", __func__, n_wino_file);
+        return;
+    }
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead() * (layers_wino.size() + layers_f16.size() + layers_epilogue.size()),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    model.ctx_repack = ggml_init(params);
+    for (auto * layer : layers_wino) {
+        const int n_in  = layer->weights->ne[2];
+        const int n_out = layer->weights->ne[3];
+        layer->weights_wino = ggml_new_tensor_3d(model.ctx_repack, GGML_TYPE_F32, n_out, n_in, 16);
+        ggml_format_name(layer->weights_wino, "%s/kernel_wino", layer->name_conv.c_str());
+    }
+    for (auto * layer : layers_f16) {
+        layer->weights_f16 = ggml_new_tensor(model.ctx_repack, GGML_TYPE_F16, 4, layer->weights->ne);
+        ggml_format_name(layer->weights_f16, "%s/kernel_f16", layer->name_conv.c_str());
+    }
+    for (auto * layer : layers_epilogue) {
+        layer->epilogue = ggml_new_tensor_4d(model.ctx_repack, GGML_TYPE_F32, 1, 1, layer->weights->ne[3], 2);
+        ggml_format_name(layer->epilogue, "%s/epilogue", layer->name_conv.c_str());
+        layer->fused_epilogue = fuse;
+    }
+    model.buffer_repack = ggml_backend_alloc_ctx_tensors(model.ctx_repack, model.backend);
+
+    std::vector<float> kernel;
+    std::vector<float> transformed;
+    for (auto * layer : layers_wino) {
+        const int n_in  = layer->weights->ne[2];
+        const int n_out = layer->weights->ne[3];
+        kernel.resize(ggml_nelements(layer->weights));
+        transformed.resize(ggml_nelements(layer->weights_wino));
+        ggml_backend_tensor_get(layer->weights, kernel.data(), 0, ggml_nbytes(layer->weights));
+        unet_winograd_transform_kernel(kernel.data(), transformed.data(), n_in, n_out);
+        ggml_backend_tensor_set(layer->weights_wino, transformed.data(), 0, ggml_nbytes(layer->weights_wino));
+    }
+
+    std::vector<ggml_fp16_t> kernel_f16;
+    for (auto * layer : layers_f16) {
+        kernel.resize(ggml_nelements(layer->weights));
+        kernel_f16.resize(kernel.size());
+        ggml_backend_tensor_get(layer->weights, kernel.data(), 0, ggml_nbytes(layer->weights));
+        for (size_t i = 0; i < kernel.size(); i++) {
+            kernel_f16[i] = ggml_fp32_to_fp16(kernel[i]);
+        }
+        ggml_backend_tensor_set(layer->weights_f16, kernel_f16.data(), 0, ggml_nbytes(layer->weights_f16));
+    }
+    // ((x + bias - mean)/sqrt(var))*gamma + beta  ==  x*scale + shift
+    std::vector<float> epilogue;
+    std::vector<float> bn[4];
+    for (auto * layer : layers_epilogue) {
+        const int n_out = layer->weights->ne[3];
+        epilogue.resize(2*n_out);
+        ggml_backend_tensor_get(layer->biases, epilogue.data() + n_out, 0, n_out*sizeof(float));
+        for (int i = 0; i < n_out; i++) {
+            epilogue[i] = 1.0f;
+        }
+        if (layer->batch_normalize) {
+            const ggml_tensor * src[4] = { layer->rolling_mean, layer->rolling_variance, layer->scales, layer->beta };
+            for (int k = 0; k < 4; k++) {
+                bn[k].resize(n_out);
+                ggml_backend_tensor_get(src[k], bn[k].data(), 0, n_out*sizeof(float));
+            }
+            for (int i = 0; i < n_out; i++) {
+                const float scale = bn[2][i]/std::sqrt(bn[1][i]);
+                epilogue[i]         = scale;
+                epilogue[n_out + i] = (epilogue[n_out + i] - bn[0][i])*scale + bn[3][i];
+            }
+        }
+        ggml_backend_tensor_set(layer->epilogue, epilogue.data(), 0, ggml_nbytes(layer->epilogue));
+    }
+
+    fprintf(stderr, "%s: %d layers use Winograd F(2x2,3x3) (%d from the file), %d layers use F16 kernels\n", __func__,
+            (int) layers_wino.size() + n_wino_file, n_wino_file, (int) layers_f16.size());
+}
+
+// backbone description read from the GGUF metadata written by convert.py,
+// files without it get the ResNet50 layout of the original model
+struct unet_arch {
+    int width  = 224;
+    int height = 224;
+    bool bottleneck = true;
+    std::vector<int> blocks = { 3, 4, 6, 3 };
+    std::vector<int> skips  = { 3, 2, 1, 0 };
+    std::vector<std::string> decoder = { "conv2d", "conv2d_1", "conv2d_2", "conv2d_3", "conv2d_4", "conv2d_5" };
+    // per conv, taken from the Keras layer configs
+    std::map<std::string, int> strides;
+    std::map<std::string, int> paddings;
+    std::map<std::string, std::vector<int>> pads;   // top, bottom, left, right
+    std::map<std::string, std::string> norms;
+};
+
+static std::vector<int> unet_gguf_get_arr_i32(const gguf_context * gguf_ctx, int key_id)
+{
+    std::vector<int> values(gguf_get_arr_n(gguf_ctx, key_id));
+    const int32_t * data = (const int32_t *) gguf_get_arr_data(gguf_ctx, key_id);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = data[i];
+    }
+    return values;
+}
+
+static std::vector<std::string> unet_gguf_get_arr_strs(const gguf_context * gguf_ctx, int key_id)
+{
+    std::vector<std::string> values(gguf_get_arr_n(gguf_ctx, key_id));
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = gguf_get_arr_str(gguf_ctx, key_id, i);
+    }
+    return values;
+}
+
+#define UNET_KEY_ACT_MIN "unet.int8.act_min."
+#define UNET_KEY_ACT_MAX "unet.int8.act_max."
+
+// input ranges of the conv layers recorded by the INT8 calibration
+static void load_act_ranges(const gguf_context * gguf_ctx, std::map<std::string, std::pair<float, float>> & ranges)
+{
+    const size_t n_min = strlen(UNET_KEY_ACT_MIN);
+    for (int64_t i = 0; i < gguf_get_n_kv(gguf_ctx); i++) {
+        const std::string key = gguf_get_key(gguf_ctx, i);
+        if (key.compare(0, n_min, UNET_KEY_ACT_MIN) != 0) {
+            continue;
+        }
+        const std::string name = key.substr(n_min);
+        const int key_max = gguf_find_key(gguf_ctx, (UNET_KEY_ACT_MAX + name).c_str());
+        if (key_max < 0) {
+            fprintf(stderr, "%s: '%s' has no maximum, ignoring its calibration\n", __func__, name.c_str());
+            continue;
+        }
+        ranges[name] = { gguf_get_val_f32(gguf_ctx, i), gguf_get_val_f32(gguf_ctx, key_max) };
+    }
+}
+
+static bool load_arch(const gguf_context * gguf_ctx, unet_arch & arch)
+{
+    int key;
+    if ((key = gguf_find_key(gguf_ctx, "unet.input_width")) >= 0) {
+        arch.width = gguf_get_val_u32(gguf_ctx, key);
+    }
+    if ((key = gguf_find_key(gguf_ctx, "unet.input_height")) >= 0) {
+        arch.height = gguf_get_val_u32(gguf_ctx, key);
+    }
+    if ((key = gguf_find_key(gguf_ctx, "unet.encoder.block")) >= 0) {
+        const std::string block = gguf_get_val_str(gguf_ctx, key);
+        if (block != "bottleneck" && block != "basic") {
+            fprintf(stderr, "%s: unknown encoder block '%s'\n", __func__, block.c_str());
+            return false;
+        }
+        arch.bottleneck = block == "bottleneck";
+    }
+    if ((key = gguf_find_key(gguf_ctx, "unet.encoder.blocks")) >= 0) {
+        arch.blocks = unet_gguf_get_arr_i32(gguf_ctx, key);
+    }
+    if ((key = gguf_find_key(gguf_ctx, "unet.decoder.skips")) >= 0) {
+        arch.skips = unet_gguf_get_arr_i32(gguf_ctx, key);
+    }
+    if ((key = gguf_find_key(gguf_ctx, "unet.decoder.convs")) >= 0) {
+        arch.decoder = unet_gguf_get_arr_strs(gguf_ctx, key);
+    }
+    if ((key = gguf_find_key(gguf_ctx, "unet.conv.names")) >= 0) {
+        const std::vector<std::string> names = unet_gguf_get_arr_strs(gguf_ctx, key);
+        const int key_strides  = gguf_find_key(gguf_ctx, "unet.conv.strides");
+        const int key_paddings = gguf_find_key(gguf_ctx, "unet.conv.paddings");
+        const int key_norms    = gguf_find_key(gguf_ctx, "unet.conv.norms");
+        if (key_strides < 0 || key_paddings < 0 || key_norms < 0) {
+            fprintf(stderr, "%s: unet.conv.names needs unet.conv.strides, unet.conv.paddings and unet.conv.norms\n", __func__);
+            return false;
+        }
+        const std::vector<int> strides  = unet_gguf_get_arr_i32(gguf_ctx, key_strides);
+        const std::vector<int> paddings = unet_gguf_get_arr_i32(gguf_ctx, key_paddings);
+        const std::vector<std::string> norms = unet_gguf_get_arr_strs(gguf_ctx, key_norms);
+        if (strides.size() != names.size() || paddings.size() != names.size() || norms.size() != names.size()) {
+            fprintf(stderr, "%s: unet.conv.* arrays differ in length\n", __func__);
+            return false;
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            arch.strides[names[i]]  = strides[i];
+            arch.paddings[names[i]] = paddings[i];
+            arch.norms[names[i]]    = norms[i];
+        }
+        // per-side padding, newer files only
+        const int key_pads = gguf_find_key(gguf_ctx, "unet.conv.pads");
+        if (key_pads >= 0) {
+            const std::vector<int> pads = unet_gguf_get_arr_i32(gguf_ctx, key_pads);
+            if (pads.size() != 4*names.size()) {
+                fprintf(stderr, "%s: unet.conv.pads needs four values per conv\n", __func__);
+                return false;
+            }
+            for (size_t i = 0; i < names.size(); i++) {
+                arch.pads[names[i]].assign(pads.begin() + 4*i, pads.begin() + 4*i + 4);
+            }
+        }
+    }
+
+    const int n_stages = arch.blocks.size();
+    if (n_stages == 0 || arch.skips.empty() || arch.decoder.size() != arch.skips.size() + 2) {
+        fprintf(stderr, "%s: %d decoder convs do not match %d skips\n", __func__, (int) arch.decoder.size(), (int) arch.skips.size());
+        return false;
+    }
+    for (int tap : arch.skips) {
+        if (tap < 0 || tap >= n_stages) {
+            fprintf(stderr, "%s: skip tap %d out of range\n", __func__, tap);
+            return false;
+        }
+    }
+    return true;
+}
+
+// appends a conv to the layer table, padding and norm default to Keras 'same'
+// and the <name>_bn naming of the encoder
+static int add_conv_layer(unet_model & model, const unet_arch & arch, const std::string & name, int stride, bool activate, const std::string & name_bn)
+{
+    unet_conv2d_layer layer;
+    layer.name_conv = name;
+    layer.name_bn   = arch.norms.count(name) ? arch.norms.at(name) : name_bn;
+    layer.weights   = ggml_get_tensor(model.ctx, (name + "/kernel:0").c_str());
+    layer.biases    = ggml_get_tensor(model.ctx, (name + "/bias:0").c_str());
+    if (!layer.weights || !layer.biases) {
+        return -1;
+    }
+    layer.strike   = arch.strides.count(name) ? arch.strides.at(name) : stride;
+    layer.padding  = arch.paddings.count(name) ? arch.paddings.at(name) : (int) (layer.weights->ne[0] - 1)/2;
+    if (arch.pads.count(name)) {
+        // the engines pad symmetrically, the rest is added at the end as TensorFlow
+        // does for 'same' with stride 2. More zeros at the start cannot be expressed
+        const std::vector<int> & pads = arch.pads.at(name);
+        layer.padding = *std::min_element(pads.begin(), pads.end());
+        if (pads[0] > layer.padding || pads[2] > layer.padding) {
+            fprintf(stderr, "%s: '%s' pads %d,%d,%d,%d (top, bottom, left, right), only extra padding at the bottom and right is supported\n",
+                    __func__, name.c_str(), pads[0], pads[1], pads[2], pads[3]);
+            return -1;
+        }
+        layer.pad_end[0] = pads[3] - layer.padding;
+        layer.pad_end[1] = pads[1] - layer.padding;
+    }
+    layer.activate = activate;
+    layer.batch_normalize = !layer.name_bn.empty();
+    if (layer.batch_normalize) {
+        layer.scales           = ggml_get_tensor(model.ctx, (layer.name_bn + "/gamma:0").c_str());
+        layer.beta             = ggml_get_tensor(model.ctx, (layer.name_bn + "/beta:0").c_str());
+        layer.rolling_mean     = ggml_get_tensor(model.ctx, (layer.name_bn + "/moving_mean:0").c_str());
+        layer.rolling_variance = ggml_get_tensor(model.ctx, (layer.name_bn + "/moving_variance:0").c_str());
+        if (!layer.scales || !layer.beta || !layer.rolling_mean || !layer.rolling_variance) {
+            fprintf(stderr, "%s: missing batch norm '%s' of '%s'\n", __func__, layer.name_bn.c_str(), name.c_str());
+            return -1;
+        }
+    }
+    model.conv2d_layers.push_back(layer);
+    return (int) model.conv2d_layers.size() - 1;
+}
+
+// Keras naming: conv1_conv is the stem, conv<s+2>_block<b+1>_<k>_conv the
+// encoder, stage s > 0 downsamples in its first block
+static bool build_layer_table(unet_model & model, const unet_arch & arch)
+{
+    model.width  = arch.width;
+    model.height = arch.height;
+    model.skips  = arch.skips;
+    model.conv2d_layers.clear();
+    model.stages.clear();
+
+    if (add_conv_layer(model, arch, "conv1_conv", 2, true, "conv1_bn") != 0) {
+        fprintf(stderr, "%s: missing stem conv1_conv\n", __func__);
+        return false;
+    }
+
+    const int n_convs = arch.bottleneck ? 3 : 2;
+    char name[128];
+    for (int s = 0; s < (int) arch.blocks.size(); s++) {
+        model.stages.emplace_back();
+        for (int b = 0; b < arch.blocks[s]; b++) {
+            const int stride = s > 0 && b == 0 ? 2 : 1;
+            unet_block block;
+            for (int k = 1; k <= n_convs; k++) {
+                snprintf(name, sizeof(name), "conv%d_block%d_%d", s + 2, b + 1, k);
+                const int il = add_conv_layer(model, arch, std::string(name) + "_conv", k == 1 ? stride : 1, k < n_convs, std::string(name) + "_bn");
+                if (il < 0) {
+                    fprintf(stderr, "%s: missing encoder conv %s_conv\n", __func__, name);
+                    return false;
+                }
+                block.convs.push_back(il);
+            }
+            // projection shortcut, if the block has one
+            snprintf(name, sizeof(name), "conv%d_block%d_0", s + 2, b + 1);
+            if (ggml_get_tensor(model.ctx, (std::string(name) + "_conv/kernel:0").c_str())) {
+                block.shortcut = add_conv_layer(model, arch, std::string(name) + "_conv", stride, false, std::string(name) + "_bn");
+                if (block.shortcut < 0) {
+                    fprintf(stderr, "%s: incomplete shortcut conv %s_conv\n", __func__, name);
+                    return false;
+                }
+            }
+            model.stages.back().push_back(block);
+        }
+    }
+
+    for (size_t i = 0; i < arch.decoder.size(); i++) {
+        const bool head = i + 1 == arch.decoder.size();
+        const std::string bn = head ? "" : (i == 0 ? std::string("batch_normalization") : "batch_normalization_" + std::to_string(i));
+        if (add_conv_layer(model, arch, arch.decoder[i], 1, !head, bn) < 0) {
+            fprintf(stderr, "%s: missing decoder conv %s\n", __func__, arch.decoder[i].c_str());
+            return false;
+        }
+    }
+
+    if (g_verbose) {
+        printf("%s: %d stages (%s blocks), %d skips, %d conv layers, input %dx%d\n", __func__, (int) model.stages.size(),
+                arch.bottleneck ? "bottleneck" : "basic", (int) model.skips.size(), (int) model.conv2d_layers.size(), model.width, model.height);
+    }
+    return true;
+}
+
+// maps the whole file read-only, the pages are shared by every process
+// that maps the same model
+static bool map_model_file(const std::string & fname, unet_model & model)
+{
+#if defined(_WIN32)
+    GGML_UNUSED(fname);
+    GGML_UNUSED(model);
+    return false;
+#else
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    model.mapping = addr;
+    model.mapping_size = st.st_size;
+    return true;
+#endif
+}
+
+static void unmap_model_file(unet_model & model)
+{
+#if !defined(_WIN32)
+    if (model.mapping) {
+        munmap(model.mapping, model.mapping_size);
+    }
+#endif
+    model.mapping = NULL;
+    model.mapping_size = 0;
+}
+
+bool load_model(const std::string & fname, unet_model & model, int n_threads, bool winograd, enum ggml_type wtype, bool use_mmap) 
+{
+    // a backend set by the caller is shared with other models and stays theirs
+    model.shared_backend = model.backend != NULL;
+
+    // initialize the backend, use CPU or CUDA
+#ifdef GGML_USE_CUDA
+    if (!model.backend) {
+        fprintf(stderr, "%s: using CUDA backend\n", __func__);
+        model.backend = ggml_backend_cuda_init(0); // init device 0
+        if(!model.backend)
+        {
+            fprintf(stderr, "%s: ggml_backend_cuda_init() failed\n", __func__);
+        }
+    }
+#endif
+
+     // if there aren't GPU Backends fallback to CPU backend
+    if (!model.backend) {
+        model.backend = ggml_backend_cpu_init();
+    } 
+
+    if (ggml_backend_is_cpu(model.backend)) {
+        ggml_backend_cpu_set_n_threads(model.backend, n_threads);
+    }
+
+    // the weights stay in the page cache instead of a private copy, CPU only
+    if (use_mmap && !ggml_backend_is_cpu(model.backend)) {
+        use_mmap = false;
+    }
+    if (use_mmap && !map_model_file(fname, model)) {
+        fprintf(stderr, "%s: failed to map '%s', reading it instead\n", __func__, fname.c_str());
+        use_mmap = false;
+    }
+
+    // Read data from .gguf file: vesion, gguf magic number, tensor_count ... to gguf_ctx
+    struct ggml_context *tmp_ctx = nullptr;
+    struct gguf_init_params gguf_params = {
+        /*no_alloc = */ use_mmap,
+        /*.ctx     = */ &tmp_ctx,       
+    };
+    struct gguf_context * gguf_ctx = gguf_init_from_file(fname.c_str(), gguf_params);  
+    if (!gguf_ctx)
+    {
+        fprintf(stderr, "%s: gguf_init_from_file() failed \n", __func__);
+        return false;      
+    }
+
+    // Allocate `ggml_context` to store tensor data
+    int num_tensors = gguf_get_n_tensors(gguf_ctx);    
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead() * num_tensors, //multiplication, mem_size is a multiple of b
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    // initialize the pointer to point memory area allocate tensor (memory size, adress)
+    model.ctx = ggml_init(params);
+    // create tensors and save to main memory(RAM) zone of model.ctx
+    for (int i = 0; i < num_tensors; i++) {   
+        const char * name = gguf_get_tensor_name(gguf_ctx, i);  
+        struct ggml_tensor * src = ggml_get_tensor(tmp_ctx, name); 
+        if (g_verbose && i < 10 && !use_mmap) {
+            printf("value of tensor src: %f\n", ggml_get_f32_1d(src, i));
+        }     
+        struct ggml_tensor * dst = ggml_dup_tensor(model.ctx, src);       
+        ggml_set_name(dst, name);
+    }
+    // tensors point into the mapping when the data is aligned for the CPU backend
+    char * data = use_mmap ? (char *) model.mapping + gguf_get_data_offset(gguf_ctx) : NULL;
+    const bool mapped = use_mmap && (uintptr_t) data % 32 == 0;
+    if (mapped) {
+        model.buffer = ggml_backend_cpu_buffer_from_ptr(data, model.mapping_size - gguf_get_data_offset(gguf_ctx));
+    } else {
+        model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, model.backend);
+    }
+    // copy tensors from main memory to backend
+    for (struct ggml_tensor * cur = ggml_get_first_tensor(model.ctx); cur != NULL; cur = ggml_get_next_tensor(model.ctx, cur)) {
+        if (use_mmap) {
+            char * src = data + gguf_get_tensor_offset(gguf_ctx, gguf_find_tensor(gguf_ctx, ggml_get_name(cur)));
+            if (mapped) {
+                ggml_backend_tensor_alloc(model.buffer, cur, src);
+            } else {
+                ggml_backend_tensor_set(cur, src, 0, ggml_nbytes(cur));
+            }
+            continue;
+        }
+        struct ggml_tensor * src = ggml_get_tensor(tmp_ctx, ggml_get_name(cur));
+        size_t n_size = ggml_nbytes(src);
+        ggml_backend_tensor_set(cur, ggml_get_data(src), 0, n_size);
+    }
+    if (use_mmap && !mapped) {
+        fprintf(stderr, "%s: tensor data of '%s' is not aligned, copied it instead of sharing the mapping\n", __func__, fname.c_str());
+        unmap_model_file(model);
+    }
+    unet_arch arch;
+    if (!load_arch(gguf_ctx, arch)) {
+        gguf_free(gguf_ctx);
+        ggml_free(tmp_ctx);
+        return false;
+    }
+    std::map<std::string, std::pair<float, float>> act_ranges;
+    load_act_ranges(gguf_ctx, act_ranges);
+    gguf_free(gguf_ctx);
+    ggml_free(tmp_ctx);
+
+    if (!build_layer_table(model, arch)) {
+        return false;
+    }
+    for (auto & layer : model.conv2d_layers) {
+        auto it = act_ranges.find(layer.name_conv);
+        if (it != act_ranges.end()) {
+            layer.act_range[0] = it->second.first;
+            layer.act_range[1] = it->second.second;
+            layer.calibrated = true;
+        }
+    }
+
+    // the Winograd kernel is a custom CPU op
+    const bool cpu = ggml_backend_is_cpu(model.backend);
+    load_repacked_kernels(model, winograd && cpu, wtype, cpu);
+    return true;
+}
+
+void free_model(unet_model & model)
+{
+    ggml_free(model.ctx);
+    ggml_backend_buffer_free(model.buffer);
+    if (model.ctx_repack) {
+        ggml_free(model.ctx_repack);
+        ggml_backend_buffer_free(model.buffer_repack);
+    }
+    if (model.ctx_direct) {
+        ggml_free(model.ctx_direct);
+        ggml_backend_buffer_free(model.buffer_direct);
+    }
+    if (!model.shared_backend) {
+        ggml_backend_free(model.backend);
+    }
+    unmap_model_file(model);
+}
+
+static void print_shape(int layer, const ggml_tensor * t)
+{
+    if (!g_verbose) {
+        return;
+    }
+    printf("Layer %2d output shape:  %3d x %3d x %4d x %3d\n", layer, (int)t->ne[0], (int)t->ne[1], (int)t->ne[2], (int)t->ne[3]);
+}
+
+static ggml_tensor * apply_conv2d_unet(ggml_context * ctx, ggml_tensor * input, const unet_conv2d_layer & layer, ggml_tensor * residual = NULL)
+{   
+    if (layer.calib) {
+        input = unet_observe_range(ctx, input, layer.calib);
+    }
+    if (layer.pad_end[0] > 0 || layer.pad_end[1] > 0) {
+        input = ggml_pad(ctx, input, layer.pad_end[0], layer.pad_end[1], 0, 0);
+    }
+    // the INT8 conv carries its own epilogue, the tiles of the sparse decoder
+    // run some layers unpadded and keep the F32 path for them
+    if (layer.int8 && layer.int8->padding == layer.padding) {
+        return unet_conv_2d_int8(ctx, layer.int8.get(), input, residual);
+    }
+
+    struct ggml_tensor * result;
+    if (layer.weights_direct) {
+        result = unet_conv_2d_direct(ctx, layer.weights_direct, input, layer.weights->ne[3], layer.strike, layer.padding);
+    } else if (layer.weights_wino) {
+        result = unet_conv_2d_3x3_winograd(ctx, layer.weights_wino, input);
+    } else {
+        struct ggml_tensor * weights = layer.weights_f16 ? layer.weights_f16 : layer.weights;
+        result = ggml_conv_2d(ctx, weights, input, layer.strike, layer.strike, layer.padding, layer.padding, 1, 1);
+    }
+
+    // bias, batch norm, the residual of a ResNet block and the ReLU in one pass,
+    // the join of a block is always followed by a ReLU
+    const bool relu = layer.activate || residual;
+    if (layer.fused_epilogue) {
+        return unet_conv_epilogue(ctx, result, layer.epilogue, residual, relu);
+    }
+
+    // other backends: broadcasting ops on the folded scale and shift
+    const int64_t n_out = layer.epilogue->ne[2];
+    struct ggml_tensor * scale = ggml_view_4d(ctx, layer.epilogue, 1, 1, n_out, 1, layer.epilogue->nb[1], layer.epilogue->nb[2], layer.epilogue->nb[3], 0);
+    struct ggml_tensor * shift = ggml_view_4d(ctx, layer.epilogue, 1, 1, n_out, 1, layer.epilogue->nb[1], layer.epilogue->nb[2], layer.epilogue->nb[3], layer.epilogue->nb[3]);
+    result = ggml_add(ctx, ggml_mul(ctx, result, scale), shift);
+    if (residual) {
+        result = ggml_add(ctx, result, residual);
+    }
+    if (relu) {
+        result = ggml_relu(ctx, result);
+    }
+    return result;
+}
+
+//
+// per-layer convolution engines
+//
+
+static const char * UNET_CONV_ENGINE_NAMES[] = {
+    "im2col",
+    "winograd",
+    "direct",
+};
+
+static bool unet_parse_conv_engine(const std::string & name, unet_conv_engine & engine)
+{
+    for (int i = 0; i <= UNET_CONV_DIRECT; i++) {
+        if (name == UNET_CONV_ENGINE_NAMES[i]) {
+            engine = (unet_conv_engine) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// input resolution of every conv layer, the same walk as build_graph_unet
+static std::vector<std::pair<int, int>> unet_conv_input_sizes(const unet_model & model)
+{
+    const std::vector<unet_conv2d_layer> & layers = model.conv2d_layers;
+    std::vector<std::pair<int, int>> sizes(layers.size());
+    std::vector<std::pair<int, int>> taps;
+
+    sizes[0] = { model.width, model.height };
+    int w = model.width/layers[0].strike;
+    int h = model.height/layers[0].strike;
+    taps.push_back({ w, h });
+    w /= 2;
+    h /= 2;
+
+    for (const auto & stage : model.stages) {
+        for (const auto & block : stage) {
+            if (block.shortcut >= 0) {
+                sizes[block.shortcut] = { w, h };
+            }
+            for (int il : block.convs) {
+                sizes[il] = { w, h };
+                w /= layers[il].strike;
+                h /= layers[il].strike;
+            }
+        }
+        taps.push_back({ w, h });
+    }
+
+    int il = layers.size() - model.skips.size() - 2;
+    for (int tap : model.skips) {
+        sizes[il++] = taps[tap];
+    }
+    sizes[il++] = { model.width, model.height };
+    sizes[il++] = { model.width, model.height };
+    return sizes;
+}
+
+static bool unet_conv_engine_supported(const unet_conv2d_layer & layer, unet_conv_engine engine)
+{
+    switch (engine) {
+        case UNET_CONV_WINOGRAD: return layer.weights_wino != NULL;
+        case UNET_CONV_DIRECT:   return layer.weights->type == GGML_TYPE_F32;
+        default:                 return true;
+    }
+}
+
+static std::vector<float> unet_pack_direct(const unet_conv2d_layer & layer)
+{
+    const ggml_tensor * w = layer.weights;
+    const int OB = unet_conv_2d_direct_block();
+    const int n_blocks = (w->ne[3] + OB - 1)/OB;
+
+    std::vector<float> kernel(ggml_nelements(w));
+    std::vector<float> packed((size_t)n_blocks*OB*w->ne[0]*w->ne[1]*w->ne[2]);
+    ggml_backend_tensor_get(w, kernel.data(), 0, ggml_nbytes(w));
+    unet_conv_2d_direct_repack_kernel(kernel.data(), packed.data(), w->ne[0], w->ne[1], w->ne[2], w->ne[3]);
+    return packed;
+}
+
+static ggml_tensor * unet_new_direct_tensor(ggml_context * ctx, const unet_conv2d_layer & layer)
+{
+    const ggml_tensor * w = layer.weights;
+    const int OB = unet_conv_2d_direct_block();
+    ggml_tensor * t = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, OB*w->ne[0], w->ne[1], w->ne[2], (w->ne[3] + OB - 1)/OB);
+    ggml_format_name(t, "%s/kernel_direct", layer.name_conv.c_str());
+    return t;
+}
+
+// best of a few runs of the layer alone on one image, -1 on failure
+static int64_t unet_time_conv(const unet_model & model, const unet_conv2d_layer & layer, unet_conv_engine engine, int w, int h)
+{
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead()*8 + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+    ggml_context * ctx_data = ggml_init(params);
+
+    unet_conv2d_layer conv = layer;
+    conv.weights_direct = NULL;
+    if (engine != UNET_CONV_WINOGRAD) {
+        conv.weights_wino = NULL;
+    }
+    if (engine == UNET_CONV_DIRECT) {
+        conv.weights_direct = unet_new_direct_tensor(ctx_data, layer);
+    }
+    ggml_tensor * input = ggml_new_tensor_4d(ctx_data, GGML_TYPE_F32, w, h, layer.weights->ne[2], 1);
+    ggml_backend_buffer_t buffer = ggml_backend_alloc_ctx_tensors(ctx_data, model.backend);
+
+    std::vector<float> data(ggml_nelements(input), 0.5f);
+    ggml_backend_tensor_set(input, data.data(), 0, ggml_nbytes(input));
+    if (conv.weights_direct) {
+        data = unet_pack_direct(layer);
+        ggml_backend_tensor_set(conv.weights_direct, data.data(), 0, ggml_nbytes(conv.weights_direct));
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, apply_conv2d_unet(ctx, input, conv));
+    ggml_gallocr_t allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(model.backend));
+
+    int64_t best = -1;
+    if (ggml_gallocr_alloc_graph(allocr, gf)) {
+        for (int run = 0; run < 4; run++) {
+            const int64_t t_start = ggml_time_us();
+            if (ggml_backend_graph_compute(model.backend, gf) != GGML_STATUS_SUCCESS) {
+                best = -1;
+                break;
+            }
+            const int64_t t = ggml_time_us() - t_start;
+            // the first run warms the caches and the scratch buffers
+            if (run > 0 && (best < 0 || t < best)) {
+                best = t;
+            }
+        }
+    }
+
+    ggml_gallocr_free(allocr);
+    ggml_backend_buffer_free(buffer);
+    ggml_free(ctx_data);
+    ggml_free(ctx);
+    return best;
+}
+
+// the timings of auto hold for the machine they were taken on
+static std::string unet_host_name()
+{
+#if defined(_WIN32)
+    const char * name = getenv("COMPUTERNAME");
+    return name ? name : "";
+#else
+    char name[256] = { 0 };
+    gethostname(name, sizeof(name) - 1);
+    return name;
+#endif
+}
+
+// "<layer> <engine>" lines, "# host <name>" records where auto timed them
+static bool unet_read_conv_tune(const std::string & fname, std::map<std::string, unet_conv_engine> & choices, std::string & host)
+{
+    std::ifstream fin(fname);
+    if (!fin) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+        std::istringstream ss(line);
+        std::string name;
+        std::string engine;
+        if (!(ss >> name)) {
+            continue;
+        }
+        if (name[0] == '#') {
+            std::string key;
+            if (ss >> key && key == "host") {
+                ss >> host;
+            }
+            continue;
+        }
+        ss >> engine;
+        unet_conv_engine e;
+        if (!unet_parse_conv_engine(engine, e)) {
+            fprintf(stderr, "%s: unknown engine '%s' for '%s' in '%s'\n", __func__, engine.c_str(), name.c_str(), fname.c_str());
+            return false;
+        }
+        choices[name] = e;
+    }
+    return true;
+}
+
+bool unet_setup_conv_engines(unet_model & model, const std::string & fname_model, const std::string & engine, const std::string & fname_tune)
+{
+    // by default every layer is timed once per host and model, the choices are
+    // kept next to the model. Other backends have only im2col
+    if (engine.empty() && fname_tune.empty() && !ggml_backend_is_cpu(model.backend)) {
+        return true;
+    }
+    const bool tune = engine.empty() || engine == "auto";
+    return unet_select_conv_engines(model, tune ? "auto" : engine,
+        tune && fname_tune.empty() ? fname_model + ".conv-tune" : fname_tune);
+}
+
+bool unet_select_conv_engines(unet_model & model, const std::string & engine, const std::string & fname_tune)
+{
+    // the direct and Winograd engines are custom CPU ops
+    if (!ggml_backend_is_cpu(model.backend)) {
+        fprintf(stderr, "%s: conv engines other than im2col need the CPU backend\n", __func__);
+        return false;
+    }
+
+    const bool tune = engine == "auto";
+    unet_conv_engine fixed = UNET_CONV_IM2COL;
+    if (!tune && !engine.empty() && !unet_parse_conv_engine(engine, fixed)) {
+        fprintf(stderr, "%s: unknown conv engine '%s'\n", __func__, engine.c_str());
+        return false;
+    }
+
+    std::map<std::string, unet_conv_engine> listed;
+    std::string host;
+    if (!fname_tune.empty() && !unet_read_conv_tune(fname_tune, listed, host) && !tune) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname_tune.c_str());
+        return false;
+    }
+    if (tune && !host.empty() && host != unet_host_name()) {
+        fprintf(stderr, "%s: '%s' was timed on %s, timing the layers again\n", __func__, fname_tune.c_str(), host.c_str());
+        listed.clear();
+    }
+
+    std::vector<unet_conv2d_layer> & layers = model.conv2d_layers;
+    const std::vector<std::pair<int, int>> sizes = unet_conv_input_sizes(model);
+    std::vector<unet_conv_engine> choice(layers.size(), UNET_CONV_IM2COL);
+    bool tuned = false;
+    int n_engine[UNET_CONV_DIRECT + 1] = { 0 };
+
+    for (size_t il = 0; il < layers.size(); il++) {
+        const unet_conv2d_layer & layer = layers[il];
+        // without an engine the layers keep what load_model picked
+        unet_conv_engine e = layer.weights_wino ? UNET_CONV_WINOGRAD : UNET_CONV_IM2COL;
+        auto it = listed.find(layer.name_conv);
+        if (it != listed.end()) {
+            e = it->second;
+        } else if (tune) {
+            int64_t best = -1;
+            for (int k = 0; k <= UNET_CONV_DIRECT; k++) {
+                if (!unet_conv_engine_supported(layer, (unet_conv_engine) k)) {
+                    continue;
+                }
+                const int64_t t = unet_time_conv(model, layer, (unet_conv_engine) k, sizes[il].first, sizes[il].second);
+                if (t >= 0 && (best < 0 || t < best)) {
+                    best = t;
+                    e = (unet_conv_engine) k;
+                }
+            }
+            tuned = true;
+        } else if (!engine.empty()) {
+            e = fixed;
+        }
+        if (!unet_conv_engine_supported(layer, e)) {
+            e = UNET_CONV_IM2COL;
+        }
+        choice[il] = e;
+        n_engine[e]++;
+    }
+
+    // only the layers on the direct engine get blocked weights
+    std::vector<unet_conv2d_layer *> layers_direct;
+    for (size_t il = 0; il < layers.size(); il++) {
+        if (choice[il] != UNET_CONV_WINOGRAD) {
+            layers[il].weights_wino = NULL;
+        }
+        if (choice[il] == UNET_CONV_DIRECT) {
+            layers_direct.push_back(&layers[il]);
+        }
+    }
+    if (!layers_direct.empty()) {
+        struct ggml_init_params params {
+            /*.mem_size   =*/ ggml_tensor_overhead() * layers_direct.size(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        model.ctx_direct = ggml_init(params);
+        for (auto * layer : layers_direct) {
+            layer->weights_direct = unet_new_direct_tensor(model.ctx_direct, *layer);
+        }
+        model.buffer_direct = ggml_backend_alloc_ctx_tensors(model.ctx_direct, model.backend);
+        for (auto * layer : layers_direct) {
+            const std::vector<float> packed = unet_pack_direct(*layer);
+            ggml_backend_tensor_set(layer->weights_direct, packed.data(), 0, ggml_nbytes(layer->weights_direct));
+        }
+    }
+
+    // written whole and renamed, workers starting together may all time and write it
+    if (tuned && !fname_tune.empty()) {
+        const std::string fname_tmp = fname_tune + ".tmp" + std::to_string((long long) getpid());
+        FILE * f = fopen(fname_tmp.c_str(), "w");
+        bool ok = f != NULL;
+        if (f) {
+            fprintf(f, "# host %s\n", unet_host_name().c_str());
+            for (size_t il = 0; il < layers.size(); il++) {
+                fprintf(f, "%s %s\n", layers[il].name_conv.c_str(), UNET_CONV_ENGINE_NAMES[choice[il]]);
+            }
+            ok = fclose(f) == 0 && std::rename(fname_tmp.c_str(), fname_tune.c_str()) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_tune.c_str());
+            std::remove(fname_tmp.c_str());
+        }
+    }
+
+    if (g_verbose) {
+        printf("conv engines: %d im2col, %d winograd, %d direct\n", n_engine[UNET_CONV_IM2COL], n_engine[UNET_CONV_WINOGRAD], n_engine[UNET_CONV_DIRECT]);
+    }
+    return true;
+}
+
+//
+// calibrated INT8 execution
+//
+
+bool unet_prepare_int8(unet_model & model)
+{
+    if (!ggml_backend_is_cpu(model.backend)) {
+        fprintf(stderr, "%s: INT8 convolutions need the CPU backend\n", __func__);
+        return false;
+    }
+
+    std::vector<float> kernel;
+    std::vector<float> epilogue;
+    int n_int8 = 0;
+    for (auto & layer : model.conv2d_layers) {
+        if (!layer.calibrated || layer.weights->type != GGML_TYPE_F32) {
+            continue;
+        }
+        const ggml_tensor * w = layer.weights;
+        auto conv = std::make_shared<unet_int8_conv>();
+        conv->kw      = w->ne[0];
+        conv->kh      = w->ne[1];
+        conv->n_in    = w->ne[2];
+        conv->n_out   = w->ne[3];
+        conv->stride  = layer.strike;
+        conv->padding = layer.padding;
+        conv->relu    = layer.activate;
+
+        kernel.resize(ggml_nelements(w));
+        ggml_backend_tensor_get(w, kernel.data(), 0, ggml_nbytes(w));
+        if (layer.epilogue) {
+            epilogue.resize(ggml_nelements(layer.epilogue));
+            ggml_backend_tensor_get(layer.epilogue, epilogue.data(), 0, ggml_nbytes(layer.epilogue));
+        }
+        unet_conv_2d_int8_prepare(*conv, kernel.data(), layer.epilogue ? epilogue.data() : NULL, layer.act_range[0], layer.act_range[1]);
+        layer.int8 = conv;
+        n_int8++;
+    }
+    if (n_int8 == 0) {
+        fprintf(stderr, "%s: the model has no INT8 calibration, create one with --calibrate\n", __func__);
+        return false;
+    }
+    if (g_verbose) {
+        printf("int8: %d of %d conv layers, %s kernel\n", n_int8, (int) model.conv2d_layers.size(), unet_conv_2d_int8_kernel_name());
+    }
+    return true;
+}
+
+void unet_calibrate_begin(unet_model & model)
+{
+    for (auto & layer : model.conv2d_layers) {
+        layer.act_range[0] =  INFINITY;
+        layer.act_range[1] = -INFINITY;
+        layer.calib = layer.act_range;
+        layer.int8.reset();
+    }
+}
+
+bool unet_calibrate_end(unet_model & model, const std::string & fname_model, const std::string & fname_out)
+{
+    for (auto & layer : model.conv2d_layers) {
+        layer.calib = NULL;
+        layer.calibrated = layer.act_range[0] <= layer.act_range[1];
+    }
+
+    // a copy of the model file with the ranges added
+    struct ggml_context * data_ctx = NULL;
+    struct gguf_init_params params = {
+        /*.no_alloc   =*/ false,
+        /*.ctx        =*/ &data_ctx,
+    };
+    struct gguf_context * src = gguf_init_from_file(fname_model.c_str(), params);
+    if (!src) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname_model.c_str());
+        return false;
+    }
+    struct gguf_context * dst = gguf_init_empty();
+    gguf_set_kv(dst, src);
+    int n_layers = 0;
+    for (const auto & layer : model.conv2d_layers) {
+        if (!layer.calibrated) {
+            continue;
+        }
+        gguf_set_val_f32(dst, (UNET_KEY_ACT_MIN + layer.name_conv).c_str(), layer.act_range[0]);
+        gguf_set_val_f32(dst, (UNET_KEY_ACT_MAX + layer.name_conv).c_str(), layer.act_range[1]);
+        n_layers++;
+    }
+    for (int i = 0; i < gguf_get_n_tensors(src); i++) {
+        gguf_add_tensor(dst, ggml_get_tensor(data_ctx, gguf_get_tensor_name(src, i)));
+    }
+    gguf_write_to_file(dst, fname_out.c_str(), false);
+
+    gguf_free(dst);
+    gguf_free(src);
+    ggml_free(data_ctx);
+
+    if (g_verbose) {
+        printf("calibration: ranges of %d conv layers written to '%s'\n", n_layers, fname_out.c_str());
+    }
+    return n_layers > 0;
+}
+
+// post-processing runs on the logits of conv2d_5: sigmoid is monotonic, so
+// sigmoid(x) >= thresh  <=>  x >= logit(thresh) and the sigmoid can be skipped
+float unet_logit(float thresh)
+{
+    return std::log(thresh) - std::log1p(-thresh);
+}
+
+// summary[0] = number of defect pixels, summary[1] = max logit
+static void unet_summary_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    GGML_ASSERT(ith == 0 && nth == 1);
+    GGML_UNUSED(userdata);
+
+    const float * logits = (const float *) a->data;
+    const float   t      = ((const float *) b->data)[0];
+    const int64_t n      = ggml_nelements(a);
+
+    int64_t n_defect = 0;
+    float   max_logit = -INFINITY;
+    for (int64_t i = 0; i < n; i++) {
+        n_defect += logits[i] >= t;
+        max_logit = std::max(max_logit, logits[i]);
+    }
+
+    float * summary = (float *) dst->data;
+    summary[0] = (float) n_defect;
+    summary[1] = max_logit;
+}
+
+// bit i of the mask is set when pixel i (row-major) is a defect
+static void unet_mask_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    GGML_UNUSED(userdata);
+
+    const float * logits  = (const float *) a->data;
+    const float   t       = ((const float *) b->data)[0];
+    const int64_t n       = ggml_nelements(a);
+    const int64_t n_words = ggml_nelements(dst);
+
+    uint32_t * bits = (uint32_t *) dst->data;
+
+    const int64_t dw = (n_words + nth - 1)/nth;
+    const int64_t w0 = dw*ith;
+    const int64_t w1 = std::min(w0 + dw, n_words);
+
+    for (int64_t w = w0; w < w1; w++) {
+        const int64_t i0 = w*32;
+        const int64_t i1 = std::min(i0 + 32, n);
+        uint32_t word = 0;
+        for (int64_t i = i0; i < i1; i++) {
+            word |= (uint32_t)(logits[i] >= t) << (i - i0);
+        }
+        bits[w] = word;
+    }
+}
+
+// threshold on-graph, only the summary and the packed mask are read back. The
+// threshold ops are CPU custom ops, other backends read back the logits and
+// threshold them on the host (read_logits_unet)
+static void build_graph_unet_output(struct ggml_context * ctx_cgraph, const unet_model & model, struct ggml_cgraph * gf, struct ggml_tensor * logits)
+{
+    if (!ggml_backend_is_cpu(model.backend)) {
+        ggml_set_output(logits);
+        ggml_build_forward_expand(gf, logits);
+        return;
+    }
+
+    struct ggml_tensor * logit_thresh = ggml_new_tensor_1d(ctx_cgraph, GGML_TYPE_F32, 1);
+    ggml_set_name(logit_thresh, "logit_thresh");
+    ggml_set_input(logit_thresh);
+
+    struct ggml_tensor * summary = ggml_map_custom2(ctx_cgraph, logits, logit_thresh, unet_summary_op, 1, NULL);
+    unet_set_shape(summary, GGML_TYPE_F32, 2, 1, 1, 1);
+    ggml_set_output(summary);
+    ggml_set_name(summary, "defect_summary");
+
+    struct ggml_tensor * mask = ggml_map_custom2(ctx_cgraph, logits, logit_thresh, unet_mask_op, GGML_N_TASKS_MAX, NULL);
+    unet_set_shape(mask, GGML_TYPE_I32, (ggml_nelements(logits) + 31)/32, 1, 1, 1);
+    ggml_set_output(mask);
+    ggml_set_name(mask, "defect_mask");
+
+    ggml_build_forward_expand(gf, summary);
+    ggml_build_forward_expand(gf, mask);
+}
+
+// graph parts: part 0 is the stem, part s + 1 encoder stage s and the last
+// part the decoder. taps[0] is the stem output, taps[s + 1] the output of
+// encoder stage s
+static void build_encoder_part(struct ggml_context * ctx_cgraph, const unet_model & model, int part, int n_batch, std::vector<struct ggml_tensor *> & taps)
+{
+    const std::vector<unet_conv2d_layer> & layers = model.conv2d_layers;
+
+    if (part == 0) {
+        struct ggml_tensor * input = ggml_new_tensor_4d(ctx_cgraph, GGML_TYPE_F32, model.width, model.height, 3, n_batch); // 224x224x3xN
+        print_shape(100, input);  
+        ggml_set_name(input, "input");
+        ggml_set_input(input);
+
+        struct ggml_tensor * layer_0 = apply_conv2d_unet(ctx_cgraph, input, layers[0]);  
+        print_shape(0, layer_0);
+        ggml_set_name(layer_0, "layer_0");
+        taps.push_back(layer_0);
+        return;
+    }
+
+    struct ggml_tensor * result = taps[part - 1];
+    if (part == 1) {
+        result = ggml_pool_2d(ctx_cgraph, result, GGML_OP_POOL_MAX, 3, 3, 2, 2, 1, 1);
+    }
+    for (const auto & block : model.stages[part - 1]) {
+        struct ggml_tensor * shortcut = result;
+        if (block.shortcut >= 0) {
+            shortcut = apply_conv2d_unet(ctx_cgraph, result, layers[block.shortcut]);
+            print_shape(block.shortcut, shortcut);
+        }
+        for (size_t k = 0; k < block.convs.size(); k++) {
+            const bool join = k + 1 == block.convs.size();
+            result = apply_conv2d_unet(ctx_cgraph, result, layers[block.convs[k]], join ? shortcut : NULL);
+            print_shape(block.convs[k], result);
+        }
+    }
+    taps.push_back(result);
+}
+
+// upsampling convs of the first n_skips skips, il is left at the next decoder conv
+static struct ggml_tensor * build_decoder_skips(struct ggml_context * ctx_cgraph, const unet_model & model, const std::vector<struct ggml_tensor *> & taps, int n_skips, int & il)
+{
+    const std::vector<unet_conv2d_layer> & layers = model.conv2d_layers;
+
+    struct ggml_tensor * result = taps.back();
+    il = layers.size() - model.skips.size() - 2;
+    for (int i = 0; i < n_skips; i++) {
+        result = ggml_upscale(ctx_cgraph, result, 2);
+        result = ggml_concat(ctx_cgraph, result, taps[model.skips[i]], 2);
+        result = apply_conv2d_unet(ctx_cgraph, result, layers[il]);
+        print_shape(il, result);
+        il++;
+    }
+    return result;
+}
+
+// all skips, the full-resolution conv and the head
+static struct ggml_tensor * build_decoder(struct ggml_context * ctx_cgraph, const unet_model & model, const std::vector<struct ggml_tensor *> & taps)
+{
+    const std::vector<unet_conv2d_layer> & layers = model.conv2d_layers;
+
+    int il;
+    struct ggml_tensor * result = build_decoder_skips(ctx_cgraph, model, taps, model.skips.size(), il);
+
+    result = ggml_upscale(ctx_cgraph, result, 2);
+
+    result = apply_conv2d_unet(ctx_cgraph, result, layers[il]);
+    print_shape(il, result);
+    il++;
+    result = apply_conv2d_unet(ctx_cgraph, result, layers[il]);
+    print_shape(il, result);
+    ggml_set_name(result, "logits");
+    return result;
+}
+
+int unet_n_parts(const unet_model & model)
+{
+    return model.stages.size() + 2;
+}
+
+struct ggml_cgraph * build_graph_unet(struct ggml_context * ctx_cgraph, const unet_model & model, int n_batch, bool sparse) {   
+    struct ggml_cgraph * gf = ggml_new_graph(ctx_cgraph);   
+
+    std::vector<struct ggml_tensor *> taps;
+    for (int part = 0; part < unet_n_parts(model) - 1; part++) {
+        build_encoder_part(ctx_cgraph, model, part, n_batch, taps);
+    }
+
+    if (sparse) {
+        // the last skip (the stem) and the full-resolution tail run per tile in
+        // build_graph_unet_tiles(), their inputs have to survive this graph
+        int il;
+        struct ggml_tensor * decoder_low = build_decoder_skips(ctx_cgraph, model, taps, model.skips.size() - 1, il);
+        ggml_set_name(decoder_low, "decoder_low");
+        ggml_set_output(decoder_low);
+        struct ggml_tensor * layer_0 = taps[0];
+        ggml_set_output(layer_0);
+
+        // coarse preview of the tail at 1/4 resolution to pick the tiles
+        struct ggml_tensor * preview = ggml_concat(ctx_cgraph, decoder_low, ggml_pool_2d(ctx_cgraph, layer_0, GGML_OP_POOL_AVG, 2, 2, 2, 2, 0, 0), 2);
+        for (; il < (int) model.conv2d_layers.size(); il++) {
+            preview = apply_conv2d_unet(ctx_cgraph, preview, model.conv2d_layers[il]);
+        }
+        ggml_set_name(preview, "preview");
+        ggml_set_output(preview);
+
+        ggml_build_forward_expand(gf, preview);
+        return gf;
+    }
+
+    build_graph_unet_output(ctx_cgraph, model, gf, build_decoder(ctx_cgraph, model, taps));
+    return gf;
+}
+
+// parts [part_begin, part_end) of the graph for pipeline-parallel execution.
+// taps holds the outputs of the earlier segments, which must be allocated
+// already, and receives the taps of this one (outputs of the graph)
+struct ggml_cgraph * build_graph_unet_segment(struct ggml_context * ctx_cgraph, const unet_model & model, int part_begin, int part_end, std::vector<struct ggml_tensor *> & taps)
+{
+    struct ggml_cgraph * gf = ggml_new_graph(ctx_cgraph);
+
+    // views keep the earlier segments out of this graph
+    for (auto & tap : taps) {
+        tap = ggml_view_tensor(ctx_cgraph, tap);
+    }
+
+    const int n_parts = unet_n_parts(model);
+    const size_t n_taps = taps.size();
+    for (int part = part_begin; part < part_end; part++) {
+        if (part == n_parts - 1) {
+            build_graph_unet_output(ctx_cgraph, model, gf, build_decoder(ctx_cgraph, model, taps));
+            return gf;
+        }
+        build_encoder_part(ctx_cgraph, model, part, 1, taps);
+    }
+    for (size_t i = n_taps; i < taps.size(); i++) {
+        ggml_set_output(taps[i]);
+        ggml_build_forward_expand(gf, taps[i]);
+    }
+    return gf;
+}
+
+// full-resolution tail of the decoder on the selected tiles only: conv2d_3 and
+// conv2d_4 run unpadded on tiles with enough halo, positions outside the image
+// are zeroed to reproduce the padding of the dense graph
+struct ggml_cgraph * build_graph_unet_tiles(struct ggml_context * ctx_tiles, const unet_model & model, struct ggml_tensor * decoder_low, struct ggml_tensor * layer_0, int n_tiles)
+{
+    const int T = UNET_SPARSE_TILE;
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx_tiles);
+
+    struct ggml_tensor * tile_pos = ggml_new_tensor_1d(ctx_tiles, GGML_TYPE_I32, 2*n_tiles);
+    ggml_set_name(tile_pos, "tile_pos");
+    ggml_set_input(tile_pos);
+
+    // views keep the encoder out of this graph
+    decoder_low = ggml_view_tensor(ctx_tiles, decoder_low);
+    layer_0    = ggml_view_tensor(ctx_tiles, layer_0);
+
+    const int il = model.conv2d_layers.size() - 3;
+    unet_conv2d_layer conv_skip = model.conv2d_layers[il];
+    unet_conv2d_layer conv_full = model.conv2d_layers[il + 1];
+    conv_skip.padding = conv_full.padding = 0;
+    conv_skip.weights_wino = conv_full.weights_wino = NULL;
+
+    struct ggml_tensor * result = unet_gather_tiles(ctx_tiles, decoder_low, tile_pos, T/4 + 2, 1);
+    result = ggml_upscale(ctx_tiles, result, 2);
+    result = ggml_concat(ctx_tiles, result, unet_gather_tiles(ctx_tiles, layer_0, tile_pos, T/2 + 4, 2), 2);
+
+    result = apply_conv2d_unet(ctx_tiles, result, conv_skip);
+    result = unet_mask_tiles(ctx_tiles, result, tile_pos, layer_0, 1);
+    print_shape(il, result);
+
+    result = ggml_upscale(ctx_tiles, result, 2);
+
+    result = apply_conv2d_unet(ctx_tiles, result, conv_full);
+    print_shape(il + 1, result);
+    result = apply_conv2d_unet(ctx_tiles, result, model.conv2d_layers[il + 2]);
+    print_shape(il + 2, result);
+
+    result = unet_scatter_tiles(ctx_tiles, result, tile_pos, model.width, model.height, 1);
+    ggml_set_name(result, "logits");
+
+    build_graph_unet_output(ctx_tiles, model, gf, result);
+    return gf;
+}
+
+bool init_context(unet_context & uctx, const unet_model & model, int n_batch, bool keep_logits)
+{
+    // create a temporally context to build the graph
+    struct ggml_init_params params0 = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true, // the tensors will be allocated later by ggml_gallocr_alloc_graph()
+    };
+    uctx.ctx_cgraph = ggml_init(params0); // pointer to save adress of tensor
+
+    // decided per model, a rebind to another model starts from the request again
+    uctx.sparse = uctx.sparse_requested;
+    if (uctx.sparse && (n_batch != 1 || keep_logits || !ggml_backend_is_cpu(model.backend) || model.skips.back() != 0)) {
+        fprintf(stderr, "%s: sparse decoding needs the CPU backend, a batch of one and the stem as last skip, using the dense decoder\n", __func__);
+        uctx.sparse = false;
+    }
+
+    uctx.gf = build_graph_unet(uctx.ctx_cgraph, model, n_batch, uctx.sparse);
+    if (keep_logits) {
+        ggml_set_output(ggml_graph_get_tensor(uctx.gf, "logits"));
+    }
+
+    // kept by rebind_context, the buffers only grow
+    if (!uctx.allocr) {
+        uctx.allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(model.backend));
+    }
+    if (!ggml_gallocr_alloc_graph(uctx.allocr, uctx.gf)) {
+        fprintf(stderr, "%s: ggml_gallocr_alloc_graph() failed\n", __func__);
+        return false;
+    }
+
+    if (uctx.sparse) {
+        const int n_tx = (model.width  + UNET_SPARSE_TILE - 1)/UNET_SPARSE_TILE;
+        const int n_ty = (model.height + UNET_SPARSE_TILE - 1)/UNET_SPARSE_TILE;
+
+        struct ggml_init_params params1 = {
+            /*.mem_size   =*/ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        uctx.ctx_tiles = ggml_init(params1);
+
+        // reserve for every tile so per-frame graphs never grow the buffer
+        uctx.tile_pos.clear();
+        for (int ty = 0; ty < n_ty; ty++) {
+            for (int tx = 0; tx < n_tx; tx++) {
+                uctx.tile_pos.push_back(tx);
+                uctx.tile_pos.push_back(ty);
+            }
+        }
+        uctx.n_tiles = n_tx*n_ty;
+        uctx.gf_tiles = build_graph_unet_tiles(uctx.ctx_tiles, model, ggml_graph_get_tensor(uctx.gf, "decoder_low"), ggml_graph_get_tensor(uctx.gf, "layer_0"), uctx.n_tiles);
+
+        if (!uctx.allocr_tiles) {
+            uctx.allocr_tiles = ggml_gallocr_new(ggml_backend_get_default_buffer_type(model.backend));
+        }
+        if (!ggml_gallocr_reserve(uctx.allocr_tiles, uctx.gf_tiles)) {
+            fprintf(stderr, "%s: ggml_gallocr_reserve() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // sized for a batch of one, grown by the first frame otherwise
+    uctx.sized.resize(model.width, model.height, 3);
+    uctx.result.resize(model.width, model.height, 1);
+    uctx.mask.resize((model.width*model.height + 31)/32);
+    return true;
+}
+
+void unbind_context(unet_context & uctx)
+{
+    ggml_free(uctx.ctx_cgraph);
+    uctx.ctx_cgraph = NULL;
+    uctx.gf = NULL;
+    if (uctx.ctx_tiles) {
+        ggml_free(uctx.ctx_tiles);
+        uctx.ctx_tiles = NULL;
+        uctx.gf_tiles = NULL;
+    }
+}
+
+bool rebind_context(unet_context & uctx, const unet_model & model)
+{
+    unbind_context(uctx);
+    return init_context(uctx, model);
+}
+
+void free_context(unet_context & uctx)
+{
+    ggml_free(uctx.ctx_cgraph);
+    ggml_gallocr_free(uctx.allocr);
+    uctx.ctx_cgraph = NULL;
+    uctx.allocr = NULL;
+    uctx.gf = NULL;
+    if (uctx.ctx_tiles) {
+        ggml_free(uctx.ctx_tiles);
+        ggml_gallocr_free(uctx.allocr_tiles);
+        uctx.ctx_tiles = NULL;
+        uctx.allocr_tiles = NULL;
+        uctx.gf_tiles = NULL;
+    }
+}
+
+// touch every page of the weights and the compute buffer so the first inference
+// does not pay for page faults
+void prefault_context(unet_context & uctx, const unet_model & model)
+{
+    const size_t page = 4096;
+
+    volatile uint8_t sink = 0;
+    for (ggml_backend_buffer_t buffer : { model.buffer, model.buffer_repack }) {
+        if (!buffer || !ggml_backend_buffer_is_host(buffer)) {
+            continue;
+        }
+        const uint8_t * base = (const uint8_t *) ggml_backend_buffer_get_base(buffer);
+        const size_t    size = ggml_backend_buffer_get_size(buffer);
+        for (size_t off = 0; off < size; off += page) {
+            sink ^= base[off];
+        }
+    }
+    GGML_UNUSED(sink);
+
+    // the graph tensors are views into the gallocr compute buffer
+    for (int i = 0; i < ggml_graph_n_nodes(uctx.gf); i++) {
+        struct ggml_tensor * node = ggml_graph_node(uctx.gf, i);
+        if (node->data && node->buffer && ggml_backend_buffer_is_host(node->buffer)) {
+            memset(node->data, 0, ggml_nbytes(node));
+        }
+    }
+}
+
+// run the graph on a blank frame to spin up the thread pool and warm the caches
+void warmup_context(unet_context & uctx, const unet_model & model, int n_warmup)
+{
+    unet_image_u8 blank(model.width, model.height, 3);
+    blank.fill(128);
+    for (int i = 0; i < n_warmup; i++) {
+        detect_defect(uctx, model, blank, 0.5f);
+    }
+}
+
+// reads the summary and, for frames with defects, the packed mask of a
+// computed graph into the 0/255 image dst. t_us and t_start time the readback
+// and threshold stages
+unet_result read_result_unet(struct ggml_cgraph * gf, const unet_model & model, std::vector<uint32_t> & mask, unet_image_u8 & dst, int64_t * t_us, int64_t t_start)
+{
+    unet_result res;
+
+    float summary[2];
+    ggml_backend_tensor_get(ggml_graph_get_tensor(gf, "defect_summary"), summary, 0, sizeof(summary));
+    res.n_defect  = (int) summary[0];
+    res.max_score = 1.0f/(1.0f + std::exp(-summary[1]));
+
+    dst.resize(model.width, model.height, 1);
+
+    // clean frames are decided from the summary alone
+    if (res.n_defect == 0) {
+        int64_t t0 = ggml_time_us();
+        t_us[UNET_STAGE_READBACK] = t0 - t_start;
+        dst.fill(0);
+        t_us[UNET_STAGE_THRESHOLD] = ggml_time_us() - t0;
+        return res;
+    }
+
+    struct ggml_tensor * packed = ggml_graph_get_tensor(gf, "defect_mask");
+    mask.resize(ggml_nelements(packed));
+    ggml_backend_tensor_get(packed, mask.data(), 0, ggml_nbytes(packed));
+    int64_t t0 = ggml_time_us();
+    t_us[UNET_STAGE_READBACK] = t0 - t_start;
+
+    if (mask.size()*32 < dst.data.size()) {
+        fprintf(stderr, "%s: Size of mask does not match image dimensions.\n", __func__);
+        return res;
+    }
+
+    for (size_t i = 0; i < dst.data.size(); ++i) {
+        dst.data[i] = (mask[i/32] >> (i%32)) & 1 ? 255 : 0;
+    }
+    t_us[UNET_STAGE_THRESHOLD] = ggml_time_us() - t0;
+    return res;
+}
+
+// picks the tiles whose preview logits come within sparse_margin of the
+// threshold and runs the tail graph on them, NULL when there is nothing to run
+static struct ggml_cgraph * compute_tiles_unet(unet_context & uctx, const unet_model & model, float logit_thresh)
+{
+    const int T = UNET_SPARSE_TILE;
+
+    struct ggml_tensor * preview = ggml_graph_get_tensor(uctx.gf, "preview");
+    const int pw = preview->ne[0];
+    const int ph = preview->ne[1];
+    uctx.preview.resize(pw*ph);
+    ggml_backend_tensor_get(preview, uctx.preview.data(), 0, ggml_nbytes(preview));
+
+    // a tile covers T/4 preview pixels, dilated by one for the receptive field
+    const int P = T/4;
+    const float cut = logit_thresh - uctx.sparse_margin;
+    uctx.tile_pos.clear();
+    for (int ty = 0; ty*T < model.height; ty++) {
+        for (int tx = 0; tx*T < model.width; tx++) {
+            bool hit = false;
+            for (int y = std::max(ty*P - 1, 0); y < std::min((ty + 1)*P + 1, ph) && !hit; y++) {
+                for (int x = std::max(tx*P - 1, 0); x < std::min((tx + 1)*P + 1, pw); x++) {
+                    if (uctx.preview[y*pw + x] >= cut) {
+                        hit = true;
+                        break;
+                    }
+                }
+            }
+            if (hit) {
+                uctx.tile_pos.push_back(tx);
+                uctx.tile_pos.push_back(ty);
+            }
+        }
+    }
+    uctx.n_tiles = uctx.tile_pos.size()/2;
+    if (uctx.n_tiles == 0) {
+        return uctx.gf;
+    }
+
+    ggml_reset(uctx.ctx_tiles);
+    uctx.gf_tiles = build_graph_unet_tiles(uctx.ctx_tiles, model, ggml_graph_get_tensor(uctx.gf, "decoder_low"), ggml_graph_get_tensor(uctx.gf, "layer_0"), uctx.n_tiles);
+    if (!ggml_gallocr_alloc_graph(uctx.allocr_tiles, uctx.gf_tiles)) {
+        fprintf(stderr, "%s: ggml_gallocr_alloc_graph() failed\n", __func__);
+        return NULL;
+    }
+
+    ggml_backend_tensor_set(ggml_graph_get_tensor(uctx.gf_tiles, "tile_pos"), uctx.tile_pos.data(), 0, uctx.tile_pos.size()*sizeof(int32_t));
+    ggml_backend_tensor_set(ggml_graph_get_tensor(uctx.gf_tiles, "logit_thresh"), &logit_thresh, 0, sizeof(float));
+
+    if (ggml_backend_graph_compute(model.backend, uctx.gf_tiles) != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "%s: ggml_backend_graph_compute() failed\n", __func__);
+        return NULL;
+    }
+    return uctx.gf_tiles;
+}
+
+// the mask of the quarter-resolution preview head of the sparse graph, upsampled to the input
+static unet_result read_preview_unet(unet_context & uctx, const unet_model & model, float logit_thresh, int64_t * t_us, int64_t t_start)
+{
+    unet_result res;
+
+    struct ggml_tensor * preview = ggml_graph_get_tensor(uctx.gf, "preview");
+    const int pw = preview->ne[0];
+    const int ph = preview->ne[1];
+    uctx.preview.resize(pw*ph);
+    ggml_backend_tensor_get(preview, uctx.preview.data(), 0, ggml_nbytes(preview));
+    int64_t t0 = ggml_time_us();
+    t_us[UNET_STAGE_READBACK] = t0 - t_start;
+
+    res.max_score = 1.0f/(1.0f + std::exp(-*std::max_element(uctx.preview.begin(), uctx.preview.end())));
+    unet_image_u8 & dst = uctx.result;
+    dst.resize(model.width, model.height, 1);
+    for (int y = 0; y < model.height; y++) {
+        const float * row = &uctx.preview[(y*ph/model.height)*pw];
+        for (int x = 0; x < model.width; x++) {
+            const bool defect = row[x*pw/model.width] > logit_thresh;
+            dst.data[y*model.width + x] = defect ? 255 : 0;
+            res.n_defect += defect;
+        }
+    }
+    t_us[UNET_STAGE_THRESHOLD] = ggml_time_us() - t0;
+    return res;
+}
+
+// the mask of a graph without the on-graph threshold (non-CPU backends)
+static unet_result read_logits_unet(unet_context & uctx, struct ggml_cgraph * gf, const unet_model & model, float logit_thresh, int64_t * t_us, int64_t t_start)
+{
+    unet_result res;
+
+    struct ggml_tensor * logits = ggml_graph_get_tensor(gf, "logits");
+    uctx.logits.resize(ggml_nelements(logits));
+    ggml_backend_tensor_get(logits, uctx.logits.data(), 0, ggml_nbytes(logits));
+    int64_t t0 = ggml_time_us();
+    t_us[UNET_STAGE_READBACK] = t0 - t_start;
+
+    unet_image_u8 & dst = uctx.result;
+    dst.resize(model.width, model.height, 1);
+    float max_logit = -INFINITY;
+    for (size_t i = 0; i < dst.data.size(); i++) {
+        const bool defect = uctx.logits[i] >= logit_thresh;
+        dst.data[i] = defect ? 255 : 0;
+        res.n_defect += defect;
+        max_logit = std::max(max_logit, uctx.logits[i]);
+    }
+    res.max_score = 1.0f/(1.0f + std::exp(-max_logit));
+    t_us[UNET_STAGE_THRESHOLD] = ggml_time_us() - t0;
+    return res;
+}
+
+// runs the graph on the letterboxed frame in uctx.sized
+static unet_result compute_defect_unet(unet_context & uctx, const unet_model & model, float thresh, bool preview_only)
+{
+    unet_result res;
+
+    struct ggml_cgraph * gf = uctx.gf;
+    int64_t * t_us = uctx.timings.us;
+
+    int64_t t1 = ggml_time_us();
+    struct ggml_tensor * input = ggml_graph_get_tensor(gf, "input");
+    ggml_backend_tensor_set(input, uctx.sized.data.data(), 0, ggml_nbytes(input));
+
+    const float logit_thresh = unet_logit(thresh);
+    struct ggml_tensor * thresh_input = ggml_graph_get_tensor(gf, "logit_thresh");
+    if (thresh_input) {
+        ggml_backend_tensor_set(thresh_input, &logit_thresh, 0, sizeof(float));
+    }
+    int64_t t0 = ggml_time_us();
+    t_us[UNET_STAGE_UPLOAD] = t0 - t1;
+
+    if (ggml_backend_graph_compute(model.backend, gf) != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "%s: ggml_backend_graph_compute() failed\n", __func__);
+        return res;
+    }
+    if (uctx.sparse && preview_only) {
+        t1 = ggml_time_us();
+        t_us[UNET_STAGE_COMPUTE] = t1 - t0;
+        return read_preview_unet(uctx, model, logit_thresh, t_us, t1);
+    }
+    if (uctx.sparse) {
+        gf = compute_tiles_unet(uctx, model, logit_thresh);
+        if (!gf) {
+            return res;
+        }
+    }
+    t1 = ggml_time_us();
+    t_us[UNET_STAGE_COMPUTE] = t1 - t0;
+
+    // no tile near the threshold, the frame is clean
+    if (uctx.sparse && uctx.n_tiles == 0) {
+        res.max_score = 1.0f/(1.0f + std::exp(-*std::max_element(uctx.preview.begin(), uctx.preview.end())));
+        unet_image_u8 & dst = uctx.result;
+        dst.resize(model.width, model.height, 1);
+        t0 = ggml_time_us();
+        t_us[UNET_STAGE_READBACK] = t0 - t1;
+        dst.fill(0);
+        t_us[UNET_STAGE_THRESHOLD] = ggml_time_us() - t0;
+        return res;
+    }
+
+    if (!ggml_graph_get_tensor(gf, "defect_summary")) {
+        return read_logits_unet(uctx, gf, model, logit_thresh, t_us, t1);
+    }
+    return read_result_unet(gf, model, uctx.mask, uctx.result, t_us, t1);
+}
+
+// a cached result of the same frame, the mask goes to uctx.result
+static unet_result cached_result_unet(unet_context & uctx, const unet_cache_entry & entry)
+{
+    unet_result res;
+    res.n_defect  = entry.n_defect;
+    res.max_score = entry.max_score;
+    uctx.result.resize(entry.mask.w, entry.mask.h, entry.mask.c);
+    std::copy(entry.mask.data.begin(), entry.mask.data.end(), uctx.result.data.begin());
+    uctx.cache_hit = true;
+    for (int i = UNET_STAGE_UPLOAD; i <= UNET_STAGE_THRESHOLD; i++) {
+        uctx.timings.us[i] = 0;
+    }
+    return res;
+}
+
+unet_result find_cached_result(unet_context & uctx, uint64_t raw)
+{
+    uctx.timings = unet_frame_timings();
+    uctx.cache_hit = false;
+    uctx.cache_has_raw = uctx.cache != NULL;
+    uctx.cache_raw = raw;
+    const unet_cache_entry * entry = uctx.cache ? unet_cache_find_raw(*uctx.cache, raw) : NULL;
+    return entry ? cached_result_unet(uctx, *entry) : unet_result();
+}
+
+template <typename T>
+unet_result detect_defect(unet_context & uctx, const unet_model & model, const unet_image_t<T> & img, float thresh, bool preview_only)
+{   
+    int64_t * t_us = uctx.timings.us;
+
+    int64_t t0 = ggml_time_us();
+    letterbox_image_unet(img, uctx.sized, model.width, model.height, uctx.pool);
+
+    // the degraded preview is not cached, its mask is coarser
+    unet_cache * cache = preview_only ? NULL : uctx.cache;
+    unet_cache_entry entry;
+    entry.has_raw = uctx.cache_has_raw;
+    entry.raw = uctx.cache_raw;
+    uctx.cache_has_raw = false;
+    uctx.cache_hit = false;
+    if (cache && cache->perceptual) {
+        entry.has_phash = true;
+        entry.phash = unet_perceptual_hash(uctx.sized);
+        const unet_cache_entry * hit = unet_cache_find_perceptual(*cache, entry.phash);
+        if (hit) {
+            t_us[UNET_STAGE_LETTERBOX] = ggml_time_us() - t0;
+            return cached_result_unet(uctx, *hit);
+        }
+    }
+    t_us[UNET_STAGE_LETTERBOX] = ggml_time_us() - t0;
+
+    unet_result res = compute_defect_unet(uctx, model, thresh, preview_only);
+    // panel tiles and frames without a raw key and --cache-perceptual can never be found
+    if (cache && (entry.has_raw || entry.has_phash)) {
+        entry.n_defect  = res.n_defect;
+        entry.max_score = res.max_score;
+        entry.mask      = uctx.result;
+        unet_cache_insert(*cache, entry);
+    }
+    return res;
+}
+
+template unet_result detect_defect(unet_context & uctx, const unet_model & model, const unet_image & img, float thresh, bool preview_only);
+template unet_result detect_defect(unet_context & uctx, const unet_model & model, const unet_image_u8 & img, float thresh, bool preview_only);
+
+// copies the panel pixels of a tile out of a strip
+static void crop_strip(const unet_image_u8 & strip, unet_image_u8 & tile, int x0, int w)
+{
+    tile.resize(w, strip.h, strip.c);
+    for (int k = 0; k < strip.c; ++k) {
+        for (int y = 0; y < strip.h; ++y) {
+            memcpy(&tile.data[(k*strip.h + y)*w], &strip.data[(k*strip.h + y)*strip.w + x0], w);
+        }
+    }
+}
+
+bool detect_defect_panel(unet_context & uctx, const unet_model & model, const char * fname, int panel_tile, float thresh, unet_result & res)
+{
+    res = unet_result();
+    unet_frame_timings timings;
+    const int S = panel_tile;
+
+    int64_t t0 = ggml_time_us();
+    unet_image_reader reader;
+    if (!unet_image_reader_open(reader, fname)) {
+        return false;
+    }
+    int n_rows = unet_image_reader_read(reader, uctx.strips[0], S);
+    timings.us[UNET_STAGE_DECODE] += ggml_time_us() - t0;
+    if (n_rows < 0) {
+        unet_image_reader_close(reader);
+        return false;
+    }
+
+    // a panel_tile square maps to the network input
+    const int mw = model.width;
+    const int mh = model.height;
+    unet_image_u8 & panel = uctx.panel;
+    panel.resize((reader.w*mw + S - 1)/S, (reader.h*mh + S - 1)/S, 1);
+
+    int cur = 0;
+    for (int y0 = 0; n_rows > 0; y0 += S, cur ^= 1) {
+        const unet_image_u8 & strip = uctx.strips[cur];
+
+        // decoding the next strip overlaps with the tiles of this one
+        int n_next = 0;
+        std::thread next;
+        if (reader.row < reader.h) {
+            next = std::thread([&] { n_next = unet_image_reader_read(reader, uctx.strips[cur ^ 1], S); });
+        }
+
+        for (int x0 = 0; x0 < strip.w; x0 += S) {
+            const int tw = std::min(S, strip.w - x0);
+            const int th = strip.h;
+
+            t0 = ggml_time_us();
+            crop_strip(strip, uctx.tile, x0, tw);
+            timings.us[UNET_STAGE_LETTERBOX] += ggml_time_us() - t0;
+
+            const unet_result tile_res = detect_defect(uctx, model, uctx.tile, thresh);
+            for (int i = 0; i < UNET_STAGE_COUNT; i++) {
+                if (i != UNET_STAGE_DECODE) {
+                    timings.us[i] += uctx.timings.us[i];
+                }
+            }
+            res.max_score = std::max(res.max_score, tile_res.max_score);
+
+            // letterbox placement of the tile in the network input, see letterbox_image_unet
+            int new_w = tw;
+            int new_h = th;
+            if (((float) mw/tw) < ((float) mh/th)) {
+                new_w = mw;
+                new_h = (th*mw)/tw;
+            } else {
+                new_h = mh;
+                new_w = (tw*mh)/th;
+            }
+            const int dx = (mw - new_w)/2;
+            const int dy = (mh - new_h)/2;
+
+            t0 = ggml_time_us();
+            const int X0 = (x0*mw + S - 1)/S;
+            const int X1 = std::min(panel.w, ((x0 + tw)*mw + S - 1)/S);
+            const int Y0 = (y0*mh + S - 1)/S;
+            const int Y1 = std::min(panel.h, ((y0 + th)*mh + S - 1)/S);
+            for (int Y = Y0; Y < Y1; ++Y) {
+                const float py = (Y + 0.5f)*S/mh - y0;
+                const int ly = std::min(dy + new_h - 1, dy + (int) (py*new_h/th));
+                for (int X = X0; X < X1; ++X) {
+                    const float px = (X + 0.5f)*S/mw - x0;
+                    const int lx = std::min(dx + new_w - 1, dx + (int) (px*new_w/tw));
+                    panel.set_pixel(X, Y, 0, uctx.result.get_pixel(lx, ly, 0));
+                }
+            }
+            timings.us[UNET_STAGE_THRESHOLD] += ggml_time_us() - t0;
+        }
+
+        t0 = ggml_time_us();
+        if (next.joinable()) {
+            next.join();
+        }
+        timings.us[UNET_STAGE_DECODE] += ggml_time_us() - t0;
+        if (n_next < 0) {
+            unet_image_reader_close(reader);
+            return false;
+        }
+        n_rows = n_next;
+    }
+    unet_image_reader_close(reader);
+
+    for (uint8_t v : panel.data) {
+        res.n_defect += v != 0;
+    }
+    std::swap(uctx.result, panel);
+    uctx.timings = timings;
+    return true;
+}
@@ -0,0 +1,978 @@
+#include "unet-ops.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#if defined(__AVX512F__)
+#define UNET_VL               16
+#define UNET_VEC              __m512
+#define UNET_VEC_ZERO         _mm512_setzero_ps
+#define UNET_VEC_SET1         _mm512_set1_ps
+#define UNET_VEC_LOAD         _mm512_loadu_ps
+#define UNET_VEC_STORE        _mm512_storeu_ps
+#define UNET_VEC_FMA(a, b, c) _mm512_fmadd_ps(b, c, a)
+#elif defined(__AVX2__) && defined(__FMA__)
+#define UNET_VL               8
+#define UNET_VEC              __m256
+#define UNET_VEC_ZERO         _mm256_setzero_ps
+#define UNET_VEC_SET1         _mm256_set1_ps
+#define UNET_VEC_LOAD         _mm256_loadu_ps
+#define UNET_VEC_STORE        _mm256_storeu_ps
+#define UNET_VEC_FMA(a, b, c) _mm256_fmadd_ps(b, c, a)
+#endif
+
+void unet_set_shape(struct ggml_tensor * t, enum ggml_type type, int64_t ne0, int64_t ne1, int64_t ne2, int64_t ne3)
+{
+    GGML_ASSERT(t->data == NULL && t->view_src == NULL);
+
+    t->type  = type;
+    t->ne[0] = ne0;
+    t->ne[1] = ne1;
+    t->ne[2] = ne2;
+    t->ne[3] = ne3;
+    t->nb[0] = ggml_type_size(type);
+    t->nb[1] = ggml_row_size(type, ne0);
+    t->nb[2] = t->nb[1]*ne1;
+    t->nb[3] = t->nb[2]*ne2;
+}
+
+//
+// Winograd F(2x2,3x3)
+//
+// Y = A^T [ (G g G^T) * (B^T d B) ] A
+//
+// with a 4x4 input tile d, a 3x3 kernel g and a 2x2 output tile Y. The 16
+// element-wise products become 16 independent GEMMs over the channels:
+//
+//   M[xi][t][oc] = sum_ic V[xi][ic][t] * U[xi][ic][oc]
+//
+
+// number of tiles per block, a multiple of 4 for the GEMM micro-kernel
+#define UNET_WINO_TB 16
+
+void unet_winograd_transform_kernel(const float * kernel, float * transformed, int n_in, int n_out)
+{
+    for (int oc = 0; oc < n_out; oc++) {
+        for (int ic = 0; ic < n_in; ic++) {
+            // g[y][x]
+            const float * g = kernel + 9*(ic + n_in*oc);
+
+            // tmp = G g
+            float tmp[4][3];
+            for (int x = 0; x < 3; x++) {
+                tmp[0][x] = g[0*3 + x];
+                tmp[1][x] = 0.5f*(g[0*3 + x] + g[1*3 + x] + g[2*3 + x]);
+                tmp[2][x] = 0.5f*(g[0*3 + x] - g[1*3 + x] + g[2*3 + x]);
+                tmp[3][x] = g[2*3 + x];
+            }
+
+            // u = tmp G^T
+            for (int y = 0; y < 4; y++) {
+                float u[4];
+                u[0] = tmp[y][0];
+                u[1] = 0.5f*(tmp[y][0] + tmp[y][1] + tmp[y][2]);
+                u[2] = 0.5f*(tmp[y][0] - tmp[y][1] + tmp[y][2]);
+                u[3] = tmp[y][2];
+                for (int x = 0; x < 4; x++) {
+                    transformed[((size_t)(4*y + x)*n_in + ic)*n_out + oc] = u[x];
+                }
+            }
+        }
+    }
+}
+
+// M[t][oc] = sum_ic V[ic][t] * U[ic][oc]
+// V: [IC][TB], U: [IC][OC], M: [TB][OC]
+static void unet_winograd_gemm(const float * V, const float * U, float * M, int n_in, int n_out)
+{
+    const int TB = UNET_WINO_TB;
+
+    int oc0 = 0;
+#if defined(UNET_VL)
+    for (; oc0 + 2*UNET_VL <= n_out; oc0 += 2*UNET_VL) {
+        for (int t = 0; t < TB; t += 4) {
+            UNET_VEC acc00 = UNET_VEC_ZERO(), acc01 = UNET_VEC_ZERO();
+            UNET_VEC acc10 = UNET_VEC_ZERO(), acc11 = UNET_VEC_ZERO();
+            UNET_VEC acc20 = UNET_VEC_ZERO(), acc21 = UNET_VEC_ZERO();
+            UNET_VEC acc30 = UNET_VEC_ZERO(), acc31 = UNET_VEC_ZERO();
+            for (int ic = 0; ic < n_in; ic++) {
+                const float * u = U + (size_t)ic*n_out + oc0;
+                const float * v = V + ic*TB + t;
+                const UNET_VEC u0 = UNET_VEC_LOAD(u);
+                const UNET_VEC u1 = UNET_VEC_LOAD(u + UNET_VL);
+                UNET_VEC vv;
+                vv = UNET_VEC_SET1(v[0]); acc00 = UNET_VEC_FMA(acc00, vv, u0); acc01 = UNET_VEC_FMA(acc01, vv, u1);
+                vv = UNET_VEC_SET1(v[1]); acc10 = UNET_VEC_FMA(acc10, vv, u0); acc11 = UNET_VEC_FMA(acc11, vv, u1);
+                vv = UNET_VEC_SET1(v[2]); acc20 = UNET_VEC_FMA(acc20, vv, u0); acc21 = UNET_VEC_FMA(acc21, vv, u1);
+                vv = UNET_VEC_SET1(v[3]); acc30 = UNET_VEC_FMA(acc30, vv, u0); acc31 = UNET_VEC_FMA(acc31, vv, u1);
+            }
+            float * m = M + (size_t)t*n_out + oc0;
+            UNET_VEC_STORE(m + 0*n_out, acc00); UNET_VEC_STORE(m + 0*n_out + UNET_VL, acc01);
+            UNET_VEC_STORE(m + 1*n_out, acc10); UNET_VEC_STORE(m + 1*n_out + UNET_VL, acc11);
+            UNET_VEC_STORE(m + 2*n_out, acc20); UNET_VEC_STORE(m + 2*n_out + UNET_VL, acc21);
+            UNET_VEC_STORE(m + 3*n_out, acc30); UNET_VEC_STORE(m + 3*n_out + UNET_VL, acc31);
+        }
+    }
+#endif
+    // scalar fallback and leftover output channels
+    if (oc0 == n_out) {
+        return;
+    }
+    for (int t = 0; t < TB; t++) {
+        float * m = M + (size_t)t*n_out;
+        for (int oc = oc0; oc < n_out; oc++) {
+            m[oc] = 0.0f;
+        }
+        for (int ic = 0; ic < n_in; ic++) {
+            const float   v = V[ic*TB + t];
+            const float * u = U + (size_t)ic*n_out;
+            for (int oc = oc0; oc < n_out; oc++) {
+                m[oc] += v*u[oc];
+            }
+        }
+    }
+}
+
+static void unet_conv_2d_3x3_winograd_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    GGML_UNUSED(userdata);
+
+    const struct ggml_tensor * input  = b;
+    const struct ggml_tensor * kernel = a;
+
+    const int W     = input->ne[0];
+    const int H     = input->ne[1];
+    const int n_in  = input->ne[2];
+    const int N     = input->ne[3];
+    const int n_out = kernel->ne[0];
+
+    const int TB = UNET_WINO_TB;
+
+    const int tiles_x  = (W + 1)/2;
+    const int tiles_y  = (H + 1)/2;
+    const int n_tiles  = tiles_x*tiles_y*N;
+    const int n_blocks = (n_tiles + TB - 1)/TB;
+
+    // per-thread scratch, reused across ops and graph evaluations
+    static thread_local std::vector<float> V;
+    static thread_local std::vector<float> M;
+    V.resize((size_t)16*n_in*TB);
+    M.resize((size_t)16*TB*n_out);
+
+    const float * U = (const float *) kernel->data;
+    const char  * src = (const char *) input->data;
+    float       * out = (float *) dst->data;
+
+    for (int blk = ith; blk < n_blocks; blk += nth) {
+        const int t0 = blk*TB;
+
+        // V = B^T d B
+        for (int t = 0; t < TB; t++) {
+            const int tile = t0 + t;
+            if (tile >= n_tiles) {
+                for (int xi = 0; xi < 16; xi++) {
+                    for (int ic = 0; ic < n_in; ic++) {
+                        V[((size_t)xi*n_in + ic)*TB + t] = 0.0f;
+                    }
+                }
+                continue;
+            }
+            const int n  = tile/(tiles_x*tiles_y);
+            const int ty = (tile/tiles_x) % tiles_y;
+            const int tx = tile % tiles_x;
+            const int x0 = 2*tx - 1;
+            const int y0 = 2*ty - 1;
+
+            for (int ic = 0; ic < n_in; ic++) {
+                const char * plane = src + ic*input->nb[2] + n*input->nb[3];
+
+                float d[4][4];
+                for (int y = 0; y < 4; y++) {
+                    const int iy = y0 + y;
+                    for (int x = 0; x < 4; x++) {
+                        const int ix = x0 + x;
+                        d[y][x] = (ix >= 0 && ix < W && iy >= 0 && iy < H) ? *(const float *)(plane + ix*input->nb[0] + iy*input->nb[1]) : 0.0f;
+                    }
+                }
+
+                float tmp[4][4];
+                for (int x = 0; x < 4; x++) {
+                    tmp[0][x] = d[0][x] - d[2][x];
+                    tmp[1][x] = d[1][x] + d[2][x];
+                    tmp[2][x] = d[2][x] - d[1][x];
+                    tmp[3][x] = d[1][x] - d[3][x];
+                }
+                for (int y = 0; y < 4; y++) {
+                    float * v = V.data() + (size_t)(4*y)*n_in*TB + ic*TB + t;
+                    v[0*n_in*TB] = tmp[y][0] - tmp[y][2];
+                    v[1*n_in*TB] = tmp[y][1] + tmp[y][2];
+                    v[2*n_in*TB] = tmp[y][2] - tmp[y][1];
+                    v[3*n_in*TB] = tmp[y][1] - tmp[y][3];
+                }
+            }
+        }
+
+        for (int xi = 0; xi < 16; xi++) {
+            unet_winograd_gemm(V.data() + (size_t)xi*n_in*TB, U + (size_t)xi*n_in*n_out, M.data() + (size_t)xi*TB*n_out, n_in, n_out);
+        }
+
+        // Y = A^T M A
+        for (int t = 0; t < TB && t0 + t < n_tiles; t++) {
+            const int tile = t0 + t;
+            const int n  = tile/(tiles_x*tiles_y);
+            const int ty = (tile/tiles_x) % tiles_y;
+            const int tx = tile % tiles_x;
+            const int ox = 2*tx;
+            const int oy = 2*ty;
+
+            for (int oc = 0; oc < n_out; oc++) {
+                const float * m = M.data() + (size_t)t*n_out + oc;
+                const size_t  s = (size_t)TB*n_out;
+
+                float tmp[2][4];
+                for (int x = 0; x < 4; x++) {
+                    tmp[0][x] = m[(0*4 + x)*s] + m[(1*4 + x)*s] + m[(2*4 + x)*s];
+                    tmp[1][x] = m[(1*4 + x)*s] - m[(2*4 + x)*s] - m[(3*4 + x)*s];
+                }
+
+                float * plane = out + ((size_t)n*n_out + oc)*W*H;
+                for (int y = 0; y < 2 && oy + y < H; y++) {
+                    plane[(oy + y)*W + ox] = tmp[y][0] + tmp[y][1] + tmp[y][2];
+                    if (ox + 1 < W) {
+                        plane[(oy + y)*W + ox + 1] = tmp[y][1] - tmp[y][2] - tmp[y][3];
+                    }
+                }
+            }
+        }
+    }
+}
+
+struct ggml_tensor * unet_conv_2d_3x3_winograd(struct ggml_context * ctx, struct ggml_tensor * kernel, struct ggml_tensor * input)
+{
+    GGML_ASSERT(kernel->type == GGML_TYPE_F32 && input->type == GGML_TYPE_F32);
+    GGML_ASSERT(kernel->ne[1] == input->ne[2] && kernel->ne[2] == 16);
+
+    struct ggml_tensor * result = ggml_map_custom2(ctx, kernel, input, unet_conv_2d_3x3_winograd_op, GGML_N_TASKS_MAX, NULL);
+    unet_set_shape(result, GGML_TYPE_F32, input->ne[0], input->ne[1], kernel->ne[0], input->ne[3]);
+    return result;
+}
+
+//
+// blocked direct convolution
+//
+// The weights are repacked at load time into blocks of OB output channels with
+// the block innermost, [OC/OB][IC][KH][KW][OB], so one (ic, ky, kx) step loads
+// OB contiguous weights. Each step broadcasts RX input pixels of one output row
+// against them, a register tile of RX x OB accumulators. The input rows a
+// output row needs are copied zero-padded into per-thread scratch, so there
+// are no bounds checks in the inner loop and no im2col matrix
+//
+
+#if defined(UNET_VL)
+#define UNET_DIRECT_OB (2*UNET_VL)
+#else
+#define UNET_DIRECT_OB 8
+#endif
+#define UNET_DIRECT_RX 6
+
+int unet_conv_2d_direct_block(void)
+{
+    return UNET_DIRECT_OB;
+}
+
+void unet_conv_2d_direct_repack_kernel(const float * kernel, float * packed, int kw, int kh, int n_in, int n_out)
+{
+    const int OB = UNET_DIRECT_OB;
+    const int n_blocks = (n_out + OB - 1)/OB;
+
+    for (int ob = 0; ob < n_blocks; ob++) {
+        for (int ic = 0; ic < n_in; ic++) {
+            for (int ky = 0; ky < kh; ky++) {
+                for (int kx = 0; kx < kw; kx++) {
+                    float * p = packed + ((((size_t)ob*n_in + ic)*kh + ky)*kw + kx)*OB;
+                    for (int o = 0; o < OB; o++) {
+                        const int oc = ob*OB + o;
+                        p[o] = oc < n_out ? kernel[(((size_t)oc*n_in + ic)*kh + ky)*kw + kx] : 0.0f;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// acc[rx*OB + o] = sum over ic, ky, kx of rows[ky][ic][rx*s + kx]*w[ic][ky][kx][o]
+static void unet_conv_2d_direct_tile(const float * rows, const float * w, float * acc, int n_in, int kw, int kh, int row_size, int s)
+{
+    const int OB = UNET_DIRECT_OB;
+    const int RX = UNET_DIRECT_RX;
+
+#if defined(UNET_VL)
+    UNET_VEC acc0[RX];
+    UNET_VEC acc1[RX];
+    for (int rx = 0; rx < RX; rx++) {
+        acc0[rx] = UNET_VEC_ZERO();
+        acc1[rx] = UNET_VEC_ZERO();
+    }
+    for (int ic = 0; ic < n_in; ic++) {
+        for (int ky = 0; ky < kh; ky++) {
+            const float * row = rows + ((size_t)ky*n_in + ic)*row_size;
+            const float * wk  = w + (((size_t)ic*kh + ky)*kw)*OB;
+            for (int kx = 0; kx < kw; kx++) {
+                const UNET_VEC w0 = UNET_VEC_LOAD(wk + kx*OB);
+                const UNET_VEC w1 = UNET_VEC_LOAD(wk + kx*OB + UNET_VL);
+                for (int rx = 0; rx < RX; rx++) {
+                    const UNET_VEC v = UNET_VEC_SET1(row[rx*s + kx]);
+                    acc0[rx] = UNET_VEC_FMA(acc0[rx], v, w0);
+                    acc1[rx] = UNET_VEC_FMA(acc1[rx], v, w1);
+                }
+            }
+        }
+    }
+    for (int rx = 0; rx < RX; rx++) {
+        UNET_VEC_STORE(acc + rx*OB, acc0[rx]);
+        UNET_VEC_STORE(acc + rx*OB + UNET_VL, acc1[rx]);
+    }
+#else
+    for (int i = 0; i < RX*OB; i++) {
+        acc[i] = 0.0f;
+    }
+    for (int ic = 0; ic < n_in; ic++) {
+        for (int ky = 0; ky < kh; ky++) {
+            const float * row = rows + ((size_t)ky*n_in + ic)*row_size;
+            const float * wk  = w + (((size_t)ic*kh + ky)*kw)*OB;
+            for (int kx = 0; kx < kw; kx++) {
+                for (int rx = 0; rx < RX; rx++) {
+                    const float v = row[rx*s + kx];
+                    for (int o = 0; o < OB; o++) {
+                        acc[rx*OB + o] += v*wk[kx*OB + o];
+                    }
+                }
+            }
+        }
+    }
+#endif
+}
+
+static void unet_conv_2d_direct_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const struct ggml_tensor * input  = b;
+    const struct ggml_tensor * kernel = a;
+
+    // userdata packs the stride and the padding, see unet_conv_2d_direct
+    const int s = (int)((intptr_t) userdata >> 8);
+    const int p = (int)((intptr_t) userdata & 0xff);
+
+    const int OB = UNET_DIRECT_OB;
+    const int RX = UNET_DIRECT_RX;
+
+    const int W     = input->ne[0];
+    const int H     = input->ne[1];
+    const int n_in  = input->ne[2];
+    const int N     = input->ne[3];
+    const int kw    = kernel->ne[0]/OB;
+    const int kh    = kernel->ne[1];
+    const int n_blocks = kernel->ne[3];
+    const int OW    = dst->ne[0];
+    const int OH    = dst->ne[1];
+    const int n_out = dst->ne[2];
+
+    // padded input row, the last tile of a row may read past OW
+    const int n_tiles_x = (OW + RX - 1)/RX;
+    const int row_size  = (n_tiles_x*RX - 1)*s + kw;
+
+    static thread_local std::vector<float> rows;
+    static thread_local std::vector<float> acc;
+    rows.resize((size_t)kh*n_in*row_size);
+    acc.resize((size_t)RX*OB);
+
+    const float * packed = (const float *) kernel->data;
+    const char  * src = (const char *) input->data;
+    float       * out = (float *) dst->data;
+
+    for (int r = ith; r < N*OH; r += nth) {
+        const int n  = r/OH;
+        const int oy = r % OH;
+
+        for (int ky = 0; ky < kh; ky++) {
+            const int iy = oy*s - p + ky;
+            for (int ic = 0; ic < n_in; ic++) {
+                float * row = rows.data() + ((size_t)ky*n_in + ic)*row_size;
+                if (iy < 0 || iy >= H) {
+                    std::fill(row, row + row_size, 0.0f);
+                    continue;
+                }
+                const char * line = src + ic*input->nb[2] + n*input->nb[3] + iy*input->nb[1];
+                for (int xp = 0; xp < row_size; xp++) {
+                    const int ix = xp - p;
+                    row[xp] = (ix >= 0 && ix < W) ? *(const float *)(line + ix*input->nb[0]) : 0.0f;
+                }
+            }
+        }
+
+        for (int ob = 0; ob < n_blocks; ob++) {
+            const float * w = packed + (size_t)ob*n_in*kh*kw*OB;
+            const int n_o = std::min(OB, n_out - ob*OB);
+            for (int tx = 0; tx < n_tiles_x; tx++) {
+                const int ox0 = tx*RX;
+                const int n_x = std::min(RX, OW - ox0);
+                unet_conv_2d_direct_tile(rows.data() + ox0*s, w, acc.data(), n_in, kw, kh, row_size, s);
+                for (int o = 0; o < n_o; o++) {
+                    float * dst_row = out + (((size_t)n*n_out + ob*OB + o)*OH + oy)*OW + ox0;
+                    for (int rx = 0; rx < n_x; rx++) {
+                        dst_row[rx] = acc[rx*OB + o];
+                    }
+                }
+            }
+        }
+    }
+}
+
+struct ggml_tensor * unet_conv_2d_direct(struct ggml_context * ctx, struct ggml_tensor * kernel, struct ggml_tensor * input, int n_out, int stride, int padding)
+{
+    GGML_ASSERT(kernel->type == GGML_TYPE_F32 && input->type == GGML_TYPE_F32);
+    GGML_ASSERT(kernel->ne[2] == input->ne[2] && kernel->ne[0] % UNET_DIRECT_OB == 0);
+    GGML_ASSERT(kernel->ne[3]*UNET_DIRECT_OB >= n_out && stride > 0 && padding >= 0 && padding < 256);
+
+    const int kw = kernel->ne[0]/UNET_DIRECT_OB;
+    const int kh = kernel->ne[1];
+    const int64_t OW = (input->ne[0] + 2*padding - kw)/stride + 1;
+    const int64_t OH = (input->ne[1] + 2*padding - kh)/stride + 1;
+
+    void * userdata = (void *)(((intptr_t) stride << 8) | padding);
+    struct ggml_tensor * result = ggml_map_custom2(ctx, kernel, input, unet_conv_2d_direct_op, GGML_N_TASKS_MAX, userdata);
+    unet_set_shape(result, GGML_TYPE_F32, OW, OH, n_out, input->ne[3]);
+    return result;
+}
+
+//
+// tiles for region-sparse execution
+//
+// tile_pos holds (tx, ty) pairs. A tile of size P with margin m covers the
+// source region starting at (t*(P - 2*m) - m), pixels outside the source are 0
+//
+
+static void unet_gather_tiles_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const int margin = (int) (intptr_t) userdata;
+
+    const struct ggml_tensor * src = a;
+    const int32_t * pos = (const int32_t *) b->data;
+
+    const int W = src->ne[0];
+    const int H = src->ne[1];
+    const int C = src->ne[2];
+    const int P = dst->ne[0];
+    const int K = dst->ne[3];
+    const int step = P - 2*margin;
+
+    float * out = (float *) dst->data;
+
+    // one (tile, channel) plane per task
+    for (int i = ith; i < K*C; i += nth) {
+        const int k = i / C;
+        const int c = i % C;
+        const int x0 = pos[2*k + 0]*step - margin;
+        const int y0 = pos[2*k + 1]*step - margin;
+
+        const char * plane = (const char *) src->data + c*src->nb[2];
+        float * o = out + ((size_t)k*C + c)*P*P;
+        for (int y = 0; y < P; y++) {
+            const int iy = y0 + y;
+            for (int x = 0; x < P; x++) {
+                const int ix = x0 + x;
+                o[y*P + x] = (ix >= 0 && ix < W && iy >= 0 && iy < H) ? *(const float *)(plane + ix*src->nb[0] + iy*src->nb[1]) : 0.0f;
+            }
+        }
+    }
+}
+
+static void unet_mask_tiles_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, const struct ggml_tensor * c, int ith, int nth, void * userdata)
+{
+    const int margin = (int) (intptr_t) userdata;
+
+    const int32_t * pos = (const int32_t *) b->data;
+
+    const int W = c->ne[0];
+    const int H = c->ne[1];
+    const int P = a->ne[0];
+    const int C = a->ne[2];
+    const int K = a->ne[3];
+    const int step = P - 2*margin;
+
+    GGML_ASSERT(ggml_is_contiguous(a));
+    const float * src = (const float *) a->data;
+    float * out = (float *) dst->data;
+
+    for (int i = ith; i < K*C; i += nth) {
+        const int k = i / C;
+        const int x0 = pos[2*k + 0]*step - margin;
+        const int y0 = pos[2*k + 1]*step - margin;
+
+        const float * s = src + (size_t)i*P*P;
+        float * o = out + (size_t)i*P*P;
+        for (int y = 0; y < P; y++) {
+            const int iy = y0 + y;
+            for (int x = 0; x < P; x++) {
+                const int ix = x0 + x;
+                o[y*P + x] = (ix >= 0 && ix < W && iy >= 0 && iy < H) ? s[y*P + x] : 0.0f;
+            }
+        }
+    }
+}
+
+static void unet_scatter_tiles_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    const int margin = (int) (intptr_t) userdata;
+
+    const int32_t * pos = (const int32_t *) b->data;
+
+    const int P = a->ne[0];
+    const int K = a->ne[3];
+    const int W = dst->ne[0];
+    const int H = dst->ne[1];
+    const int step = P - 2*margin;
+
+    GGML_ASSERT(a->ne[2] == 1 && ggml_is_contiguous(a));
+    const float * src = (const float *) a->data;
+    float * out = (float *) dst->data;
+
+    // each task owns a band of rows: background first, then the tiles crossing it
+    const int dy = (H + nth - 1)/nth;
+    const int r0 = dy*ith;
+    const int r1 = std::min(r0 + dy, H);
+
+    for (int y = r0; y < r1; y++) {
+        for (int x = 0; x < W; x++) {
+            out[y*W + x] = -INFINITY;
+        }
+    }
+    for (int k = 0; k < K; k++) {
+        const int x0 = pos[2*k + 0]*step;
+        const int y0 = pos[2*k + 1]*step;
+        const float * s = src + (size_t)k*P*P;
+        for (int y = std::max(y0, r0); y < std::min(y0 + step, r1); y++) {
+            for (int x = x0; x < std::min(x0 + step, W); x++) {
+                out[y*W + x] = s[(y - y0 + margin)*P + (x - x0 + margin)];
+            }
+        }
+    }
+}
+
+struct ggml_tensor * unet_gather_tiles(struct ggml_context * ctx, struct ggml_tensor * src, struct ggml_tensor * tile_pos, int size, int margin)
+{
+    GGML_ASSERT(src->type == GGML_TYPE_F32 && src->ne[3] == 1 && tile_pos->type == GGML_TYPE_I32);
+
+    struct ggml_tensor * result = ggml_map_custom2(ctx, src, tile_pos, unet_gather_tiles_op, GGML_N_TASKS_MAX, (void *) (intptr_t) margin);
+    unet_set_shape(result, GGML_TYPE_F32, size, size, src->ne[2], ggml_nelements(tile_pos)/2);
+    return result;
+}
+
+struct ggml_tensor * unet_mask_tiles(struct ggml_context * ctx, struct ggml_tensor * tiles, struct ggml_tensor * tile_pos, struct ggml_tensor * ref, int margin)
+{
+    return ggml_map_custom3(ctx, tiles, tile_pos, ref, unet_mask_tiles_op, GGML_N_TASKS_MAX, (void *) (intptr_t) margin);
+}
+
+struct ggml_tensor * unet_scatter_tiles(struct ggml_context * ctx, struct ggml_tensor * tiles, struct ggml_tensor * tile_pos, int width, int height, int margin)
+{
+    struct ggml_tensor * result = ggml_map_custom2(ctx, tiles, tile_pos, unet_scatter_tiles_op, GGML_N_TASKS_MAX, (void *) (intptr_t) margin);
+    unet_set_shape(result, GGML_TYPE_F32, width, height, 1, 1);
+    return result;
+}
+
+//
+// conv epilogue: y = relu(x*scale[c] + shift[c] + residual) in one pass
+//
+
+static void unet_conv_epilogue_impl(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, const struct ggml_tensor * c, int ith, int nth, bool relu)
+{
+    GGML_ASSERT(ggml_is_contiguous(a) && ggml_is_contiguous(b) && (!c || ggml_is_contiguous(c)));
+
+    const int n = a->ne[0]*a->ne[1];
+    const int C = a->ne[2];
+    const int N = a->ne[3];
+
+    const float * scale = (const float *) b->data;
+    const float * shift = scale + C;
+
+    // one channel plane per task
+    for (int i = ith; i < C*N; i += nth) {
+        const float   s = scale[i % C];
+        const float   t = shift[i % C];
+        const float * x = (const float *) a->data + (size_t)i*n;
+        float       * y = (float *) dst->data + (size_t)i*n;
+        const float * r = c ? (const float *) c->data + (size_t)i*n : NULL;
+        const float   lo = relu ? 0.0f : -INFINITY;
+        if (r) {
+            for (int k = 0; k < n; k++) {
+                y[k] = std::max(x[k]*s + t + r[k], lo);
+            }
+        } else {
+            for (int k = 0; k < n; k++) {
+                y[k] = std::max(x[k]*s + t, lo);
+            }
+        }
+    }
+}
+
+static void unet_conv_epilogue_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    unet_conv_epilogue_impl(dst, a, b, NULL, ith, nth, userdata != NULL);
+}
+
+static void unet_conv_epilogue_residual_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, const struct ggml_tensor * c, int ith, int nth, void * userdata)
+{
+    unet_conv_epilogue_impl(dst, a, b, c, ith, nth, userdata != NULL);
+}
+
+struct ggml_tensor * unet_conv_epilogue(struct ggml_context * ctx, struct ggml_tensor * x, struct ggml_tensor * scale_shift, struct ggml_tensor * residual, bool relu)
+{
+    GGML_ASSERT(x->type == GGML_TYPE_F32 && ggml_nelements(scale_shift) == 2*x->ne[2]);
+
+    void * userdata = relu ? (void *) 1 : NULL;
+    if (residual) {
+        GGML_ASSERT(ggml_are_same_shape(x, residual));
+        return ggml_map_custom3(ctx, x, scale_shift, residual, unet_conv_epilogue_residual_op, GGML_N_TASKS_MAX, userdata);
+    }
+    return ggml_map_custom2(ctx, x, scale_shift, unet_conv_epilogue_op, GGML_N_TASKS_MAX, userdata);
+}
+
+//
+// calibrated INT8 convolution
+//
+// Activations are quantized per tensor with the ranges recorded by the
+// calibration, x_q = round(x/act_scale) + act_zero as unsigned bytes, and the
+// weights per output channel to signed bytes. Groups of 4 input channels are
+// innermost on both sides so one 32-bit lane holds a 4-way dot product: VNNI
+// does it in one instruction, AVX2 as maddubs + madd. maddubs saturates its
+// int16 pair sums, so without VNNI the activations keep 7 bits
+//
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+#define UNET_Q8_VL   16
+#define UNET_Q8_RX   6
+#define UNET_Q8_UMAX 255
+#elif defined(__AVX2__)
+#define UNET_Q8_VL   8
+#define UNET_Q8_RX   4
+#define UNET_Q8_UMAX 127
+#else
+#define UNET_Q8_RX   4
+#define UNET_Q8_UMAX 255
+#endif
+
+#if defined(UNET_Q8_VL)
+#define UNET_Q8_OB (2*UNET_Q8_VL)
+#else
+#define UNET_Q8_OB 8
+#endif
+
+const char * unet_conv_2d_int8_kernel_name(void)
+{
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    return "avx512-vnni";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "scalar";
+#endif
+}
+
+void unet_conv_2d_int8_prepare(unet_int8_conv & conv, const float * kernel, const float * scale_shift, float act_min, float act_max)
+{
+    const int OB = UNET_Q8_OB;
+    const int kw = conv.kw;
+    const int kh = conv.kh;
+    const int n_in  = conv.n_in;
+    const int n_out = conv.n_out;
+    const int n_inq = (n_in + 3)/4;
+    const int n_blocks = (n_out + OB - 1)/OB;
+
+    // inputs of the convs after a ReLU are never negative and use the full range
+    if (act_min >= 0.0f) {
+        conv.act_zero  = 0;
+        conv.act_scale = act_max/UNET_Q8_UMAX;
+    } else {
+        conv.act_zero  = (UNET_Q8_UMAX + 1)/2;
+        conv.act_scale = std::max(-act_min, act_max)/(UNET_Q8_UMAX - conv.act_zero);
+    }
+    if (!(conv.act_scale > 0.0f)) {
+        conv.act_scale = 1.0f;
+    }
+
+    conv.weights.assign((size_t)n_blocks*n_inq*kh*kw*OB*4, 0);
+    conv.comp.assign((size_t)n_blocks*OB, 0);
+    conv.scale.assign((size_t)n_blocks*OB, 0.0f);
+    conv.shift.assign((size_t)n_blocks*OB, 0.0f);
+
+    const size_t n_k = (size_t)kw*kh*n_in;
+    for (int oc = 0; oc < n_out; oc++) {
+        const float * w = kernel + oc*n_k;
+        float w_max = 0.0f;
+        for (size_t k = 0; k < n_k; k++) {
+            w_max = std::max(w_max, std::fabs(w[k]));
+        }
+        const float w_scale = w_max > 0.0f ? w_max/127.0f : 1.0f;
+
+        const int ob = oc/OB;
+        const int o  = oc % OB;
+        int32_t sum = 0;
+        for (int ic = 0; ic < n_in; ic++) {
+            for (int ky = 0; ky < kh; ky++) {
+                for (int kx = 0; kx < kw; kx++) {
+                    const int q = std::min(127, std::max(-127, (int) lrintf(w[((size_t)ic*kh + ky)*kw + kx]/w_scale)));
+                    conv.weights[(((((size_t)ob*n_inq + ic/4)*kh + ky)*kw + kx)*OB + o)*4 + ic % 4] = (int8_t) q;
+                    sum += q;
+                }
+            }
+        }
+        // every tap adds act_zero*w, padding included, so it comes off as one term
+        conv.comp[oc]  = conv.act_zero*sum;
+        conv.scale[oc] = conv.act_scale*w_scale*(scale_shift ? scale_shift[oc] : 1.0f);
+        conv.shift[oc] = scale_shift ? scale_shift[n_out + oc] : 0.0f;
+    }
+}
+
+// acc[rx*OB + o] = sum over icq, ky, kx and the 4 channels of a group of rows*w
+static void unet_conv_2d_int8_tile(const uint8_t * rows, const int8_t * w, int32_t * acc, int n_inq, int kw, int kh, int row_size, int s)
+{
+    const int OB = UNET_Q8_OB;
+    const int RX = UNET_Q8_RX;
+
+#if defined(UNET_Q8_VL)
+#if UNET_Q8_VL == 16
+    __m512i acc0[RX];
+    __m512i acc1[RX];
+    for (int rx = 0; rx < RX; rx++) {
+        acc0[rx] = _mm512_setzero_si512();
+        acc1[rx] = _mm512_setzero_si512();
+    }
+#else
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc0[RX];
+    __m256i acc1[RX];
+    for (int rx = 0; rx < RX; rx++) {
+        acc0[rx] = _mm256_setzero_si256();
+        acc1[rx] = _mm256_setzero_si256();
+    }
+#endif
+    for (int icq = 0; icq < n_inq; icq++) {
+        for (int ky = 0; ky < kh; ky++) {
+            const uint8_t * row = rows + ((size_t)ky*n_inq + icq)*row_size*4;
+            const int8_t  * wk  = w + (((size_t)icq*kh + ky)*kw)*OB*4;
+            for (int kx = 0; kx < kw; kx++) {
+#if UNET_Q8_VL == 16
+                const __m512i w0 = _mm512_loadu_si512(wk + kx*OB*4);
+                const __m512i w1 = _mm512_loadu_si512(wk + kx*OB*4 + 64);
+#else
+                const __m256i w0 = _mm256_loadu_si256((const __m256i *)(wk + kx*OB*4));
+                const __m256i w1 = _mm256_loadu_si256((const __m256i *)(wk + kx*OB*4 + 32));
+#endif
+                for (int rx = 0; rx < RX; rx++) {
+                    int32_t quad;
+                    memcpy(&quad, row + (rx*s + kx)*4, 4);
+#if UNET_Q8_VL == 16
+                    const __m512i x = _mm512_set1_epi32(quad);
+                    acc0[rx] = _mm512_dpbusd_epi32(acc0[rx], x, w0);
+                    acc1[rx] = _mm512_dpbusd_epi32(acc1[rx], x, w1);
+#else
+                    const __m256i x = _mm256_set1_epi32(quad);
+                    acc0[rx] = _mm256_add_epi32(acc0[rx], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w0), ones));
+                    acc1[rx] = _mm256_add_epi32(acc1[rx], _mm256_madd_epi16(_mm256_maddubs_epi16(x, w1), ones));
+#endif
+                }
+            }
+        }
+    }
+    for (int rx = 0; rx < RX; rx++) {
+#if UNET_Q8_VL == 16
+        _mm512_storeu_si512(acc + rx*OB, acc0[rx]);
+        _mm512_storeu_si512(acc + rx*OB + UNET_Q8_VL, acc1[rx]);
+#else
+        _mm256_storeu_si256((__m256i *)(acc + rx*OB), acc0[rx]);
+        _mm256_storeu_si256((__m256i *)(acc + rx*OB + UNET_Q8_VL), acc1[rx]);
+#endif
+    }
+#else
+    for (int i = 0; i < RX*OB; i++) {
+        acc[i] = 0;
+    }
+    for (int icq = 0; icq < n_inq; icq++) {
+        for (int ky = 0; ky < kh; ky++) {
+            const uint8_t * row = rows + ((size_t)ky*n_inq + icq)*row_size*4;
+            const int8_t  * wk  = w + (((size_t)icq*kh + ky)*kw)*OB*4;
+            for (int kx = 0; kx < kw; kx++) {
+                for (int rx = 0; rx < RX; rx++) {
+                    const uint8_t * x = row + (rx*s + kx)*4;
+                    for (int o = 0; o < OB; o++) {
+                        const int8_t * wo = wk + (kx*OB + o)*4;
+                        acc[rx*OB + o] += x[0]*wo[0] + x[1]*wo[1] + x[2]*wo[2] + x[3]*wo[3];
+                    }
+                }
+            }
+        }
+    }
+#endif
+}
+
+static void unet_conv_2d_int8_impl(struct ggml_tensor * dst, const struct ggml_tensor * input, const struct ggml_tensor * residual, int ith, int nth, const unet_int8_conv & conv)
+{
+    const int OB = UNET_Q8_OB;
+    const int RX = UNET_Q8_RX;
+
+    const int W     = input->ne[0];
+    const int H     = input->ne[1];
+    const int n_in  = conv.n_in;
+    const int n_inq = (n_in + 3)/4;
+    const int N     = input->ne[3];
+    const int kw    = conv.kw;
+    const int kh    = conv.kh;
+    const int s     = conv.stride;
+    const int p     = conv.padding;
+    const int OW    = dst->ne[0];
+    const int OH    = dst->ne[1];
+    const int n_out = conv.n_out;
+    const int n_blocks = (n_out + OB - 1)/OB;
+
+    const int n_tiles_x = (OW + RX - 1)/RX;
+    const int row_size  = (n_tiles_x*RX - 1)*s + kw;
+
+    // quantized input rows, [KH][IC/4][row_size][4]
+    static thread_local std::vector<uint8_t> rows;
+    static thread_local std::vector<int32_t> acc;
+    rows.resize((size_t)kh*n_inq*row_size*4);
+    acc.resize((size_t)RX*OB);
+
+    const float inv_scale = 1.0f/conv.act_scale;
+    const uint8_t zero = (uint8_t) conv.act_zero;
+    const bool relu = conv.relu || residual;
+    const float lo = relu ? 0.0f : -INFINITY;
+
+    const char  * src = (const char *) input->data;
+    const float * res = residual ? (const float *) residual->data : NULL;
+    float       * out = (float *) dst->data;
+
+    for (int r = ith; r < N*OH; r += nth) {
+        const int n  = r/OH;
+        const int oy = r % OH;
+
+        for (int ky = 0; ky < kh; ky++) {
+            const int iy = oy*s - p + ky;
+            for (int icq = 0; icq < n_inq; icq++) {
+                uint8_t * row = rows.data() + ((size_t)ky*n_inq + icq)*row_size*4;
+                for (int j = 0; j < 4; j++) {
+                    const int ic = icq*4 + j;
+                    if (iy < 0 || iy >= H || ic >= n_in) {
+                        for (int xp = 0; xp < row_size; xp++) {
+                            row[xp*4 + j] = zero;
+                        }
+                        continue;
+                    }
+                    const char * line = src + ic*input->nb[2] + n*input->nb[3] + iy*input->nb[1];
+                    for (int xp = 0; xp < row_size; xp++) {
+                        const int ix = xp - p;
+                        if (ix < 0 || ix >= W) {
+                            row[xp*4 + j] = zero;
+                            continue;
+                        }
+                        const int q = (int) lrintf(*(const float *)(line + ix*input->nb[0])*inv_scale) + conv.act_zero;
+                        row[xp*4 + j] = (uint8_t) std::min(UNET_Q8_UMAX, std::max(0, q));
+                    }
+                }
+            }
+        }
+
+        for (int ob = 0; ob < n_blocks; ob++) {
+            const int8_t * w = conv.weights.data() + (size_t)ob*n_inq*kh*kw*OB*4;
+            const int n_o = std::min(OB, n_out - ob*OB);
+            for (int tx = 0; tx < n_tiles_x; tx++) {
+                const int ox0 = tx*RX;
+                const int n_x = std::min(RX, OW - ox0);
+                unet_conv_2d_int8_tile(rows.data() + (size_t)ox0*s*4, w, acc.data(), n_inq, kw, kh, row_size, s);
+                // requantization, bias, batch norm, residual and ReLU in one step
+                for (int o = 0; o < n_o; o++) {
+                    const int oc = ob*OB + o;
+                    const size_t i0 = (((size_t)n*n_out + oc)*OH + oy)*OW + ox0;
+                    const int32_t comp  = conv.comp[oc];
+                    const float   scale = conv.scale[oc];
+                    const float   shift = conv.shift[oc];
+                    for (int rx = 0; rx < n_x; rx++) {
+                        float y = (acc[rx*OB + o] - comp)*scale + shift;
+                        if (res) {
+                            y += res[i0 + rx];
+                        }
+                        out[i0 + rx] = std::max(y, lo);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void unet_conv_2d_int8_op(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata)
+{
+    unet_conv_2d_int8_impl(dst, a, NULL, ith, nth, *(const unet_int8_conv *) userdata);
+}
+
+static void unet_conv_2d_int8_residual_op(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b, int ith, int nth, void * userdata)
+{
+    unet_conv_2d_int8_impl(dst, a, b, ith, nth, *(const unet_int8_conv *) userdata);
+}
+
+struct ggml_tensor * unet_conv_2d_int8(struct ggml_context * ctx, const unet_int8_conv * conv, struct ggml_tensor * input, struct ggml_tensor * residual)
+{
+    GGML_ASSERT(input->type == GGML_TYPE_F32 && input->ne[2] == conv->n_in);
+
+    const int64_t OW = (input->ne[0] + 2*conv->padding - conv->kw)/conv->stride + 1;
+    const int64_t OH = (input->ne[1] + 2*conv->padding - conv->kh)/conv->stride + 1;
+
+    void * userdata = (void *) conv;
+    struct ggml_tensor * result;
+    if (residual) {
+        GGML_ASSERT(residual->type == GGML_TYPE_F32 && ggml_is_contiguous(residual));
+        GGML_ASSERT(residual->ne[0] == OW && residual->ne[1] == OH && residual->ne[2] == conv->n_out && residual->ne[3] == input->ne[3]);
+        result = ggml_map_custom2(ctx, input, residual, unet_conv_2d_int8_residual_op, GGML_N_TASKS_MAX, userdata);
+    } else {
+        result = ggml_map_custom1(ctx, input, unet_conv_2d_int8_op, GGML_N_TASKS_MAX, userdata);
+    }
+    unet_set_shape(result, GGML_TYPE_F32, OW, OH, conv->n_out, input->ne[3]);
+    return result;
+}
+
+static void unet_observe_range_op(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata)
+{
+    GGML_UNUSED(dst);
+    GGML_UNUSED(ith);
+    GGML_UNUSED(nth);
+
+    float * range = (float *) userdata;
+    for (int64_t i3 = 0; i3 < a->ne[3]; i3++) {
+        for (int64_t i2 = 0; i2 < a->ne[2]; i2++) {
+            for (int64_t i1 = 0; i1 < a->ne[1]; i1++) {
+                const float * x = (const float *)((const char *) a->data + i1*a->nb[1] + i2*a->nb[2] + i3*a->nb[3]);
+                for (int64_t i0 = 0; i0 < a->ne[0]; i0++) {
+                    range[0] = std::min(range[0], x[i0]);
+                    range[1] = std::max(range[1], x[i0]);
+                }
+            }
+        }
+    }
+}
+
+struct ggml_tensor * unet_observe_range(struct ggml_context * ctx, struct ggml_tensor * x, float * range)
+{
+    GGML_ASSERT(x->type == GGML_TYPE_F32 && x->nb[0] == sizeof(float));
+
+    // one task, the range is shared
+    return ggml_map_custom1_inplace(ctx, x, unet_observe_range_op, 1, range);
+}
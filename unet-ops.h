@@ -0,0 +1,77 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <vector>
+
+// custom CPU operators for the unet graph, built on ggml_map_custom*
+
+// ggml_map_custom* results take the shape of their first operand. Graph contexts
+// are no_alloc, so the result can be re-shaped before the allocator sees it.
+void unet_set_shape(struct ggml_tensor * t, enum ggml_type type, int64_t ne0, int64_t ne1, int64_t ne2, int64_t ne3);
+
+// Winograd F(2x2,3x3) for 3x3 convolutions with stride 1 and padding 1
+// kernel:   [3, 3, IC, OC] as used by ggml_conv_2d
+// transformed: [OC, IC, 16], computed once at load time
+void unet_winograd_transform_kernel(const float * kernel, float * transformed, int n_in, int n_out);
+
+// kernel: transformed weights [OC, IC, 16], input: [W, H, IC, N] -> result: [W, H, OC, N]
+struct ggml_tensor * unet_conv_2d_3x3_winograd(struct ggml_context * ctx, struct ggml_tensor * kernel, struct ggml_tensor * input);
+
+// blocked direct convolution for any kernel size, stride and padding
+// output channels are blocked by unet_conv_2d_direct_block(), twice the SIMD width
+// kernel: [KW, KH, IC, OC] as used by ggml_conv_2d
+// packed: [OB*KW, KH, IC, OC/OB] with OC rounded up, computed once at load time
+int unet_conv_2d_direct_block(void);
+void unet_conv_2d_direct_repack_kernel(const float * kernel, float * packed, int kw, int kh, int n_in, int n_out);
+
+// kernel: packed weights, input: [W, H, IC, N] -> result: [OW, OH, n_out, N]
+struct ggml_tensor * unet_conv_2d_direct(struct ggml_context * ctx, struct ggml_tensor * kernel, struct ggml_tensor * input, int n_out, int stride, int padding);
+
+// tiles for region-sparse execution, tile_pos: I32 [2*K] of (tx, ty)
+// a tile of size P with margin m starts at t*(P - 2*m) - m in its source
+// src: [W, H, C, 1] -> [P, P, C, K], zero outside the source
+struct ggml_tensor * unet_gather_tiles(struct ggml_context * ctx, struct ggml_tensor * src, struct ggml_tensor * tile_pos, int size, int margin);
+// zeroes the tile pixels that fall outside ref [W, H, ...]
+struct ggml_tensor * unet_mask_tiles(struct ggml_context * ctx, struct ggml_tensor * tiles, struct ggml_tensor * tile_pos, struct ggml_tensor * ref, int margin);
+// tiles: [P, P, 1, K] -> [width, height, 1, 1], pixels outside the tiles are -inf
+struct ggml_tensor * unet_scatter_tiles(struct ggml_context * ctx, struct ggml_tensor * tiles, struct ggml_tensor * tile_pos, int width, int height, int margin);
+
+// fused conv epilogue: relu(x*scale[c] + shift[c] + residual) without
+// broadcast tensors, scale_shift holds the C scales followed by the C shifts
+// residual may be NULL, x: [W, H, C, N]
+struct ggml_tensor * unet_conv_epilogue(struct ggml_context * ctx, struct ggml_tensor * x, struct ggml_tensor * scale_shift, struct ggml_tensor * residual, bool relu);
+
+// calibrated INT8 convolution: uint8 activations quantized on the fly with a
+// per-tensor scale, int8 weights with a per-channel scale, int32 accumulation
+// and the requantization folded into the conv epilogue
+struct unet_int8_conv {
+    int kw = 0;
+    int kh = 0;
+    int n_in = 0;
+    int n_out = 0;
+    int stride = 1;
+    int padding = 0;
+    bool relu = false;
+    float act_scale = 1.0f;         // x_q = round(x/act_scale) + act_zero
+    int act_zero = 0;
+    std::vector<int8_t> weights;    // [OC/OB][IC/4][KH][KW][OB][4]
+    std::vector<int32_t> comp;      // act_zero*sum of the weights of a channel
+    std::vector<float> scale;       // act_scale*weight scale*epilogue scale
+    std::vector<float> shift;
+};
+
+// avx512-vnni, avx2 (7 bit activations) or scalar
+const char * unet_conv_2d_int8_kernel_name(void);
+
+// conv: geometry set, kernel: [KW, KH, IC, OC] as used by ggml_conv_2d,
+// scale_shift: folded epilogue or NULL, act_min/act_max: calibrated input range
+void unet_conv_2d_int8_prepare(unet_int8_conv & conv, const float * kernel, const float * scale_shift, float act_min, float act_max);
+
+// input: [W, H, IC, N] -> result: [OW, OH, OC, N], residual like the result or NULL
+// conv is read when the graph is computed and has to outlive it
+struct ggml_tensor * unet_conv_2d_int8(struct ggml_context * ctx, const unet_int8_conv * conv, struct ggml_tensor * input, struct ggml_tensor * residual);
+
+// records min and max of x into range[0], range[1] when the graph is computed
+struct ggml_tensor * unet_observe_range(struct ggml_context * ctx, struct ggml_tensor * x, float * range);
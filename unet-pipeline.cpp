@@ -0,0 +1,330 @@
+#include "unet-pipeline.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// threads started by the backend inherit the affinity of the segment thread
+static void unet_pin_thread(int first_cpu, int n_cpus)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < n_cpus; i++) {
+        CPU_SET(first_cpu + i, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "%s: failed to pin to cpus %d-%d\n", __func__, first_cpu, first_cpu + n_cpus - 1);
+    }
+#else
+    GGML_UNUSED(first_cpu);
+    GGML_UNUSED(n_cpus);
+#endif
+}
+
+// conv FLOPs of every graph part, following the resolution through the layer table
+static std::vector<double> unet_part_flops(const unet_model & model)
+{
+    const std::vector<unet_conv2d_layer> & layers = model.conv2d_layers;
+    auto conv_flops = [&](int il, int w, int h) {
+        const ggml_tensor * k = layers[il].weights;
+        return 2.0*w*h*k->ne[0]*k->ne[1]*k->ne[2]*k->ne[3];
+    };
+
+    std::vector<double> flops(unet_n_parts(model), 0.0);
+    std::vector<std::pair<int, int>> taps;
+
+    int w = model.width/layers[0].strike;
+    int h = model.height/layers[0].strike;
+    flops[0] = conv_flops(0, w, h);
+    taps.push_back({ w, h });
+    w /= 2;
+    h /= 2;
+
+    for (size_t s = 0; s < model.stages.size(); s++) {
+        for (const auto & block : model.stages[s]) {
+            if (block.shortcut >= 0) {
+                flops[s + 1] += conv_flops(block.shortcut, w/layers[block.shortcut].strike, h/layers[block.shortcut].strike);
+            }
+            for (int il : block.convs) {
+                w /= layers[il].strike;
+                h /= layers[il].strike;
+                flops[s + 1] += conv_flops(il, w, h);
+            }
+        }
+        taps.push_back({ w, h });
+    }
+
+    double & decoder = flops.back();
+    int il = layers.size() - model.skips.size() - 2;
+    for (int tap : model.skips) {
+        decoder += conv_flops(il++, taps[tap].first, taps[tap].second);
+    }
+    decoder += conv_flops(il++, model.width, model.height);
+    decoder += conv_flops(il++, model.width, model.height);
+    return flops;
+}
+
+static void unet_pipeline_worker(unet_pipeline * pipe, int k, int first_cpu, bool pin)
+{
+    if (pin) {
+        unet_pin_thread(first_cpu, pipe->threads[k]);
+    }
+
+    const int n_segments = pipe->backends.size();
+    const int n_slots    = pipe->slots.size();
+    for (int frame = 0; ; frame++) {
+        unet_pipeline_slot & slot = pipe->slots[frame % n_slots];
+        {
+            std::unique_lock<std::mutex> lock(pipe->mutex);
+            // a later frame in the slot means this one was dropped before reaching us
+            pipe->cv.wait(lock, [&] { return pipe->stop || slot.frame > frame || (slot.frame == frame && slot.next >= k); });
+            if (pipe->stop) {
+                return;
+            }
+            if (slot.frame != frame || slot.next != k) {
+                continue;
+            }
+        }
+
+        const int64_t t0 = ggml_time_us();
+        if (slot.ok && ggml_backend_graph_compute(pipe->backends[k], slot.gf[k]) != GGML_STATUS_SUCCESS) {
+            fprintf(stderr, "%s: segment %d: ggml_backend_graph_compute() failed\n", __func__, k);
+            slot.ok = false;
+        }
+        const int64_t t1 = ggml_time_us();
+        slot.timings.us[UNET_STAGE_COMPUTE] += t1 - t0;
+        if (k == n_segments - 1 && slot.ok) {
+            slot.res = read_result_unet(slot.gf[k], *pipe->model, slot.mask, slot.result, slot.timings.us, t1);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pipe->mutex);
+            slot.next = k + 1;
+        }
+        pipe->cv.notify_all();
+    }
+}
+
+bool unet_pipeline_init(unet_pipeline & pipe, const unet_model & model, int n_threads, const std::vector<int> & threads, float thresh)
+{
+    if (!ggml_backend_is_cpu(model.backend)) {
+        fprintf(stderr, "%s: pipeline-parallel execution needs the CPU backend\n", __func__);
+        return false;
+    }
+    pipe.model = &model;
+
+    // stem + first stage | middle stages | last stage | decoder
+    const int n_parts = unet_n_parts(model);
+    pipe.part_begin.clear();
+    for (int b : { 0, 2, n_parts - 2, n_parts - 1, n_parts }) {
+        if (pipe.part_begin.empty() || b > pipe.part_begin.back()) {
+            pipe.part_begin.push_back(b);
+        }
+    }
+    const int n_segments = pipe.part_begin.size() - 1;
+
+    pipe.threads = threads;
+    if (pipe.threads.empty()) {
+        // core groups sized by the work of each segment
+        const std::vector<double> flops = unet_part_flops(model);
+        std::vector<double> seg_flops(n_segments, 0.0);
+        double total = 0.0;
+        for (int k = 0; k < n_segments; k++) {
+            for (int p = pipe.part_begin[k]; p < pipe.part_begin[k + 1]; p++) {
+                seg_flops[k] += flops[p];
+            }
+            total += seg_flops[k];
+        }
+        int n_assigned = 0;
+        for (int k = 0; k < n_segments; k++) {
+            pipe.threads.push_back(std::max(1, (int) (n_threads*seg_flops[k]/total)));
+            n_assigned += pipe.threads.back();
+        }
+        // hand out the remainder to the segments with the most work per thread
+        while (n_assigned < n_threads) {
+            int best = 0;
+            for (int k = 1; k < n_segments; k++) {
+                if (seg_flops[k]/pipe.threads[k] > seg_flops[best]/pipe.threads[best]) {
+                    best = k;
+                }
+            }
+            pipe.threads[best]++;
+            n_assigned++;
+        }
+    }
+    if ((int) pipe.threads.size() != n_segments) {
+        fprintf(stderr, "%s: %d thread counts given for %d segments\n", __func__, (int) pipe.threads.size(), n_segments);
+        return false;
+    }
+
+    for (int k = 0; k < n_segments; k++) {
+        ggml_backend_t backend = ggml_backend_cpu_init();
+        ggml_backend_cpu_set_n_threads(backend, pipe.threads[k]);
+        pipe.backends.push_back(backend);
+    }
+
+    // one slot per segment, each with the full set of segment graphs
+    pipe.slots.resize(n_segments);
+    for (auto & slot : pipe.slots) {
+        std::vector<struct ggml_tensor *> taps;
+        for (int k = 0; k < n_segments; k++) {
+            struct ggml_init_params params = {
+                /*.mem_size   =*/ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            struct ggml_context * ctx = ggml_init(params);
+            // the taps of earlier segments are allocated by now
+            struct ggml_cgraph * gf = build_graph_unet_segment(ctx, model, pipe.part_begin[k], pipe.part_begin[k + 1], taps);
+            ggml_gallocr_t allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+            slot.ctx.push_back(ctx);
+            slot.gf.push_back(gf);
+            slot.allocr.push_back(allocr);
+            if (!ggml_gallocr_alloc_graph(allocr, gf)) {
+                fprintf(stderr, "%s: ggml_gallocr_alloc_graph() failed\n", __func__);
+                return false;
+            }
+        }
+        const float logit_thresh = unet_logit(thresh);
+        ggml_backend_tensor_set(ggml_graph_get_tensor(slot.gf.back(), "logit_thresh"), &logit_thresh, 0, sizeof(float));
+        slot.sized.resize(model.width, model.height, 3);
+        slot.result.resize(model.width, model.height, 1);
+    }
+
+    // pin only when the groups fit on the machine
+    int n_total = 0;
+    for (int t : pipe.threads) {
+        n_total += t;
+    }
+    const bool pin = n_total <= (int) std::thread::hardware_concurrency();
+
+    fprintf(stderr, "%s: %d segments on core groups of", __func__, n_segments);
+    for (int k = 0; k < n_segments; k++) {
+        fprintf(stderr, " %d", pipe.threads[k]);
+    }
+    fprintf(stderr, " threads%s\n", pin ? "" : " (not pinned)");
+
+    pipe.stop = false;
+    int first_cpu = 0;
+    for (int k = 0; k < n_segments; k++) {
+        pipe.workers.emplace_back(unet_pipeline_worker, &pipe, k, first_cpu, pin);
+        first_cpu += pipe.threads[k];
+    }
+    return true;
+}
+
+void unet_pipeline_free(unet_pipeline & pipe)
+{
+    {
+        std::lock_guard<std::mutex> lock(pipe.mutex);
+        pipe.stop = true;
+    }
+    pipe.cv.notify_all();
+    for (auto & worker : pipe.workers) {
+        worker.join();
+    }
+    pipe.workers.clear();
+
+    for (auto & slot : pipe.slots) {
+        for (size_t k = 0; k < slot.ctx.size(); k++) {
+            ggml_gallocr_free(slot.allocr[k]);
+            ggml_free(slot.ctx[k]);
+        }
+    }
+    pipe.slots.clear();
+    for (auto backend : pipe.backends) {
+        ggml_backend_free(backend);
+    }
+    pipe.backends.clear();
+}
+
+unet_pipeline::~unet_pipeline()
+{
+    unet_pipeline_free(*this);
+}
+
+bool unet_pipeline_run(unet_pipeline & pipe, int n_frames,
+        const std::function<bool(int frame, unet_image_u8 & img)> & load,
+        const std::function<bool(int frame, unet_pipeline_slot & slot)> & done)
+{
+    const unet_model & model = *pipe.model;
+    const int n_segments = pipe.backends.size();
+    const int n_slots    = pipe.slots.size();
+
+    // slots and segments count frames across runs
+    const int base = pipe.n_submitted;
+
+    bool ok = true;
+    auto finish = [&](unet_pipeline_slot & slot) {
+        if (slot.frame < 0 || slot.finished) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(pipe.mutex);
+            pipe.cv.wait(lock, [&] { return slot.next == n_segments; });
+        }
+        if (slot.loaded) {
+            ok = slot.ok && done(slot.frame - base, slot) && ok;
+        }
+        slot.finished = true;
+    };
+
+    int frame = 0;
+    for (; frame < n_frames; frame++) {
+        const int id = base + frame;
+        unet_pipeline_slot & slot = pipe.slots[id % n_slots];
+        finish(slot);
+
+        if (!ok) {
+            break;
+        }
+
+        slot.timings = unet_frame_timings();
+        int64_t t0 = ggml_time_us();
+        if (!load(frame, pipe.pool.decoded)) {
+            // let the segments skip the slot
+            {
+                std::lock_guard<std::mutex> lock(pipe.mutex);
+                slot.frame = id;
+                slot.next = n_segments;
+                slot.ok = false;
+                slot.loaded = false;
+                slot.finished = false;
+            }
+            pipe.cv.notify_all();
+            continue;
+        }
+        int64_t t1 = ggml_time_us();
+        slot.timings.us[UNET_STAGE_DECODE] = t1 - t0;
+
+        letterbox_image_unet(pipe.pool.decoded, slot.sized, model.width, model.height, pipe.pool);
+        t0 = ggml_time_us();
+        slot.timings.us[UNET_STAGE_LETTERBOX] = t0 - t1;
+
+        struct ggml_tensor * input = ggml_graph_get_tensor(slot.gf[0], "input");
+        ggml_backend_tensor_set(input, slot.sized.data.data(), 0, ggml_nbytes(input));
+        slot.timings.us[UNET_STAGE_UPLOAD] = ggml_time_us() - t0;
+
+        {
+            std::lock_guard<std::mutex> lock(pipe.mutex);
+            slot.frame = id;
+            slot.next = 0;
+            slot.ok = true;
+            slot.loaded = true;
+            slot.finished = false;
+        }
+        pipe.cv.notify_all();
+    }
+    pipe.n_submitted += frame;
+
+    // drain the frames still in flight, in order
+    for (int id = std::max(base, base + frame - n_slots); id < base + frame; id++) {
+        unet_pipeline_slot & slot = pipe.slots[id % n_slots];
+        if (slot.frame == id) {
+            finish(slot);
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "unet.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// pipeline-parallel inference: the graph is split into segments (stem and first
+// encoder stage, middle encoder stages, last encoder stage, decoder), each run
+// by its own thread and CPU backend pinned to a core group. Stage outputs and
+// skip tensors stay in the buffers of their frame slot and are read by later
+// segments through views. The skips span the whole pipeline, so there is one
+// slot per segment and every segment works on a different frame
+
+struct unet_pipeline_slot {
+    std::vector<struct ggml_context *> ctx;
+    std::vector<struct ggml_cgraph *> gf;
+    std::vector<ggml_gallocr_t> allocr;
+
+    unet_image sized;
+    unet_image_u8 result;
+    std::vector<uint32_t> mask;
+    unet_result res;
+    unet_frame_timings timings;
+
+    // frame stays set after the frame is done, the segments use it to tell a
+    // finished or skipped frame from one still to come
+    int frame = -1;
+    int next = 0;     // next segment to run, n_segments once the frame is done
+    bool ok = true;
+    bool loaded = true;
+    bool finished = false;  // handed to done, only touched by the calling thread
+};
+
+struct unet_pipeline {
+    const unet_model * model = NULL;
+    std::vector<int> part_begin;    // segment k runs parts [part_begin[k], part_begin[k + 1])
+    std::vector<int> threads;       // per segment
+    std::vector<ggml_backend_t> backends;
+    std::vector<unet_pipeline_slot> slots;
+    unet_image_pool pool;
+    int n_submitted = 0;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+
+    // joins the workers, so an early return after unet_pipeline_init does not
+    // destroy joinable threads
+    ~unet_pipeline();
+};
+
+// threads: per segment, or empty to split n_threads by the conv FLOPs of each segment
+bool unet_pipeline_init(unet_pipeline & pipe, const unet_model & model, int n_threads, const std::vector<int> & threads, float thresh);
+void unet_pipeline_free(unet_pipeline & pipe);
+
+// runs frames [0, n_frames): load decodes a frame into img on the calling
+// thread, done gets the finished frames in order, also on the calling thread.
+// frames that fail to load are skipped, returns false and stops when a frame
+// fails to compute or done returns false
+bool unet_pipeline_run(unet_pipeline & pipe, int n_frames,
+        const std::function<bool(int frame, unet_image_u8 & img)> & load,
+        const std::function<bool(int frame, unet_pipeline_slot & slot)> & done);
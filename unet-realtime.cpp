@@ -0,0 +1,101 @@
+#include "unet-realtime.h"
+
+#include "ggml.h"
+
+#include <cstring>
+
+static const char * UNET_RT_POLICY_NAMES[] = {
+    "drop-oldest",
+    "drop-newest",
+    "degrade",
+};
+
+bool unet_rt_parse_policy(const char * name, unet_rt_policy & policy)
+{
+    for (int i = 0; i <= UNET_RT_DEGRADE; i++) {
+        if (strcmp(name, UNET_RT_POLICY_NAMES[i]) == 0) {
+            policy = (unet_rt_policy) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * unet_rt_policy_name(unet_rt_policy policy)
+{
+    return UNET_RT_POLICY_NAMES[policy];
+}
+
+unet_rt_frame unet_rt_acquire(unet_rt_queue & queue)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.spare.empty()) {
+        return unet_rt_frame();
+    }
+    unet_rt_frame frame = std::move(queue.spare.back());
+    queue.spare.pop_back();
+    return frame;
+}
+
+void unet_rt_release(unet_rt_queue & queue, unet_rt_frame && frame)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.spare.push_back(std::move(frame));
+}
+
+void unet_rt_push(unet_rt_queue & queue, unet_rt_frame && frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.counters.n_arrived++;
+        if ((int) queue.frames.size() >= queue.depth) {
+            queue.counters.n_dropped++;
+            if (queue.policy == UNET_RT_DROP_NEWEST) {
+                queue.spare.push_back(std::move(frame));
+                return;
+            }
+            queue.spare.push_back(std::move(queue.frames.front()));
+            queue.frames.pop_front();
+        }
+        queue.frames.push_back(std::move(frame));
+    }
+    queue.cv.notify_one();
+}
+
+void unet_rt_close(unet_rt_queue & queue)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.closed = true;
+    }
+    queue.cv.notify_one();
+}
+
+bool unet_rt_pop(unet_rt_queue & queue, unet_rt_frame & frame)
+{
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    for (;;) {
+        queue.cv.wait(lock, [&] { return queue.closed || !queue.frames.empty(); });
+        if (queue.frames.empty()) {
+            return false;
+        }
+        frame = std::move(queue.frames.front());
+        queue.frames.pop_front();
+        if (ggml_time_us() < frame.t_deadline_us) {
+            return true;
+        }
+        queue.counters.n_expired++;
+        queue.spare.push_back(std::move(frame));
+    }
+}
+
+void unet_rt_write_summary(FILE * f, const unet_rt_queue & queue)
+{
+    const unet_rt_counters & c = queue.counters;
+    fprintf(f, "{\"realtime\": {\"policy\": \"%s\", \"queue_depth\": %d, \"arrived\": %d, \"full\": %d, \"degraded\": %d, "
+               "\"dropped\": %d, \"expired\": %d, \"missed\": %d, ",
+            unet_rt_policy_name(queue.policy), queue.depth, c.n_arrived, c.n_full, c.n_degraded, c.n_dropped, c.n_expired, c.n_missed);
+    fprintf(f, "\"latency\": {\"count\": %llu, \"p50_us\": %lld, \"p99_us\": %lld, \"max_us\": %lld}}}\n",
+            (unsigned long long) c.latency.count, (long long) c.latency.percentile(50), (long long) c.latency.percentile(99), (long long) c.latency.max);
+    fflush(f);
+}
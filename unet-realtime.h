@@ -0,0 +1,67 @@
+#pragma once
+
+#include "unet-image.h"
+#include "unet-stats.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// real-time mode: frames arrive at the camera rate and wait in a bounded
+// admission queue, each with a deadline relative to its arrival. Frames whose
+// deadline has passed before they start are dropped, so the latency stays
+// bounded by the queue depth and the deadline when the detector falls behind
+
+enum unet_rt_policy {
+    UNET_RT_DROP_OLDEST,    // a full queue evicts its oldest frame
+    UNET_RT_DROP_NEWEST,    // a full queue rejects the arriving frame
+    UNET_RT_DEGRADE,        // like drop-oldest, frames that would be late run the preview graph
+};
+
+bool unet_rt_parse_policy(const char * name, unet_rt_policy & policy);
+const char * unet_rt_policy_name(unet_rt_policy policy);
+
+struct unet_rt_frame {
+    int index = -1;
+    int64_t t_arrival_us  = 0;
+    int64_t t_deadline_us = 0;
+    int64_t t_decode_us   = 0;
+    unet_image_u8 img;
+};
+
+struct unet_rt_counters {
+    int n_arrived  = 0;
+    int n_full     = 0;     // finished with the full graph
+    int n_degraded = 0;     // finished with the preview graph
+    int n_dropped  = 0;     // evicted or rejected by a full queue
+    int n_expired  = 0;     // deadline passed while queued
+    int n_missed   = 0;     // finished after the deadline
+    unet_histogram latency; // arrival to result
+};
+
+struct unet_rt_queue {
+    unet_rt_policy policy = UNET_RT_DROP_OLDEST;
+    int depth = 2;
+
+    std::deque<unet_rt_frame> frames;
+    std::vector<unet_rt_frame> spare;   // recycled frames, their images keep the storage
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    unet_rt_counters counters;
+};
+
+// a frame to decode into, recycled when possible
+unet_rt_frame unet_rt_acquire(unet_rt_queue & queue);
+void unet_rt_release(unet_rt_queue & queue, unet_rt_frame && frame);
+
+// admits an arrived frame, applying the policy when the queue is full
+void unet_rt_push(unet_rt_queue & queue, unet_rt_frame && frame);
+// no more frames will arrive
+void unet_rt_close(unet_rt_queue & queue);
+// waits for the next frame that can still make its deadline,
+// returns false once the queue is closed and empty
+bool unet_rt_pop(unet_rt_queue & queue, unet_rt_frame & frame);
+
+void unet_rt_write_summary(FILE * f, const unet_rt_queue & queue);
@@ -0,0 +1,204 @@
+#include "unet-registry.h"
+
+#include <sstream>
+#include <sys/stat.h>
+
+bool unet_registry_read_list(unet_registry & reg, const std::string & fname)
+{
+    std::ifstream fin(fname);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+    std::string line;
+    for (int n_line = 1; std::getline(fin, line); n_line++) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        std::istringstream ss(line);
+        unet_registry_model entry;
+        if (!(ss >> entry.name) || entry.name[0] == '#') {
+            continue;
+        }
+        // the path is the rest of the line, it may contain spaces
+        std::getline(ss >> std::ws, entry.fname);
+        if (entry.fname.empty()) {
+            fprintf(stderr, "%s: %s:%d: model '%s' has no path\n", __func__, fname.c_str(), n_line, entry.name.c_str());
+            return false;
+        }
+        for (const auto & other : reg.models) {
+            if (other.name == entry.name) {
+                fprintf(stderr, "%s: %s:%d: model '%s' listed twice\n", __func__, fname.c_str(), n_line, entry.name.c_str());
+                return false;
+            }
+        }
+        reg.models.push_back(entry);
+    }
+    if (reg.models.empty()) {
+        fprintf(stderr, "%s: no models in '%s'\n", __func__, fname.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool unet_registry_init(unet_registry & reg)
+{
+    reg.backend = ggml_backend_cpu_init();
+    if (!reg.backend) {
+        fprintf(stderr, "%s: ggml_backend_cpu_init() failed\n", __func__);
+        return false;
+    }
+    ggml_backend_cpu_set_n_threads(reg.backend, reg.n_threads);
+    return true;
+}
+
+static size_t unet_model_bytes(const unet_model & model)
+{
+    size_t n = ggml_backend_buffer_get_size(model.buffer);
+    if (model.buffer_repack) {
+        n += ggml_backend_buffer_get_size(model.buffer_repack);
+    }
+    if (model.buffer_direct) {
+        n += ggml_backend_buffer_get_size(model.buffer_direct);
+    }
+    for (const auto & layer : model.conv2d_layers) {
+        if (layer.int8) {
+            n += layer.int8->weights.size() + layer.int8->comp.size()*(sizeof(int32_t) + 2*sizeof(float));
+        }
+    }
+    return n;
+}
+
+static void unet_registry_unload(unet_registry & reg, int k, unet_context & uctx)
+{
+    unet_registry_model & entry = reg.models[k];
+    if (reg.bound == k) {
+        unbind_context(uctx);
+        reg.bound = -1;
+    }
+    free_model(entry.model);
+    entry.model = unet_model();
+    entry.resident = false;
+    reg.n_resident -= entry.n_bytes;
+}
+
+// unloads least recently used models other than keep until need more bytes fit
+static void unet_registry_evict(unet_registry & reg, int keep, size_t need, unet_context & uctx)
+{
+    while (reg.budget > 0 && reg.n_resident + need > reg.budget) {
+        int lru = -1;
+        for (int k = 0; k < (int) reg.models.size(); k++) {
+            if (k != keep && reg.models[k].resident && (lru < 0 || reg.models[k].t_used < reg.models[lru].t_used)) {
+                lru = k;
+            }
+        }
+        if (lru < 0) {
+            return;
+        }
+        unet_registry_unload(reg, lru, uctx);
+        reg.n_evicted++;
+    }
+}
+
+static bool unet_registry_load(unet_registry & reg, int k, unet_context & uctx)
+{
+    unet_registry_model & entry = reg.models[k];
+
+    // a model seen before needs what it took last time. A new one the file
+    // size grown by the Winograd, F16, direct and INT8 copies of the kernels,
+    // as much as they grew the models loaded so far with the same options
+    struct stat st;
+    if (stat(entry.fname.c_str(), &st) == 0) {
+        entry.file_bytes = st.st_size;
+    }
+    const size_t need = entry.n_bytes > 0 ? entry.n_bytes : (size_t) (entry.file_bytes*reg.overhead);
+    unet_registry_evict(reg, k, need, uctx);
+
+    entry.model = unet_model();
+    entry.model.backend = reg.backend;
+    if (!load_model(entry.fname, entry.model, reg.n_threads, reg.winograd, reg.wtype, reg.use_mmap)) {
+        fprintf(stderr, "%s: failed to load model '%s' from '%s'\n", __func__, entry.name.c_str(), entry.fname.c_str());
+        free_model(entry.model);
+        entry.model = unet_model();
+        return false;
+    }
+    if (!unet_setup_conv_engines(entry.model, entry.fname, reg.conv_engine, reg.fname_conv_tune)) {
+        free_model(entry.model);
+        entry.model = unet_model();
+        return false;
+    }
+    if (reg.int8 && !unet_prepare_int8(entry.model)) {
+        free_model(entry.model);
+        entry.model = unet_model();
+        return false;
+    }
+
+    entry.resident = true;
+    entry.n_bytes = unet_model_bytes(entry.model);
+    entry.n_loads++;
+    reg.n_resident += entry.n_bytes;
+    reg.n_loads++;
+    if (entry.file_bytes > 0) {
+        reg.overhead = std::max(reg.overhead, (float) entry.n_bytes/entry.file_bytes);
+    }
+
+    // the estimate may have been short
+    unet_registry_evict(reg, k, 0, uctx);
+    return true;
+}
+
+const unet_model * unet_registry_select(unet_registry & reg, const std::string & name, unet_context & uctx)
+{
+    int k = name.empty() ? 0 : -1;
+    for (int i = 0; k < 0 && i < (int) reg.models.size(); i++) {
+        if (reg.models[i].name == name) {
+            k = i;
+        }
+    }
+    if (k < 0) {
+        fprintf(stderr, "%s: unknown model '%s'\n", __func__, name.c_str());
+        return NULL;
+    }
+
+    unet_registry_model & entry = reg.models[k];
+    entry.t_used = ++reg.clock;
+    entry.n_requests++;
+    if (!entry.resident && !unet_registry_load(reg, k, uctx)) {
+        return NULL;
+    }
+    if (reg.bound != k) {
+        if (!rebind_context(uctx, entry.model)) {
+            reg.bound = -1;
+            return NULL;
+        }
+        reg.bound = k;
+        reg.n_switches++;
+    }
+    return &entry.model;
+}
+
+void unet_registry_free(unet_registry & reg, unet_context & uctx)
+{
+    for (int k = 0; k < (int) reg.models.size(); k++) {
+        if (reg.models[k].resident) {
+            unet_registry_unload(reg, k, uctx);
+        }
+    }
+    ggml_backend_free(reg.backend);
+    reg.backend = NULL;
+}
+
+void unet_registry_write_summary(FILE * f, const unet_registry & reg)
+{
+    fprintf(f, "{\"models\": {\"budget\": %zu, \"resident_bytes\": %zu, \"loads\": %d, \"evicted\": %d, \"switches\": %d, \"per_model\": [",
+            reg.budget, reg.n_resident, reg.n_loads, reg.n_evicted, reg.n_switches);
+    for (size_t k = 0; k < reg.models.size(); k++) {
+        const unet_registry_model & entry = reg.models[k];
+        fprintf(f, "%s{\"name\": ", k > 0 ? ", " : "");
+        unet_write_json_string(f, entry.name.c_str());
+        fprintf(f, ", \"resident\": %s, \"bytes\": %zu, \"loads\": %d, \"requests\": %d}",
+                entry.resident ? "true" : "false", entry.n_bytes, entry.n_loads, entry.n_requests);
+    }
+    fprintf(f, "]}}\n");
+    fflush(f);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "unet.h"
+
+// several models resident in one process, selected per request by name. All
+// of them run on one CPU backend, so they share its thread pool, and through
+// one inference context whose compute and image buffers are kept when it is
+// rebound to another model. Weights are loaded on first use and the least
+// recently used models are unloaded when the resident weights exceed the
+// budget, an unloaded model is read again when it is selected next. The budget
+// is soft: room is made before a load from an estimate of the model, and the
+// resident weights can exceed it by the error of that estimate until the
+// eviction that follows the load
+
+struct unet_registry_model {
+    std::string name;
+    std::string fname;
+    unet_model model;
+    bool resident = false;
+    size_t n_bytes = 0;     // resident weights, kept as the estimate for a reload
+    size_t file_bytes = 0;
+    uint64_t t_used = 0;    // registry clock of the last selection
+    int n_loads = 0;
+    int n_requests = 0;
+};
+
+struct unet_registry {
+    // load options applied to every model
+    int n_threads = 1;
+    bool winograd = true;
+    enum ggml_type wtype = GGML_TYPE_F32;
+    bool use_mmap = false;
+    bool int8 = false;
+    std::string conv_engine;
+    std::string fname_conv_tune;
+    size_t budget = 0;      // bytes of resident weights, 0 for no bound
+
+    ggml_backend_t backend = NULL;
+    std::vector<unet_registry_model> models;
+    int bound = -1;         // model whose graphs the context holds
+    uint64_t clock = 0;
+    size_t n_resident = 0;
+    float overhead = 1.0f;  // largest resident bytes per file byte seen, for the repacked kernels
+    int n_loads = 0;
+    int n_evicted = 0;
+    int n_switches = 0;
+};
+
+// one "<name> <model path>" per line, # starts a comment
+bool unet_registry_read_list(unet_registry & reg, const std::string & fname);
+// creates the shared backend, call after the options are set
+bool unet_registry_init(unet_registry & reg);
+void unet_registry_free(unet_registry & reg, unet_context & uctx);
+
+// loads the model when it is not resident, evicting others beyond the budget,
+// and binds uctx to it. An empty name selects the first model, NULL on failure
+const unet_model * unet_registry_select(unet_registry & reg, const std::string & name, unet_context & uctx);
+
+void unet_registry_write_summary(FILE * f, const unet_registry & reg);
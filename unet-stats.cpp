@@ -0,0 +1,161 @@
+#include "unet-stats.h"
+
+#include "ggml.h"
+
+#include <csignal>
+
+static const char * UNET_STAGE_NAMES[UNET_STAGE_COUNT] = {
+    "decode",
+    "letterbox",
+    "upload",
+    "compute",
+    "readback",
+    "threshold",
+    "encode",
+};
+
+const char * unet_stage_name(int stage)
+{
+    return UNET_STAGE_NAMES[stage];
+}
+
+static int unet_hist_bucket(int64_t us)
+{
+    if (us < UNET_HIST_SUB) {
+        return us < 0 ? 0 : (int) us;
+    }
+    int e = 0;  // floor(log2(us)) >= 4
+    for (uint64_t v = (uint64_t) us; v > 1; v >>= 1) {
+        e++;
+    }
+    int sub = (int) ((us >> (e - 4)) & (UNET_HIST_SUB - 1));
+    int idx = UNET_HIST_SUB + (e - 4)*UNET_HIST_SUB + sub;
+    return idx < UNET_HIST_BUCKETS ? idx : UNET_HIST_BUCKETS - 1;
+}
+
+// midpoint of a bucket
+static int64_t unet_hist_value(int idx)
+{
+    if (idx < UNET_HIST_SUB) {
+        return idx;
+    }
+    const int e   = (idx - UNET_HIST_SUB)/UNET_HIST_SUB + 4;
+    const int sub = (idx - UNET_HIST_SUB) % UNET_HIST_SUB;
+    return (((int64_t) (UNET_HIST_SUB + sub)) << (e - 4)) + (((int64_t) 1 << (e - 4)) >> 1);
+}
+
+void unet_histogram::add(int64_t us)
+{
+    buckets[unet_hist_bucket(us)]++;
+    count++;
+    sum += us;
+    max = us > max ? us : max;
+}
+
+int64_t unet_histogram::percentile(double p) const
+{
+    if (count == 0) {
+        return 0;
+    }
+    const uint64_t rank = (uint64_t) (p/100.0*(count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < UNET_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            const int64_t v = unet_hist_value(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+void unet_stats_init(unet_stats & stats)
+{
+    stats = unet_stats();
+    stats.t_start_us = ggml_time_us();
+}
+
+void unet_stats_add(unet_stats & stats, const unet_frame_timings & timings, int n_defect)
+{
+    for (int i = 0; i < UNET_STAGE_COUNT; i++) {
+        stats.stages[i].add(timings.us[i]);
+    }
+    stats.total.add(timings.total());
+    stats.n_frames++;
+    stats.n_defect_frames += n_defect > 0;
+}
+
+void unet_write_json_string(FILE * f, const char * s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void unet_stats_write_frame(FILE * f, const char * name, const unet_frame_timings & timings, int n_defect)
+{
+    fprintf(f, "{\"image\": ");
+    unet_write_json_string(f, name);
+    for (int i = 0; i < UNET_STAGE_COUNT; i++) {
+        fprintf(f, ", \"%s_us\": %lld", UNET_STAGE_NAMES[i], (long long) timings.us[i]);
+    }
+    fprintf(f, ", \"total_us\": %lld, \"defect_pixels\": %d}\n", (long long) timings.total(), n_defect);
+    fflush(f);
+}
+
+static void unet_write_histogram(FILE * f, const char * name, const unet_histogram & h)
+{
+    fprintf(f, "\"%s\": {\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %lld, \"p90_us\": %lld, \"p99_us\": %lld, \"p999_us\": %lld, \"max_us\": %lld}",
+            name, (unsigned long long) h.count, h.count ? (double) h.sum/h.count : 0.0,
+            (long long) h.percentile(50), (long long) h.percentile(90), (long long) h.percentile(99), (long long) h.percentile(99.9), (long long) h.max);
+}
+
+void unet_stats_write_summary(FILE * f, const unet_stats & stats)
+{
+    const double elapsed = (ggml_time_us() - stats.t_start_us)/1e6;
+
+    fprintf(f, "{\"summary\": {\"frames\": %d, \"defect_frames\": %d, \"elapsed_s\": %.3f, \"frames_per_s\": %.2f, ",
+            stats.n_frames, stats.n_defect_frames, elapsed, elapsed > 0 ? stats.n_frames/elapsed : 0.0);
+    for (int i = 0; i < UNET_STAGE_COUNT; i++) {
+        unet_write_histogram(f, UNET_STAGE_NAMES[i], stats.stages[i]);
+        fprintf(f, ", ");
+    }
+    unet_write_histogram(f, "total", stats.total);
+    fprintf(f, "}}\n");
+    fflush(f);
+}
+
+static volatile sig_atomic_t g_stats_dump = 0;
+
+#ifdef SIGUSR1
+static void unet_stats_signal_handler(int)
+{
+    g_stats_dump = 1;
+}
+#endif
+
+void unet_stats_install_signal()
+{
+#ifdef SIGUSR1
+    signal(SIGUSR1, unet_stats_signal_handler);
+#endif
+}
+
+bool unet_stats_dump_requested()
+{
+    if (!g_stats_dump) {
+        return false;
+    }
+    g_stats_dump = 0;
+    return true;
+}
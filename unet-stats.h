@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+// per-stage latency histograms and the JSON-lines stats stream
+
+enum unet_stage {
+    UNET_STAGE_DECODE,
+    UNET_STAGE_LETTERBOX,
+    UNET_STAGE_UPLOAD,
+    UNET_STAGE_COMPUTE,
+    UNET_STAGE_READBACK,
+    UNET_STAGE_THRESHOLD,
+    UNET_STAGE_ENCODE,
+    UNET_STAGE_COUNT,
+};
+
+const char * unet_stage_name(int stage);
+
+struct unet_frame_timings {
+    int64_t us[UNET_STAGE_COUNT] = {};
+
+    int64_t total() const {
+        int64_t sum = 0;
+        for (int i = 0; i < UNET_STAGE_COUNT; i++) {
+            sum += us[i];
+        }
+        return sum;
+    }
+};
+
+// log-linear histogram of microsecond values: exact below 16 us, then 16
+// sub-buckets per power of two (~6% resolution)
+#define UNET_HIST_SUB     16
+#define UNET_HIST_BUCKETS (UNET_HIST_SUB + 40*UNET_HIST_SUB)
+
+struct unet_histogram {
+    uint64_t buckets[UNET_HIST_BUCKETS] = {};
+    uint64_t count = 0;
+    int64_t  sum   = 0;
+    int64_t  max   = 0;
+
+    void add(int64_t us);
+    int64_t percentile(double p) const;
+};
+
+struct unet_stats {
+    unet_histogram stages[UNET_STAGE_COUNT];
+    unet_histogram total;
+    int64_t t_start_us = 0;
+    int n_frames = 0;
+    int n_defect_frames = 0;
+};
+
+void unet_stats_init(unet_stats & stats);
+void unet_stats_add(unet_stats & stats, const unet_frame_timings & timings, int n_defect);
+
+// quoted and escaped JSON string
+void unet_write_json_string(FILE * f, const char * s);
+
+// one JSON object per line
+void unet_stats_write_frame(FILE * f, const char * name, const unet_frame_timings & timings, int n_defect);
+void unet_stats_write_summary(FILE * f, const unet_stats & stats);
+
+// SIGUSR1 requests a summary dump, checked by the processing loop
+void unet_stats_install_signal();
+bool unet_stats_dump_requested();
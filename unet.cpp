@@ -1,4 +1,12 @@
 #include "unet.h"
+#include "unet-batch.h"
+#include "unet-pipeline.h"
+#include "unet-registry.h"
+
+#include <chrono>
+#include <thread>
+
+#include <sstream>
 
 void unet_print_usage(int argc, char ** argv, const unet_params & params) {
     fprintf(stderr, "usage: %s [options]\n", argv[0]);
@@ -12,10 +20,55 @@ void unet_print_usage(int argc, char ** argv, const unet_params & params) {
     // fprintf(stderr, "                        input file (default: %s)\n", params.fname_inp.c_str());
     fprintf(stderr, "  -o FNAME, --out FNAME\n");
     // fprintf(stderr, "                        output file (default: %s)\n", params.fname_out.c_str());
+    fprintf(stderr, "  -p T, --precision T   conv kernel precision, f32 or f16 (default: f32)\n");
+    fprintf(stderr, "  -nw, --no-winograd    use im2col for 3x3 convolutions instead of Winograd\n");
+    fprintf(stderr, "  --conv-engine E       im2col, winograd or direct for every conv layer that supports it, or auto (default)\n");
+    fprintf(stderr, "                        to time the engines on each layer at load and keep the fastest\n");
+    fprintf(stderr, "  --conv-tune FNAME     per-layer engines, read when it exists and written by auto (default: MODEL.conv-tune)\n");
+    fprintf(stderr, "  --int8                run the calibrated conv layers on INT8 activations and weights (CPU only)\n");
+    fprintf(stderr, "  --calibrate FNAME     record the input range of every conv over the inputs and write the model\n");
+    fprintf(stderr, "                        with the INT8 calibration to FNAME\n");
+    fprintf(stderr, "  -q, --quiet           do not print tensor values and layer shapes at startup\n");
+    fprintf(stderr, "  --prefault            touch the weight and compute buffers before the first image\n");
+    fprintf(stderr, "  --warmup N            run N warmup inferences before the first image (default: 0)\n");
+    fprintf(stderr, "  --fast-start          same as --quiet --prefault --warmup 2\n");
+    fprintf(stderr, "  --sparse              run the full-resolution decoder only on tiles near the threshold\n");
+    fprintf(stderr, "  --sparse-margin F     logit margin below the threshold for selecting tiles (default: %.1f)\n", params.sparse_margin);
+    fprintf(stderr, "  --pipeline            run the graph as a pipeline of segments on separate core groups,\n");
+    fprintf(stderr, "                        several images in flight (CPU only)\n");
+    fprintf(stderr, "  --pipeline-threads N,N,...\n");
+    fprintf(stderr, "                        threads per pipeline segment (default: -t split by the work per segment)\n");
+    fprintf(stderr, "  --panel N             stream large images in strips of N rows and run them as NxN tiles,\n");
+    fprintf(stderr, "                        the mask is stitched at the network resolution of a tile\n");
+    fprintf(stderr, "  --realtime FPS        feed the inputs at FPS frames per second like a camera and drop late frames\n");
+    fprintf(stderr, "  --deadline MS         latency budget of a frame from its arrival (default: one frame period)\n");
+    fprintf(stderr, "  --queue-depth N       frames waiting for the detector before the late policy applies (default: %d)\n", params.queue_depth);
+    fprintf(stderr, "  --late-policy P       drop-oldest, drop-newest or degrade to the preview graph (default: %s)\n", unet_rt_policy_name(params.late_policy));
+    fprintf(stderr, "  --cache N             keep the results of the last N distinct frames, repeated frames skip inference\n");
+    fprintf(stderr, "  --cache-mb MB         memory bound of the cache (default: %d)\n", params.cache_mb);
+    fprintf(stderr, "  --cache-perceptual    also match frames by a hash of the letterboxed input, for near-identical frames\n");
+    fprintf(stderr, "  --cache-phash-dist D  bits the perceptual hashes of matching frames may differ by (default: 0)\n");
+    fprintf(stderr, "  --models FNAME        keep several models in one process, one \"<name> <model path>\" per line;\n");
+    fprintf(stderr, "                        they share the thread pool and compute buffers and load on first use\n");
+    fprintf(stderr, "  --model-budget MB     unload the least recently used models beyond MB of weights, a soft bound\n");
+    fprintf(stderr, "                        enforced from an estimate before each load (default: no bound)\n");
+    fprintf(stderr, "  --use NAME            run the -i inputs that follow on model NAME of --models (default: the first)\n");
+    fprintf(stderr, "  --mmap                map the model file instead of reading it, processes share the weights\n");
+    fprintf(stderr, "  --manifest FNAME      read the inputs from FNAME, one image per line with an optional\n");
+    fprintf(stderr, "                        tab-separated output path; resumes where an earlier run stopped\n");
+    fprintf(stderr, "  --out-dir DIR         outputs and results of manifest images without an output path (default: %s)\n", params.out_dir.c_str());
+    fprintf(stderr, "  --shard I/N           process only shard I of N, without it workers share all chunks\n");
+    fprintf(stderr, "  --chunk N             images claimed by a worker at a time (default: %d)\n", params.chunk);
+    fprintf(stderr, "  --state FNAME         chunk state shared by the workers (default: <manifest>.state)\n");
+    fprintf(stderr, "  --results PREFIX      JSON lines with the result of every image, one PREFIX.<chunk>.jsonl per chunk\n");
+    fprintf(stderr, "                        (default: <out-dir>/results)\n");
+    fprintf(stderr, "  --stats FNAME         write per-image stage timings as JSON lines to FNAME (- for stdout),\n");
+    fprintf(stderr, "                        followed by a summary; SIGUSR1 dumps the summary to stderr\n");
     fprintf(stderr, "\n");
 }
 
 bool unet_params_parse(int argc, char ** argv, unet_params & params) {
+    std::string use_model;
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
 
@@ -28,6 +81,7 @@ bool unet_params_parse(int argc, char ** argv, unet_params & params) {
         } else if (arg == "-i" || arg == "--inp") {
             while (++i < argc && argv[i][0] != '-') {
                 params.fname_inp.push_back(argv[i]);
+                params.model_names.push_back(use_model);
             }
             --i;          
         } else if (arg == "-o" || arg == "--out") {
@@ -35,6 +89,91 @@ bool unet_params_parse(int argc, char ** argv, unet_params & params) {
                 params.fname_out.push_back(argv[i]);
             }
             --i; 
+        } else if (arg == "-p" || arg == "--precision") {
+            std::string precision = argv[++i];
+            params.wtype = precision == "f16" ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        } else if (arg == "-nw" || arg == "--no-winograd") {
+            params.winograd = false;
+        } else if (arg == "--conv-engine") {
+            params.conv_engine = argv[++i];
+        } else if (arg == "--conv-tune") {
+            params.fname_conv_tune = argv[++i];
+        } else if (arg == "--models") {
+            params.fname_models = argv[++i];
+        } else if (arg == "--model-budget") {
+            params.model_budget_mb = std::stoi(argv[++i]);
+        } else if (arg == "--use") {
+            use_model = argv[++i];
+        } else if (arg == "--int8") {
+            params.int8 = true;
+        } else if (arg == "--calibrate") {
+            params.fname_calibrate = argv[++i];
+        } else if (arg == "-q" || arg == "--quiet") {
+            params.quiet = true;
+        } else if (arg == "--prefault") {
+            params.prefault = true;
+        } else if (arg == "--warmup") {
+            params.warmup = std::stoi(argv[++i]);
+        } else if (arg == "--fast-start") {
+            params.quiet = true;
+            params.prefault = true;
+            params.warmup = std::max(params.warmup, 2);
+        } else if (arg == "--sparse") {
+            params.sparse = true;
+        } else if (arg == "--sparse-margin") {
+            params.sparse_margin = std::stof(argv[++i]);
+        } else if (arg == "--pipeline") {
+            params.pipeline = true;
+        } else if (arg == "--pipeline-threads") {
+            params.pipeline = true;
+            params.pipeline_threads.clear();
+            std::stringstream ss(argv[++i]);
+            std::string count;
+            while (std::getline(ss, count, ',')) {
+                params.pipeline_threads.push_back(std::stoi(count));
+            }
+        } else if (arg == "--panel") {
+            params.panel_tile = std::stoi(argv[++i]);
+        } else if (arg == "--realtime") {
+            params.realtime_fps = std::stof(argv[++i]);
+        } else if (arg == "--deadline") {
+            params.deadline_ms = std::stof(argv[++i]);
+        } else if (arg == "--queue-depth") {
+            params.queue_depth = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--late-policy") {
+            if (!unet_rt_parse_policy(argv[++i], params.late_policy)) {
+                fprintf(stderr, "error: unknown late policy: %s\n", argv[i]);
+                return false;
+            }
+        } else if (arg == "--cache") {
+            params.cache_entries = std::stoi(argv[++i]);
+        } else if (arg == "--cache-mb") {
+            params.cache_mb = std::stoi(argv[++i]);
+        } else if (arg == "--cache-perceptual") {
+            params.cache_perceptual = true;
+        } else if (arg == "--cache-phash-dist") {
+            params.cache_perceptual = true;
+            params.cache_phash_dist = std::stoi(argv[++i]);
+        } else if (arg == "--mmap") {
+            params.use_mmap = true;
+        } else if (arg == "--manifest") {
+            params.fname_manifest = argv[++i];
+        } else if (arg == "--out-dir") {
+            params.out_dir = argv[++i];
+        } else if (arg == "--shard") {
+            if (sscanf(argv[++i], "%d/%d", &params.shard, &params.n_shards) != 2 ||
+                params.n_shards < 1 || params.shard < 0 || params.shard >= params.n_shards) {
+                fprintf(stderr, "error: invalid shard: %s\n", argv[i]);
+                return false;
+            }
+        } else if (arg == "--chunk") {
+            params.chunk = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--state") {
+            params.fname_state = argv[++i];
+        } else if (arg == "--results") {
+            params.fname_results = argv[++i];
+        } else if (arg == "--stats") {
+            params.fname_stats = argv[++i];
         } else if (arg == "-h" || arg == "--help") {
             unet_print_usage(argc, argv, params);
             exit(0);
@@ -44,804 +183,472 @@ bool unet_params_parse(int argc, char ** argv, unet_params & params) {
             exit(0);
         }
     }
+    if (params.panel_tile > 0 && params.pipeline) {
+        fprintf(stderr, "error: --panel does not work with --pipeline\n");
+        return false;
+    }
+    if (params.realtime_fps > 0 && (params.pipeline || params.panel_tile > 0 || !params.fname_manifest.empty())) {
+        fprintf(stderr, "error: --realtime does not work with --pipeline, --panel or --manifest\n");
+        return false;
+    }
+    // every conv has to see the dense graph on every input
+    if (!params.fname_calibrate.empty() && (params.int8 || params.sparse || params.panel_tile > 0 || params.realtime_fps > 0 ||
+            !params.fname_manifest.empty() || params.cache_entries > 0)) {
+        fprintf(stderr, "error: --calibrate does not work with --int8, --sparse, --panel, --realtime, --manifest or --cache\n");
+        return false;
+    }
+    if (!params.fname_models.empty() && (params.pipeline || params.realtime_fps > 0 || !params.fname_calibrate.empty() || params.cache_entries > 0)) {
+        fprintf(stderr, "error: --models does not work with --pipeline, --realtime, --calibrate or --cache\n");
+        return false;
+    }
+    // the blank warmup frames would count towards the ranges
+    if (!params.fname_calibrate.empty()) {
+        params.warmup = 0;
+    }
+    if (params.realtime_fps > 0 && params.deadline_ms <= 0) {
+        params.deadline_ms = 1000.0f/params.realtime_fps;
+    }
     return true;
 }
 
-static bool load_model(const std::string & fname, unet_model & model, int n_threads = 1) 
+int main(int argc, char ** argv) 
 {
-    // initialize the backend, use CPU or CUDA
-#ifdef GGML_USE_CUDA
-    fprintf(stderr, "%s: using CUDA backend\n", __func__);
-    model.backend = ggml_backend_cuda_init(0); // init device 0
-    if(!model.backend)
-    {
-        fprintf(stderr, "%s: ggml_backend_cuda_init() failed\n", __func__);
-    }
-#endif
-
-     // if there aren't GPU Backends fallback to CPU backend
-    if (!model.backend) {
-        model.backend = ggml_backend_cpu_init();
-    } 
-
-    if (ggml_backend_is_cpu(model.backend)) {
-        ggml_backend_cpu_set_n_threads(model.backend, n_threads);
-    }
+    ggml_time_init();
+    const int64_t t_main_start_us = ggml_time_us();
+    unet_model model;
 
-    // Read data from .gguf file: vesion, gguf magic number, tensor_count ... to gguf_ctx
-    struct ggml_context *tmp_ctx = nullptr;
-    struct gguf_init_params gguf_params = {
-        /*no_alloc = */ false,
-        /*.ctx     = */ &tmp_ctx,       
-    };
-    struct gguf_context * gguf_ctx = gguf_init_from_file(fname.c_str(), gguf_params);  
-    if (!gguf_ctx)
+    unet_params params;
+    if (!unet_params_parse(argc, argv, params)) 
     {
-        fprintf(stderr, "%s: gguf_init_from_file() failed \n", __func__);
-        return false;      
-    }
-
-    // Allocate `ggml_context` to store tensor data
-    int num_tensors = gguf_get_n_tensors(gguf_ctx);    
-    struct ggml_init_params params {
-        /*.mem_size   =*/ ggml_tensor_overhead() * num_tensors, //multiplication, mem_size is a multiple of b
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ true,
-    };
-    // initialize the pointer to point memory area allocate tensor (memory size, adress)
-    model.ctx = ggml_init(params);
-    // create tensors and save to main memory(RAM) zone of model.ctx
-    for (int i = 0; i < num_tensors; i++) {   
-        const char * name = gguf_get_tensor_name(gguf_ctx, i);  
-        struct ggml_tensor * src = ggml_get_tensor(tmp_ctx, name); 
-        if (i < 10) {
-            printf("value of tensor src: %f\n", ggml_get_f32_1d(src, i));
-        }     
-        struct ggml_tensor * dst = ggml_dup_tensor(model.ctx, src);       
-        ggml_set_name(dst, name);
-    }
-    model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, model.backend);
-    // copy tensors from main memory to backend
-    for (struct ggml_tensor * cur = ggml_get_first_tensor(model.ctx); cur != NULL; cur = ggml_get_next_tensor(model.ctx, cur)) {
-        struct ggml_tensor * src = ggml_get_tensor(tmp_ctx, ggml_get_name(cur));
-        size_t n_size = ggml_nbytes(src);
-        ggml_backend_tensor_set(cur, ggml_get_data(src), 0, n_size);
+        return 1;
     }
-    gguf_free(gguf_ctx);
-
-    // load tensor from ctx to vector conv2d_layers
-    model.width  = 224;
-    model.height = 224;
-    model.conv2d_layers.resize(59);
-
-    model.conv2d_layers[0].padding = 3;
-    model.conv2d_layers[0].strike = 2;
-    model.conv2d_layers[0].name_conv = "conv1_conv";
-    model.conv2d_layers[0].name_bn = "conv1_bn";
-
-    model.conv2d_layers[1].padding = 0;
-    model.conv2d_layers[1].name_conv = "conv2_block1_1_conv";
-    model.conv2d_layers[1].name_bn = "conv2_block1_1_bn";
-
-    model.conv2d_layers[2].name_conv = "conv2_block1_2_conv";
-    model.conv2d_layers[2].name_bn = "conv2_block1_2_bn";
-
-    model.conv2d_layers[3].padding = 0;
-    model.conv2d_layers[3].load_next = true;
-    model.conv2d_layers[3].activate = false;
-    model.conv2d_layers[3].name_conv = "conv2_block1_0_conv";
-    model.conv2d_layers[3].name_bn = "conv2_block1_0_bn";
-
-    model.conv2d_layers[4].padding = 0;
-    model.conv2d_layers[4].skip_load = true;  
-    model.conv2d_layers[4].activate = false;
-    model.conv2d_layers[4].name_conv = "conv2_block1_3_conv";
-    model.conv2d_layers[4].name_bn = "conv2_block1_3_bn";
-
-    model.conv2d_layers[5].padding = 0;
-    model.conv2d_layers[5].name_conv = "conv2_block2_1_conv";
-    model.conv2d_layers[5].name_bn = "conv2_block2_1_bn";
-
-    model.conv2d_layers[6].name_conv = "conv2_block2_2_conv";
-    model.conv2d_layers[6].name_bn = "conv2_block2_2_bn";
-
-    model.conv2d_layers[7].padding = 0;
-    model.conv2d_layers[7].activate = false;
-    model.conv2d_layers[7].name_conv = "conv2_block2_3_conv";
-    model.conv2d_layers[7].name_bn = "conv2_block2_3_bn";
-
-    model.conv2d_layers[8].padding = 0;
-    model.conv2d_layers[8].name_conv = "conv2_block3_1_conv";
-    model.conv2d_layers[8].name_bn = "conv2_block3_1_bn";
-
-    model.conv2d_layers[9].name_conv = "conv2_block3_2_conv";
-    model.conv2d_layers[9].name_bn = "conv2_block3_2_bn";
-
-    model.conv2d_layers[10].padding = 0;
-    model.conv2d_layers[10].activate = false;
-    model.conv2d_layers[10].name_conv = "conv2_block3_3_conv";
-    model.conv2d_layers[10].name_bn = "conv2_block3_3_bn";
-
-    model.conv2d_layers[11].padding = 0;
-    model.conv2d_layers[11].name_conv = "conv3_block1_1_conv";
-    model.conv2d_layers[11].name_bn = "conv3_block1_1_bn";
-    model.conv2d_layers[11].strike = 2;
-
-    model.conv2d_layers[12].name_conv = "conv3_block1_2_conv";
-    model.conv2d_layers[12].name_bn = "conv3_block1_2_bn";
-
-    model.conv2d_layers[13].padding = 0;
-    model.conv2d_layers[13].load_next = true;
-    model.conv2d_layers[13].activate = false;
-    model.conv2d_layers[13].name_conv = "conv3_block1_0_conv";
-    model.conv2d_layers[13].name_bn = "conv3_block1_0_bn";
-    model.conv2d_layers[13].strike = 2;
-
-    model.conv2d_layers[14].padding = 0;
-    model.conv2d_layers[14].skip_load = true; 
-    model.conv2d_layers[14].activate = false;
-    model.conv2d_layers[14].name_conv = "conv3_block1_3_conv";
-    model.conv2d_layers[14].name_bn = "conv3_block1_3_bn";
-
-    model.conv2d_layers[15].padding = 0;
-    model.conv2d_layers[15].name_conv = "conv3_block2_1_conv";
-    model.conv2d_layers[15].name_bn = "conv3_block2_1_bn";
-
-    model.conv2d_layers[16].name_conv = "conv3_block2_2_conv";
-    model.conv2d_layers[16].name_bn = "conv3_block2_2_bn";
-
-    model.conv2d_layers[17].padding = 0;
-    model.conv2d_layers[17].activate = false;
-    model.conv2d_layers[17].name_conv = "conv3_block2_3_conv";
-    model.conv2d_layers[17].name_bn = "conv3_block2_3_bn";
-
-    model.conv2d_layers[18].padding = 0;
-    model.conv2d_layers[18].name_conv = "conv3_block3_1_conv";
-    model.conv2d_layers[18].name_bn = "conv3_block3_1_bn";
-
-    model.conv2d_layers[19].name_conv = "conv3_block3_2_conv";
-    model.conv2d_layers[19].name_bn = "conv3_block3_2_bn";
-
-    model.conv2d_layers[20].padding = 0;
-    model.conv2d_layers[20].activate = false;
-    model.conv2d_layers[20].name_conv = "conv3_block3_3_conv";
-    model.conv2d_layers[20].name_bn = "conv3_block3_3_bn";
-
-    model.conv2d_layers[21].padding = 0;
-    model.conv2d_layers[21].name_conv = "conv3_block4_1_conv";
-    model.conv2d_layers[21].name_bn = "conv3_block4_1_bn";
-
-    model.conv2d_layers[22].name_conv = "conv3_block4_2_conv";
-    model.conv2d_layers[22].name_bn = "conv3_block4_2_bn";
-
-    model.conv2d_layers[23].padding = 0;
-    model.conv2d_layers[23].activate = false;
-    model.conv2d_layers[23].name_conv = "conv3_block4_3_conv";
-    model.conv2d_layers[23].name_bn = "conv3_block4_3_bn";
-
-    model.conv2d_layers[24].padding = 0;
-    model.conv2d_layers[24].name_conv = "conv4_block1_1_conv";
-    model.conv2d_layers[24].name_bn = "conv4_block1_1_bn";
-    model.conv2d_layers[24].strike = 2;
-
-    model.conv2d_layers[25].name_conv = "conv4_block1_2_conv";
-    model.conv2d_layers[25].name_bn = "conv4_block1_2_bn";
-
-    model.conv2d_layers[26].padding = 0;
-    model.conv2d_layers[26].load_next = true;
-    model.conv2d_layers[26].activate = false;
-    model.conv2d_layers[26].name_conv = "conv4_block1_0_conv";
-    model.conv2d_layers[26].name_bn = "conv4_block1_0_bn";
-    model.conv2d_layers[26].strike = 2;
-
-    model.conv2d_layers[27].padding = 0;
-    model.conv2d_layers[27].skip_load = true;
-    model.conv2d_layers[27].activate = false;
-    model.conv2d_layers[27].name_conv = "conv4_block1_3_conv";
-    model.conv2d_layers[27].name_bn = "conv4_block1_3_bn";
-
-    model.conv2d_layers[28].padding = 0;
-    model.conv2d_layers[28].name_conv = "conv4_block2_1_conv";
-    model.conv2d_layers[28].name_bn = "conv4_block2_1_bn";
-
-    model.conv2d_layers[29].name_conv = "conv4_block2_2_conv";
-    model.conv2d_layers[29].name_bn = "conv4_block2_2_bn";
-
-    model.conv2d_layers[30].padding = 0;
-    model.conv2d_layers[30].activate = false;
-    model.conv2d_layers[30].name_conv = "conv4_block2_3_conv";
-    model.conv2d_layers[30].name_bn = "conv4_block2_3_bn";
-
-    model.conv2d_layers[31].padding = 0;
-    model.conv2d_layers[31].name_conv = "conv4_block3_1_conv";
-    model.conv2d_layers[31].name_bn = "conv4_block3_1_bn";
-
-    model.conv2d_layers[32].name_conv = "conv4_block3_2_conv";
-    model.conv2d_layers[32].name_bn = "conv4_block3_2_bn";
-
-    model.conv2d_layers[33].padding = 0;
-    model.conv2d_layers[33].activate = false;
-    model.conv2d_layers[33].name_conv = "conv4_block3_3_conv";
-    model.conv2d_layers[33].name_bn = "conv4_block3_3_bn";
-
-    model.conv2d_layers[34].padding = 0;
-    model.conv2d_layers[34].name_conv = "conv4_block4_1_conv";
-    model.conv2d_layers[34].name_bn = "conv4_block4_1_bn";
-
-    model.conv2d_layers[35].name_conv = "conv4_block4_2_conv";
-    model.conv2d_layers[35].name_bn = "conv4_block4_2_bn";
-
-    model.conv2d_layers[36].padding = 0;
-    model.conv2d_layers[36].activate = false;
-    model.conv2d_layers[36].name_conv = "conv4_block4_3_conv";
-    model.conv2d_layers[36].name_bn = "conv4_block4_3_bn";
-
-    model.conv2d_layers[37].padding = 0;
-    model.conv2d_layers[37].name_conv = "conv4_block5_1_conv";
-    model.conv2d_layers[37].name_bn = "conv4_block5_1_bn";
-
-    model.conv2d_layers[38].name_conv = "conv4_block5_2_conv";
-    model.conv2d_layers[38].name_bn = "conv4_block5_2_bn";
-
-    model.conv2d_layers[39].padding = 0;
-    model.conv2d_layers[39].activate = false;
-    model.conv2d_layers[39].name_conv = "conv4_block5_3_conv";
-    model.conv2d_layers[39].name_bn = "conv4_block5_3_bn";
-
-    model.conv2d_layers[40].padding = 0;
-    model.conv2d_layers[40].name_conv = "conv4_block6_1_conv";
-    model.conv2d_layers[40].name_bn = "conv4_block6_1_bn";
-
-    model.conv2d_layers[41].name_conv = "conv4_block6_2_conv";
-    model.conv2d_layers[41].name_bn = "conv4_block6_2_bn";
-    
-    model.conv2d_layers[42].padding = 0;
-    model.conv2d_layers[42].activate = false;
-    model.conv2d_layers[42].name_conv = "conv4_block6_3_conv";
-    model.conv2d_layers[42].name_bn = "conv4_block6_3_bn";
-
-    model.conv2d_layers[43].padding = 0;
-    model.conv2d_layers[43].name_conv = "conv5_block1_1_conv";
-    model.conv2d_layers[43].name_bn = "conv5_block1_1_bn";
-    model.conv2d_layers[43].strike = 2;
-
-    model.conv2d_layers[44].name_conv = "conv5_block1_2_conv";
-    model.conv2d_layers[44].name_bn = "conv5_block1_2_bn";
-
-    model.conv2d_layers[45].padding = 0;
-    model.conv2d_layers[45].load_next = true;
-    model.conv2d_layers[45].activate = false;
-    model.conv2d_layers[45].name_conv = "conv5_block1_0_conv";
-    model.conv2d_layers[45].name_bn = "conv5_block1_0_bn";
-    model.conv2d_layers[45].strike = 2;
-
-    model.conv2d_layers[46].padding = 0;
-    model.conv2d_layers[46].skip_load = true;
-    model.conv2d_layers[46].activate = false;
-    model.conv2d_layers[46].name_conv = "conv5_block1_3_conv";
-    model.conv2d_layers[46].name_bn = "conv5_block1_3_bn";
-
-    model.conv2d_layers[47].padding = 0;
-    model.conv2d_layers[47].name_conv = "conv5_block2_1_conv";
-    model.conv2d_layers[47].name_bn = "conv5_block2_1_bn";
-
-    model.conv2d_layers[48].name_conv = "conv5_block2_2_conv";
-    model.conv2d_layers[48].name_bn = "conv5_block2_2_bn";
-
-    model.conv2d_layers[49].padding = 0;
-    model.conv2d_layers[49].activate = false;
-    model.conv2d_layers[49].name_conv = "conv5_block2_3_conv";
-    model.conv2d_layers[49].name_bn = "conv5_block2_3_bn";
-
-    model.conv2d_layers[50].padding = 0;
-    model.conv2d_layers[50].name_conv = "conv5_block3_1_conv";
-    model.conv2d_layers[50].name_bn = "conv5_block3_1_bn";
-
-    model.conv2d_layers[51].name_conv = "conv5_block3_2_conv";
-    model.conv2d_layers[51].name_bn = "conv5_block3_2_bn";
-
-    model.conv2d_layers[52].padding = 0;
-    model.conv2d_layers[52].activate = false;
-    model.conv2d_layers[52].name_conv = "conv5_block3_3_conv";
-    model.conv2d_layers[52].name_bn = "conv5_block3_3_bn";
-
-    model.conv2d_layers[53].name_conv = "conv2d";
-    model.conv2d_layers[53].name_bn = "batch_normalization";
-
-    model.conv2d_layers[54].name_conv = "conv2d_1";
-    model.conv2d_layers[54].name_bn = "batch_normalization_1";
-
-    model.conv2d_layers[55].name_conv = "conv2d_2";
-    model.conv2d_layers[55].name_bn = "batch_normalization_2";
-
-    model.conv2d_layers[56].name_conv = "conv2d_3";
-    model.conv2d_layers[56].name_bn = "batch_normalization_3";
-
-    model.conv2d_layers[57].name_conv = "conv2d_4";
-    model.conv2d_layers[57].name_bn = "batch_normalization_4";
-
-    model.conv2d_layers[58].padding = 0;    
-    model.conv2d_layers[58].batch_normalize = false;
-    model.conv2d_layers[58].activate = false;
-    model.conv2d_layers[58].name_conv = "conv2d_5"; 
+    unet_set_verbose(!params.quiet);
   
-    for (int i = 0; i < (int)model.conv2d_layers.size(); i++) {
-        char name[256];
-        if(model.conv2d_layers[i].skip_load) continue;
-
-        else if(model.conv2d_layers[i].load_next) 
+    // manifest jobs run as several worker processes on one host
+    const bool batch_mode = !params.fname_manifest.empty();
+
+    // with several models the registry loads them on first use
+    const bool multi_model = !params.fname_models.empty();
+    unet_registry registry;
+    if (multi_model) {
+        registry.n_threads       = params.threads;
+        registry.winograd        = params.winograd;
+        registry.wtype           = params.wtype;
+        registry.use_mmap        = params.use_mmap || batch_mode;
+        registry.int8            = params.int8;
+        registry.conv_engine     = params.conv_engine;
+        registry.fname_conv_tune = params.fname_conv_tune;
+        registry.budget          = (size_t) params.model_budget_mb << 20;
+        if (!unet_registry_read_list(registry, params.fname_models) || !unet_registry_init(registry)) {
+            return 1;
+        }
+    } else {
+        if (!load_model(params.model, model, params.threads, params.winograd, params.wtype, params.use_mmap || batch_mode)) 
         {
-            snprintf(name, sizeof(name), "%s/kernel:0", model.conv2d_layers[i].name_conv);
-            model.conv2d_layers[i].weights = ggml_get_tensor(model.ctx, name);
-
-            snprintf(name, sizeof(name), "%s/bias:0", model.conv2d_layers[i].name_conv);
-            model.conv2d_layers[i].biases = ggml_get_tensor(model.ctx, name);       
-
-            snprintf(name, sizeof(name), "%s/kernel:0", model.conv2d_layers[i+1].name_conv);
-            model.conv2d_layers[i+1].weights = ggml_get_tensor(model.ctx, name);
-
-            snprintf(name, sizeof(name), "%s/bias:0", model.conv2d_layers[i+1].name_conv);
-            model.conv2d_layers[i+1].biases = ggml_get_tensor(model.ctx, name);
-
-            if (model.conv2d_layers[i].batch_normalize) {
-                snprintf(name, sizeof(name), "%s/gamma:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].scales = ggml_get_tensor(model.ctx, name);
-
-                snprintf(name, sizeof(name), "%s/beta:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].beta = ggml_get_tensor(model.ctx, name);                     
+            fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
+            return 1;
+        }  
+        if (!unet_setup_conv_engines(model, params.model, params.conv_engine, params.fname_conv_tune)) {
+            return 1;
+        }
+        if (params.int8 && !unet_prepare_int8(model)) {
+            return 1;
+        }
+    }
+    // the graphs built from here on record the conv input ranges
+    if (!params.fname_calibrate.empty()) {
+        unet_calibrate_begin(model);
+    }
 
-                snprintf(name, sizeof(name), "%s/moving_mean:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].rolling_mean = ggml_get_tensor(model.ctx, name);
-             
-                snprintf(name, sizeof(name), "%s/moving_variance:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].rolling_variance = ggml_get_tensor(model.ctx, name);             
-            }
+    unet_batch batch;
+    FILE * fresults = NULL;
+    std::string results_prefix;
+    if (batch_mode) {
+        batch.chunk = params.chunk;
+        batch.shard = params.shard;
+        batch.n_shards = params.n_shards;
+        if (!unet_batch_read_manifest(batch, params.fname_manifest, params.out_dir) ||
+            !unet_batch_open(batch, params.fname_state.empty() ? params.fname_manifest + ".state" : params.fname_state)) {
+            return 1;
+        }
+        params.fname_inp.clear();
+        params.fname_out.clear();
+        for (const auto & item : batch.items) {
+            params.fname_inp.push_back(item.input);
+            params.fname_out.push_back(item.output);
+        }
+        params.model_names.clear();
+        for (const auto & item : batch.items) {
+            params.model_names.push_back(item.model);
+        }
 
-            if (model.conv2d_layers[i+1].batch_normalize) {
-                snprintf(name, sizeof(name), "%s/gamma:0", model.conv2d_layers[i+1].name_bn);
-                model.conv2d_layers[i+1].scales = ggml_get_tensor(model.ctx, name);
-          
-                snprintf(name, sizeof(name), "%s/beta:0", model.conv2d_layers[i+1].name_bn);
-                model.conv2d_layers[i+1].beta = ggml_get_tensor(model.ctx, name);
-              
-                snprintf(name, sizeof(name), "%s/moving_mean:0", model.conv2d_layers[i+1].name_bn);
-                model.conv2d_layers[i+1].rolling_mean = ggml_get_tensor(model.ctx, name);
-             
-                snprintf(name, sizeof(name), "%s/moving_variance:0", model.conv2d_layers[i+1].name_bn);
-                model.conv2d_layers[i+1].rolling_variance = ggml_get_tensor(model.ctx, name);              
-            }
+        // one results file per chunk, opened when the chunk is claimed
+        results_prefix = params.fname_results.empty() ? params.out_dir + "/results" : params.fname_results;
+        fprintf(stderr, "%s: %d images in %d chunks, %d chunks done, results in '%s.*.jsonl'\n", __func__,
+                (int) batch.items.size(), batch.n_chunks, unet_batch_n_done(batch), results_prefix.c_str());
+    }
+    unet_context uctx;
+    unet_pipeline pipe;
+    if (params.pipeline) {
+        if (!unet_pipeline_init(pipe, model, params.threads, params.pipeline_threads, params.thresh)) {
+            return 1;
         }
-        else
+    } else {
+        uctx.sparse_requested = params.sparse;
+        uctx.sparse_margin = params.sparse_margin;
+        // with several models the context is bound by the first request
+        if (!multi_model && !init_context(uctx, model)) 
         {
-            snprintf(name, sizeof(name), "%s/kernel:0", model.conv2d_layers[i].name_conv);
-            model.conv2d_layers[i].weights = ggml_get_tensor(model.ctx, name);
-
-            snprintf(name, sizeof(name), "%s/bias:0", model.conv2d_layers[i].name_conv);
-            model.conv2d_layers[i].biases = ggml_get_tensor(model.ctx, name);       
-
-            if (model.conv2d_layers[i].batch_normalize) {
-                snprintf(name, sizeof(name), "%s/gamma:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].scales = ggml_get_tensor(model.ctx, name);              
-
-                snprintf(name, sizeof(name), "%s/beta:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].beta = ggml_get_tensor(model.ctx, name);              
+            return 1;
+        }
+    }
 
-                snprintf(name, sizeof(name), "%s/moving_mean:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].rolling_mean = ggml_get_tensor(model.ctx, name);          
+    unet_cache cache;
+    if (params.cache_entries > 0 && !params.pipeline) {
+        cache.max_entries = params.cache_entries;
+        cache.max_bytes   = (size_t) params.cache_mb << 20;
+        cache.perceptual  = params.cache_perceptual;
+        cache.phash_dist  = params.cache_phash_dist;
+    }
 
-                snprintf(name, sizeof(name), "%s/moving_variance:0", model.conv2d_layers[i].name_bn);
-                model.conv2d_layers[i].rolling_variance = ggml_get_tensor(model.ctx, name);              
+    // the degrade policy runs late frames on the preview of the sparse graph
+    unet_context uctx_low;
+    unet_context * low = NULL;
+    if (params.realtime_fps > 0 && params.late_policy == UNET_RT_DEGRADE) {
+        if (uctx.sparse) {
+            low = &uctx;
+        } else {
+            uctx_low.sparse_requested = true;
+            if (!init_context(uctx_low, model)) {
+                return 1;
             }
-        }      
-        
-    }     
-    return true;
-}
-
-static void print_shape(int layer, const ggml_tensor * t)
-{
-    printf("Layer %2d output shape:  %3d x %3d x %4d x %3d\n", layer, (int)t->ne[0], (int)t->ne[1], (int)t->ne[2], (int)t->ne[3]);
-}
+            low = uctx_low.sparse ? &uctx_low : NULL;
+        }
+        if (!low) {
+            fprintf(stderr, "%s: no preview graph for this model, degrade drops late frames instead\n", __func__);
+        }
+    }
+    const int64_t t_loaded_us = ggml_time_us();
 
-static ggml_tensor * apply_conv2d_unet(ggml_context * ctx, ggml_tensor * input, const unet_conv2d_layer & layer)
-{   
-    struct ggml_tensor * result = ggml_conv_2d(ctx, layer.weights, input, layer.strike, layer.strike, layer.padding, layer.padding, 1, 1);
-  
-    result = ggml_add(ctx, result, ggml_repeat(ctx,layer.biases, result)); 
- 
-    if (layer.batch_normalize) {   
-      
-        result = ggml_sub(ctx, result, ggml_repeat(ctx,layer.rolling_mean, result));
-
-        result = ggml_div(ctx, result, ggml_sqrt(ctx, ggml_repeat(ctx,layer.rolling_variance, result)));
-   
-        result = ggml_mul(ctx, result, ggml_repeat(ctx,layer.scales, result));
-
-        result = ggml_add(ctx, result, ggml_repeat(ctx,layer.beta, result));
-    }    
- 
-    if (layer.activate) {
-        result = ggml_relu(ctx, result);
+    // with several models the first one is loaded up front to warm up on
+    const unet_model * warm = &model;
+    if (multi_model && (params.prefault || params.warmup > 0)) {
+        warm = unet_registry_select(registry, "", uctx);
+        if (!warm) {
+            return 1;
+        }
     }
+    if (!params.pipeline && (!multi_model || warm != &model)) {
+        if (params.prefault) {
+            prefault_context(uctx, *warm);
+        }
+        warmup_context(uctx, *warm, params.warmup);
+        if (low == &uctx_low) {
+            warmup_context(uctx_low, model, params.warmup);
+        }
+    }
+    // attached after the warmup, its blank frames are no results
+    if (params.cache_entries > 0 && !params.pipeline) {
+        uctx.cache = &cache;
+    }
+    const int64_t t_ready_us = ggml_time_us();
 
-    return result;
-}
+    FILE * fstats = NULL;
+    if (!params.fname_stats.empty()) {
+        fstats = params.fname_stats == "-" ? stdout : fopen(params.fname_stats.c_str(), "w");
+        if (!fstats) {
+            fprintf(stderr, "%s: failed to open '%s'\n", __func__, params.fname_stats.c_str());
+            return 1;
+        }
+    }
+    unet_stats stats;
+    unet_stats_init(stats);
+    unet_stats_install_signal();
 
-static struct ggml_cgraph * build_graph_unet(struct ggml_context * ctx_cgraph, const unet_model & model) {   
-    struct ggml_cgraph * gf = ggml_new_graph(ctx_cgraph);   
-
-    struct ggml_tensor * input = ggml_new_tensor_4d(ctx_cgraph, GGML_TYPE_F32, model.width, model.height, 3, 1); // 224x224x3x1
-    print_shape(100, input);  
-    ggml_set_name(input, "input");
-
-    struct ggml_tensor * result = apply_conv2d_unet(ctx_cgraph, input, model.conv2d_layers[0]);  
-    struct ggml_tensor * layer_0 = result; 
-    print_shape(0, result);
-    // result = ggml_pad(ctx_cgraph, result, 1, 1, 0, 0);    
-    result = ggml_pool_2d(ctx_cgraph, result, GGML_OP_POOL_MAX, 3, 3, 2, 2, 1, 1);
-    struct ggml_tensor * layer_3_connect = result;    
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[1]);
-    print_shape(1, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[2]);
-    struct ggml_tensor * layer_4_connect = result;
-    print_shape(2, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_3_connect, model.conv2d_layers[3]);
-    struct ggml_tensor * layer_3 = result;
-    print_shape(3, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_4_connect, model.conv2d_layers[4]);
-    struct ggml_tensor * layer_4 = result;
-    print_shape(4, result);
-
-    result = ggml_add(ctx_cgraph, layer_3, layer_4);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_3_4 = result;   
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[5]);
-    print_shape(5, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[6]);
-    print_shape(6, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[7]);
-    print_shape(7, result);
-
-    result = ggml_add(ctx_cgraph, layer_3_4, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_3_4_7 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[8]);
-    print_shape(8, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[9]);
-    print_shape(9, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[10]);
-    print_shape(10, result);
-
-    result = ggml_add(ctx_cgraph, layer_3_4_7, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_3_4_7_10 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[11]);
-    print_shape(11, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[12]);
-    struct ggml_tensor * layer_12 = result;
-    print_shape(12, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_3_4_7_10, model.conv2d_layers[13]);
-    struct ggml_tensor * layer_13 = result;
-    print_shape(13, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_12, model.conv2d_layers[14]);
-    print_shape(14, result);
-    struct ggml_tensor * layer_14 = result;
-
-    result = ggml_add(ctx_cgraph, layer_13, layer_14);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_13_14 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[15]);
-    print_shape(15, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[16]);
-    print_shape(16, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[17]);
-    print_shape(17, result);
-
-    result = ggml_add(ctx_cgraph, layer_13_14, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_13_14_17 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[18]);
-    print_shape(18, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[19]);
-    print_shape(19, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[20]);
-    print_shape(20, result);
-
-    result = ggml_add(ctx_cgraph, layer_13_14_17, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_13_14_17_20 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[21]);
-    print_shape(21, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[22]);
-    print_shape(22, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[23]);
-    print_shape(23, result);
-
-    result = ggml_add(ctx_cgraph, layer_13_14_17_20, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_13_14_17_20_23 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[24]);
-    print_shape(24, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[25]);
-    struct ggml_tensor * layer_25 = result;
-    print_shape(25, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_13_14_17_20_23, model.conv2d_layers[26]);
-    print_shape(26, result);
-    struct ggml_tensor * layer_26 = result;
-    result = apply_conv2d_unet(ctx_cgraph, layer_25, model.conv2d_layers[27]);
-    print_shape(27, result);
-    struct ggml_tensor * layer_27 = result;
-
-    result = ggml_add(ctx_cgraph, layer_26, layer_27);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_26_27 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[28]);
-    print_shape(28, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[29]);
-    print_shape(29, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[30]);
-    print_shape(30, result);
-
-    result = ggml_add(ctx_cgraph, layer_26_27, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_26_27_30 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[31]);
-    print_shape(31, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[32]);
-    print_shape(32, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[33]);
-    print_shape(33, result);
-
-    result = ggml_add(ctx_cgraph, layer_26_27_30, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_26_27_30_33 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[34]);
-    print_shape(34, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[35]);
-    print_shape(35, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[36]);
-    print_shape(36, result);
-
-    result = ggml_add(ctx_cgraph, layer_26_27_30_33, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_26_27_30_33_36 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[37]);
-    print_shape(37, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[38]);
-    print_shape(38, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[39]);
-    print_shape(39, result);
-
-    result = ggml_add(ctx_cgraph, layer_26_27_30_33_36, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_26_27_30_33_36_39 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[40]);
-    print_shape(40, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[41]);
-    print_shape(41, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[42]);
-    print_shape(42, result);
-
-    result = ggml_add(ctx_cgraph, layer_26_27_30_33_36_39, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_26_27_30_33_36_39_42 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[43]);
-    print_shape(43, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[44]);
-    struct ggml_tensor * layer_44 = result;
-    print_shape(44, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_26_27_30_33_36_39_42, model.conv2d_layers[45]);
-    struct ggml_tensor * layer_45 = result;
-    print_shape(45, result);
-    result = apply_conv2d_unet(ctx_cgraph, layer_44, model.conv2d_layers[46]);
-    struct ggml_tensor * layer_46 = result;
-    print_shape(46, result);
-
-    result = ggml_add(ctx_cgraph, layer_45, layer_46);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_45_46 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[47]);
-    print_shape(47, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[48]);
-    print_shape(48, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[49]);
-    print_shape(49, result);
-
-    result = ggml_add(ctx_cgraph, layer_45_46, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_45_46_49 = result;
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[50]);
-    print_shape(50, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[51]);
-    print_shape(51, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[52]);
-    print_shape(52, result);
-
-    result = ggml_add(ctx_cgraph, layer_45_46_49, result);
-    result = ggml_relu(ctx_cgraph, result); 
-    struct ggml_tensor * layer_45_46_49_52 = result;
-
-    result = ggml_upscale(ctx_cgraph, result, 2);
-                                                                        
-    result = ggml_concat(ctx_cgraph, result, layer_26_27_30_33_36_39_42, 2);
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[53]);
-    print_shape(53, result);
-
-    result = ggml_upscale(ctx_cgraph, result, 2);
-   
-    result = ggml_concat(ctx_cgraph, result, layer_13_14_17_20_23, 2);
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[54]);
-    print_shape(54, result);
-
-    result = ggml_upscale(ctx_cgraph, result, 2);
-    
-    result = ggml_concat(ctx_cgraph, result, layer_3_4_7_10, 2);
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[55]);
-    print_shape(55, result);
-
-    result = ggml_upscale(ctx_cgraph, result, 2);
-    
-    result = ggml_concat(ctx_cgraph, result, layer_0, 2);
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[56]);
-    print_shape(56, result);
-
-    result = ggml_upscale(ctx_cgraph, result, 2);
-
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[57]);
-    print_shape(57, result);
-    result = apply_conv2d_unet(ctx_cgraph, result, model.conv2d_layers[58]);
-    result = ggml_sigmoid(ctx_cgraph, result);
-    print_shape(58, result);
-    struct ggml_tensor * layer_58 = result;
-
-    ggml_set_output(layer_58);
-    ggml_set_name(layer_58, "layer_58");
-    print_shape(59, result);
-
-    ggml_build_forward_expand(gf, layer_58);    
-    return gf;
-}
+    const int64_t t_start_ms = ggml_time_ms();
 
-struct unet_layer {   
-    std::vector<float> predictions;
-    int w;
-    int h;
+    auto output_name = [&](size_t idx, char * output_file, size_t size) {
+        if (idx < params.fname_out.size()) {
+            snprintf(output_file, size, "%s", params.fname_out[idx].c_str());
+        } else {
+            
+            snprintf(output_file, size, "defect prediction%d.jpg", (int) idx + 1);
+        }
+    };
 
-    unet_layer(struct ggml_tensor * prev_layer)       
-    {
-        w = prev_layer->ne[0];
-        h = prev_layer->ne[1];
-        predictions.resize(ggml_nbytes(prev_layer)/sizeof(float));
-        ggml_backend_tensor_get(prev_layer, predictions.data(), 0, ggml_nbytes(prev_layer));
-    }
-};
+    // encode, stats and report of a finished frame
+    bool first_frame = true;
+    auto finish_frame = [&](size_t idx, const unet_result & res, const unet_image_u8 & result, unet_frame_timings & timings, unet_image_pool & pool) {
+        const std::string &input_file = params.fname_inp[idx];
+        char output_file[512];
+        output_name(idx, output_file, sizeof(output_file));
 
-void detect_defect(unet_image & img, unet_image & dst, struct ggml_cgraph * gf, const unet_model & model, float thresh)
-{   
-    unet_image sized = letterbox_image_unet(img, model.width, model.height);
-    struct ggml_tensor * input = ggml_graph_get_tensor(gf, "input");
-    ggml_backend_tensor_set(input, sized.data.data(), 0, ggml_nbytes(input));
+        int64_t t0 = ggml_time_us();
+        if (!save_unet_image(result, output_file, 80, &pool)) {
+            fprintf(stderr, "%s: failed to save image to '%s'\n", __func__, output_file);
+            return false;
+        }
+        timings.us[UNET_STAGE_ENCODE] = ggml_time_us() - t0;
+
+        if (first_frame) {
+            first_frame = false;
+            const int64_t t_first_us = ggml_time_us();
+            fprintf(stderr, "%s: startup: load %.1f ms, prefault + warmup %.1f ms, time to first result %.1f ms\n", __func__,
+                    (t_loaded_us - t_main_start_us)/1000.0, (t_ready_us - t_loaded_us)/1000.0, (t_first_us - t_main_start_us)/1000.0);
+            if (fstats) {
+                fprintf(fstats, "{\"startup\": {\"load_us\": %lld, \"warmup_us\": %lld, \"first_result_us\": %lld, \"first_frame_us\": %lld}}\n",
+                        (long long) (t_loaded_us - t_main_start_us), (long long) (t_ready_us - t_loaded_us),
+                        (long long) (t_first_us - t_main_start_us), (long long) timings.total());
+            }
+        }
 
-    if (ggml_backend_graph_compute(model.backend, gf) != GGML_STATUS_SUCCESS) {
-        fprintf(stderr, "%s: ggml_backend_graph_compute() failed\n", __func__);
-        return;
-    }
+        if (fresults) {
+            unet_batch_write_result(fresults, idx, batch.items[idx], res.n_defect, res.max_score);
+        }
 
-    struct ggml_tensor * layer_58 = ggml_graph_get_tensor(gf, "layer_58");
-    unet_layer unet58{layer_58};   
+        unet_stats_add(stats, timings, res.n_defect);
+        if (fstats) {
+            unet_stats_write_frame(fstats, input_file.c_str(), timings, res.n_defect);
+        }
+        if (unet_stats_dump_requested()) {
+            unet_stats_write_summary(stderr, stats);
+        }
 
-    dst.w = model.width;
-    dst.h = model.height;
-    dst.c = 1;
-    dst.data.resize(dst.w*dst.h*dst.c);
+        if (uctx.sparse) {
+            printf("Processed: %s -> %s (defect pixels: %d, max score: %.3f, tiles: %d)\n", input_file.c_str(), output_file, res.n_defect, res.max_score, uctx.n_tiles);
+        } else {
+            printf("Processed: %s -> %s (defect pixels: %d, max score: %.3f)\n", input_file.c_str(), output_file, res.n_defect, res.max_score);
+        }
+        return true;
+    };
 
-    if (unet58.predictions.size() != dst.w * dst.h * dst.c) {
-        fprintf(stderr, "%s: Size of predictions does not match image dimensions.\n", __func__);
-        return;
-    }
+    // a manifest job records images that fail to load and goes on
+    bool load_failed = false;
+    auto report_load_error = [&](size_t idx) {
+        fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, params.fname_inp[idx].c_str());
+        if (fresults) {
+            unet_batch_write_error(fresults, idx, batch.items[idx], "failed to load image");
+        } else {
+            load_failed = true;
+        }
+    };
 
-    for (int k = 0; k < dst.c; ++k){
-        for (int j = 0; j < dst.h; ++j){
-            for (int i = 0; i < dst.w; ++i){                
-                int index = i + dst.w*j + dst.w*dst.h*k;
-                if (unet58.predictions[index] < thresh) {
-                    dst.data[index] = 0.;                 
+    auto run_range = [&](int begin, int end) {
+        if (params.pipeline) {
+            auto load = [&](int frame, unet_image_u8 & img) {
+                if (!load_unet_image(params.fname_inp[begin + frame].c_str(), img, &pipe.pool)) {
+                    report_load_error(begin + frame);
+                    return false;
                 }
-                else {
-                    dst.data[index] = 255.;
-                }                
-            }
+                return true;
+            };
+            auto done = [&](int frame, unet_pipeline_slot & slot) {
+                return finish_frame(begin + frame, slot.res, slot.result, slot.timings, pipe.pool);
+            };
+            return unet_pipeline_run(pipe, end - begin, load, done) && !load_failed;
         }
-    }
-}
 
+        for (int idx = begin; idx < end; ++idx) {
+            const std::string &input_file = params.fname_inp[idx];
+
+            const unet_model * m = &model;
+            if (multi_model) {
+                const std::string & name = idx < (int) params.model_names.size() ? params.model_names[idx] : "";
+                m = unet_registry_select(registry, name, uctx);
+                if (!m) {
+                    if (!fresults) {
+                        return false;
+                    }
+                    unet_batch_write_error(fresults, idx, batch.items[idx], "failed to load model");
+                    continue;
+                }
+            }
+          
+            unet_result res;
+            if (params.panel_tile > 0) {
+                if (!detect_defect_panel(uctx, *m, input_file.c_str(), params.panel_tile, params.thresh, res)) {
+                    report_load_error(idx);
+                    if (load_failed) {
+                        return false;
+                    }
+                    continue;
+                }
+            } else {
+                // decoded into the pooled buffer, no per-frame allocations once it has grown
+                int64_t t0 = ggml_time_us();
+                unet_image_u8 & img = uctx.pool.decoded;
+                bool loaded;
+                if (uctx.cache) {
+                    // a repeated file is answered from its bytes, before decoding
+                    std::vector<uint8_t> & file = uctx.pool.file;
+                    loaded = read_unet_file(input_file.c_str(), file);
+                    if (loaded) {
+                        res = find_cached_result(uctx, unet_hash_bytes(file.data(), file.size()));
+                        loaded = uctx.cache_hit || load_unet_image_from_memory(file.data(), file.size(), img, &uctx.pool);
+                    }
+                } else {
+                    loaded = load_unet_image(input_file.c_str(), img, &uctx.pool);
+                }
+                if (!loaded) {
+                    report_load_error(idx);
+                    if (load_failed) {
+                        return false;
+                    }
+                    continue;
+                }
+                uctx.timings.us[UNET_STAGE_DECODE] = ggml_time_us() - t0;
+               
+                if (!uctx.cache_hit) {
+                    res = detect_defect(uctx, *m, img, params.thresh);
+                }
+            }
 
-int main(int argc, char ** argv) 
-{
-    ggml_time_init();
-    unet_model model;
-
-    unet_params params;
-    if (!unet_params_parse(argc, argv, params)) 
-    {
-        return 1;
-    }
-  
-    if (!load_model(params.model, model, params.threads)) 
-    {
-        fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model.c_str());
-        return 1;
-    }  
-    // create a temporally context to build the graph
-    struct ggml_init_params params0 = {
-        /*.mem_size   =*/ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
-        /*.mem_buffer =*/ NULL,
-        /*.no_alloc   =*/ true, // the tensors will be allocated later by ggml_gallocr_alloc_graph()
+            if (!finish_frame(idx, res, uctx.result, uctx.timings, uctx.pool)) {
+                return false;
+            }
+        }
+        return true;
     };
-    struct ggml_context * ctx_cgraph = ggml_init(params0); // pointer to save adress of tensor
-   
-    struct ggml_cgraph * gf = build_graph_unet(ctx_cgraph, model);
 
-    ggml_gallocr_t allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(model.backend));
-    ggml_gallocr_alloc_graph(allocr, gf);
+    if (params.realtime_fps > 0) {
+        unet_rt_queue queue;
+        queue.policy = params.late_policy;
+        queue.depth  = params.queue_depth;
+        const int64_t period_us   = (int64_t) (1e6/params.realtime_fps);
+        const int64_t deadline_us = (int64_t) (params.deadline_ms*1000);
+
+        // the camera: frames arrive at a fixed rate and are decoded on arrival
+        std::thread camera([&] {
+            unet_image_pool camera_pool;
+            const int64_t t_begin = ggml_time_us();
+            for (size_t idx = 0; idx < params.fname_inp.size(); ++idx) {
+                {
+                    // the detector gave up
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (queue.closed) {
+                        break;
+                    }
+                }
+                const int64_t t_arrival = t_begin + idx*period_us;
+                const int64_t t_wait = t_arrival - ggml_time_us();
+                if (t_wait > 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(t_wait));
+                }
+                unet_rt_frame frame = unet_rt_acquire(queue);
+                frame.index = idx;
+                frame.t_arrival_us  = t_arrival;
+                frame.t_deadline_us = t_arrival + deadline_us;
+                if (!load_unet_image(params.fname_inp[idx].c_str(), frame.img, &camera_pool)) {
+                    fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, params.fname_inp[idx].c_str());
+                    unet_rt_release(queue, std::move(frame));
+                    continue;
+                }
+                frame.t_decode_us = ggml_time_us() - std::max(t_arrival, t_begin);
+                unet_rt_push(queue, std::move(frame));
+            }
+            unet_rt_close(queue);
+        });
+
+        // moving average of the time a frame takes on the full graph
+        double t_full_us = 0.0;
+        bool ok = true;
+        unet_rt_frame frame;
+        while (ok && unet_rt_pop(queue, frame)) {
+            const int64_t t0 = ggml_time_us();
+            const bool degrade = low && t0 + t_full_us > frame.t_deadline_us;
+            unet_context & ctx = degrade ? *low : uctx;
+
+            unet_result res = detect_defect(ctx, model, frame.img, params.thresh, degrade);
+            ctx.timings.us[UNET_STAGE_DECODE] = frame.t_decode_us;
+            ok = finish_frame(frame.index, res, ctx.result, ctx.timings, ctx.pool);
+
+            const int64_t t1 = ggml_time_us();
+            if (!degrade) {
+                t_full_us = t_full_us > 0.0 ? 0.8*t_full_us + 0.2*(t1 - t0) : (double) (t1 - t0);
+            }
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                unet_rt_counters & counters = queue.counters;
+                counters.n_full     += !degrade;
+                counters.n_degraded += degrade;
+                counters.n_missed   += t1 > frame.t_deadline_us;
+                counters.latency.add(t1 - frame.t_arrival_us);
+            }
+            unet_rt_release(queue, std::move(frame));
+        }
+        if (!ok) {
+            unet_rt_close(queue);
+        }
+        camera.join();
 
-    const int64_t t_start_ms = ggml_time_ms();
-   
-    for (size_t idx = 0; idx < params.fname_inp.size(); ++idx) {
-        const std::string &input_file = params.fname_inp[idx];
-        std::string output_file;
-    
-        if (idx < params.fname_out.size()) {
-            output_file = params.fname_out[idx];
-        } else {
-            
-            output_file = "defect prediction" + std::to_string(idx + 1) + ".jpg";
+        unet_rt_write_summary(stderr, queue);
+        if (fstats) {
+            unet_rt_write_summary(fstats, queue);
         }
-      
-        unet_image img(0, 0, 0);
-        if (!load_unet_image(input_file.c_str(), img)) {
-            fprintf(stderr, "%s: failed to load image from '%s'\n", __func__, input_file.c_str());
+        if (!ok) {
             return 1;
         }
-       
-        unet_image img_result(0, 0, 0);
-        detect_defect(img, img_result, gf, model, params.thresh);
-    
-        if (!save_unet_image(img_result, output_file.c_str(), 80)) {
-            fprintf(stderr, "%s: failed to save image to '%s'\n", __func__, output_file.c_str());
-            return 1;
+    } else if (batch_mode) {
+        // a chunk is marked done once its results are on disk
+        int begin, end;
+        while (unet_batch_claim(batch, begin, end)) {
+            fresults = unet_batch_open_results(batch, results_prefix);
+            if (!fresults || !run_range(begin, end)) {
+                return 1;
+            }
+            const bool written = unet_batch_close_results(fresults);
+            fresults = NULL;
+            if (!written) {
+                return 1;
+            }
+            unet_batch_complete(batch);
         }
-
-        printf("Processed: %s -> %s\n", input_file.c_str(), output_file.c_str());
+        fprintf(stderr, "%s: no chunks left, %d of %d done\n", __func__, unet_batch_n_done(batch), batch.n_chunks);
+        unet_batch_close(batch);
+    } else if (!run_range(0, params.fname_inp.size())) {
+        return 1;
+    }
+    if (!params.fname_calibrate.empty() && !unet_calibrate_end(model, params.model, params.fname_calibrate)) {
+        return 1;
     }
 
     const int64_t t_detect_ms = ggml_time_ms() - t_start_ms;  
     printf("Detected objects saved in (time: %f sec.)\n",  t_detect_ms / 1000.0f);
 
-    ggml_free(ctx_cgraph);
-    ggml_gallocr_free(allocr);
-    ggml_free(model.ctx);
-    ggml_backend_buffer_free(model.buffer);
-    ggml_backend_free(model.backend);
+    if (uctx.cache) {
+        unet_cache_write_summary(stderr, cache);
+        if (fstats) {
+            unet_cache_write_summary(fstats, cache);
+        }
+    }
+
+    if (multi_model) {
+        unet_registry_write_summary(stderr, registry);
+        if (fstats) {
+            unet_registry_write_summary(fstats, registry);
+        }
+    }
+
+    if (fstats) {
+        unet_stats_write_summary(fstats, stats);
+        if (fstats != stdout) {
+            fclose(fstats);
+        }
+    }
+
+    if (params.pipeline) {
+        unet_pipeline_free(pipe);
+    } else {
+        free_context(uctx);
+    }
+    if (low == &uctx_low) {
+        free_context(uctx_low);
+    }
+    if (multi_model) {
+        unet_registry_free(registry, uctx);
+    } else {
+        free_model(model);
+    }
     return 0;
 }
 
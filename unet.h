@@ -1,3 +1,5 @@
+#pragma once
+
 #include "ggml.h"
 #include "ggml-alloc.h"
 #include "ggml-backend.h"
@@ -10,7 +12,11 @@
 #include "ggml-metal.h"
 #endif
 
+#include "unet-cache.h"
 #include "unet-image.h"
+#include "unet-ops.h"
+#include "unet-realtime.h"
+#include "unet-stats.h"
 
 #include <cmath>
 #include <cstdio>
@@ -20,11 +26,19 @@
 #include <vector>
 #include <algorithm>
 #include <fstream>
+#include <memory>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+// convolution engines, chosen per layer by unet_select_conv_engines
+enum unet_conv_engine {
+    UNET_CONV_IM2COL,       // ggml_conv_2d
+    UNET_CONV_WINOGRAD,     // 3x3, stride 1 and padding 1 only
+    UNET_CONV_DIRECT,       // blocked direct convolution
+};
+
 struct unet_conv2d_layer {
     struct ggml_tensor * weights;
     struct ggml_tensor * biases;
@@ -32,24 +46,58 @@ struct unet_conv2d_layer {
     struct ggml_tensor * beta;
     struct ggml_tensor * rolling_mean;
     struct ggml_tensor * rolling_variance;
+    struct ggml_tensor * weights_wino = NULL;
+    struct ggml_tensor * weights_f16 = NULL;
+    struct ggml_tensor * weights_direct = NULL;
+    // INT8 calibration: input range [min, max] of the conv from the model file,
+    // while calibrating the graph records it through calib
+    float act_range[2] = { 0.0f, 0.0f };
+    bool calibrated = false;
+    float * calib = NULL;
+    std::shared_ptr<unet_int8_conv> int8;
+    // bias and batch norm folded into [scale, shift], applied by unet_conv_epilogue on the CPU
+    struct ggml_tensor * epilogue = NULL;
+    bool fused_epilogue = false;
     int padding = 1;
+    int pad_end[2] = { 0, 0 };  // zeros after the width and height beyond padding, asymmetric padding
     int strike = 1;
     bool batch_normalize = true;
-    bool load_next = false;
-    bool skip_load = false;
     bool activate = true; 
    
-    const char * name_conv = NULL;
-    const char * name_bn = NULL;
+    std::string name_conv;
+    std::string name_bn;
+};
+
+// encoder block: the main branch convs in order, the last one is joined with
+// the shortcut (a projection conv or the block input)
+struct unet_block {
+    std::vector<int> convs;
+    int shortcut = -1;
 };
 
 struct unet_model {
     int width = 224;
     int height = 224;
+    // layer table built from the GGUF metadata: conv2d_layers[0] is the stem,
+    // then the encoder blocks and the decoder convs, the last one is the head
     std::vector<unet_conv2d_layer> conv2d_layers;
+    std::vector<std::vector<unet_block>> stages;
+    // encoder taps concatenated by the decoder, deepest first: 0 is the stem,
+    // k the output of stage k
+    std::vector<int> skips;
     ggml_backend_t backend = NULL;
-    ggml_backend_buffer_t buffer;
-    struct ggml_context * ctx;
+    bool shared_backend = false;    // set before load_model, not freed with the model
+    ggml_backend_buffer_t buffer = NULL;
+    struct ggml_context * ctx = NULL;
+    // model file mapped with use_mmap, buffer then points into it
+    void * mapping = NULL;
+    size_t mapping_size = 0;
+    // tensors repacked at load time (Winograd, F16, folded epilogues)
+    ggml_backend_buffer_t buffer_repack = NULL;
+    struct ggml_context * ctx_repack = NULL;
+    // weights of the layers on the direct engine, blocked by output channels
+    ggml_backend_buffer_t buffer_direct = NULL;
+    struct ggml_context * ctx_direct = NULL;
 };
 
 struct unet_params {
@@ -58,4 +106,140 @@ struct unet_params {
     std::vector<std::string> fname_inp;
     std::vector<std::string> fname_out;
     int threads;
-};
\ No newline at end of file
+    bool winograd         = true;
+    std::string conv_engine;
+    std::string fname_conv_tune;
+    bool int8             = false;
+    std::string fname_calibrate;
+    std::string fname_models;
+    int model_budget_mb   = 0;
+    std::vector<std::string> model_names;   // model of each input with --models
+    enum ggml_type wtype  = GGML_TYPE_F32;
+    std::string fname_stats;
+    bool quiet            = false;
+    bool prefault         = false;
+    int warmup            = 0;
+    bool sparse           = false;
+    float sparse_margin   = 2.0f;
+    bool pipeline         = false;
+    std::vector<int> pipeline_threads;
+    bool use_mmap         = false;
+    std::string fname_manifest;
+    std::string out_dir   = ".";
+    std::string fname_state;
+    std::string fname_results;
+    int shard             = 0;
+    int n_shards          = 1;
+    int chunk             = 16;
+    int panel_tile        = 0;
+    float realtime_fps    = 0.0f;
+    float deadline_ms     = 0.0f;
+    int queue_depth       = 2;
+    unet_rt_policy late_policy = UNET_RT_DROP_OLDEST;
+    int cache_entries     = 0;
+    int cache_mb          = 64;
+    bool cache_perceptual = false;
+    int cache_phash_dist  = 0;
+};
+
+// region-sparse decoding: output tile size in pixels of the network input
+#define UNET_SPARSE_TILE 32
+
+// inference state: graph, allocator and the buffers reused across frames
+struct unet_context {
+    struct ggml_context * ctx_cgraph = NULL;
+    struct ggml_cgraph * gf = NULL;
+    ggml_gallocr_t allocr = NULL;
+    unet_image_pool pool;
+    unet_image sized;
+    unet_image_u8 result;
+    std::vector<uint32_t> mask;
+    std::vector<float> logits; // read back by non-CPU backends, see read_logits_unet
+    unet_frame_timings timings;
+
+    // region-sparse decoding, the tail graph is rebuilt for the selected tiles.
+    // sparse_requested is set by the caller, sparse tells whether the bound
+    // model runs sparse
+    bool sparse_requested = false;
+    bool sparse = false;
+    float sparse_margin = 2.0f;
+    struct ggml_context * ctx_tiles = NULL;
+    struct ggml_cgraph * gf_tiles = NULL;
+    ggml_gallocr_t allocr_tiles = NULL;
+    std::vector<float> preview;
+    std::vector<int32_t> tile_pos;
+    int n_tiles = 0;
+
+    // panel mode: strips being read and computed, the current tile and the stitched mask
+    unet_image_u8 strips[2];
+    unet_image_u8 tile;
+    unet_image_u8 panel;
+
+    // optional result cache, the raw key of the frame is set before detect_defect
+    unet_cache * cache = NULL;
+    uint64_t cache_raw = 0;
+    bool cache_has_raw = false;
+    bool cache_hit = false;
+};
+
+struct unet_result {
+    int n_defect = 0;
+    float max_score = 0.0f;
+};
+
+bool load_model(const std::string & fname, unet_model & model, int n_threads = 1, bool winograd = true, enum ggml_type wtype = GGML_TYPE_F32, bool use_mmap = false);
+void free_model(unet_model & model);
+// engine: im2col, winograd or direct for every layer that supports it, or auto
+// to time the engines on the shape of each layer and keep the fastest. A tune
+// file holds one "<layer> <engine>" line per conv layer and the host it was
+// timed on: its layers keep the
+// listed engine, the choices of auto are written back to it. CPU only
+bool unet_select_conv_engines(unet_model & model, const std::string & engine, const std::string & fname_tune);
+// default setup of a loaded model: with no engine and no tune file the CPU
+// backend times each layer once and caches the choices in <model>.conv-tune,
+// the file is timed again on another host
+bool unet_setup_conv_engines(unet_model & model, const std::string & fname_model, const std::string & engine, const std::string & fname_tune);
+// INT8 execution of the calibrated conv layers, the others stay F32. CPU only
+bool unet_prepare_int8(unet_model & model);
+// calibration: graphs built after begin record the input range of every conv,
+// end writes the model with the ranges as unet.int8.act_min/act_max.<conv name>
+void unet_calibrate_begin(unet_model & model);
+bool unet_calibrate_end(unet_model & model, const std::string & fname_model, const std::string & fname_out);
+float unet_logit(float thresh);
+struct ggml_cgraph * build_graph_unet(struct ggml_context * ctx_cgraph, const unet_model & model, int n_batch = 1, bool sparse = false);
+// pipeline-parallel execution runs parts of the graph as separate segments:
+// part 0 is the stem, part s + 1 encoder stage s, the last part the decoder
+int unet_n_parts(const unet_model & model);
+struct ggml_cgraph * build_graph_unet_segment(struct ggml_context * ctx_cgraph, const unet_model & model, int part_begin, int part_end, std::vector<struct ggml_tensor *> & taps);
+struct ggml_cgraph * build_graph_unet_tiles(struct ggml_context * ctx_tiles, const unet_model & model, struct ggml_tensor * decoder_low, struct ggml_tensor * layer_0, int n_tiles);
+// uctx.sparse_requested selects the region-sparse decoder (CPU, batch of one)
+bool init_context(unet_context & uctx, const unet_model & model, int n_batch = 1, bool keep_logits = false);
+void free_context(unet_context & uctx);
+// moves uctx to another model: the graphs are rebuilt, the compute and image
+// buffers are kept and only grow, so models of one shape share them as they are
+bool rebind_context(unet_context & uctx, const unet_model & model);
+// drops the graphs of uctx, the buffers stay for the next rebind_context
+void unbind_context(unet_context & uctx);
+void prefault_context(unet_context & uctx, const unet_model & model);
+void warmup_context(unet_context & uctx, const unet_model & model, int n_warmup);
+
+// debug prints of tensor values and layer shapes
+void unet_set_verbose(bool verbose);
+
+// summary and packed mask of a computed graph to a 0/255 image, times readback and threshold
+unet_result read_result_unet(struct ggml_cgraph * gf, const unet_model & model, std::vector<uint32_t> & mask, unet_image_u8 & dst, int64_t * t_us, int64_t t_start);
+
+// the 0/255 mask is left in uctx.result
+// looks the raw bytes of a frame up in uctx.cache: a hit fills uctx.result and
+// sets uctx.cache_hit, a miss keeps the key for the detect_defect that follows
+unet_result find_cached_result(unet_context & uctx, uint64_t raw);
+
+// preview_only: with sparse decoding, stop at the quarter-resolution preview
+// and upsample its mask, the degraded result of the real-time mode
+template <typename T>
+unet_result detect_defect(unet_context & uctx, const unet_model & model, const unet_image_t<T> & img, float thresh, bool preview_only = false);
+// streams a large image in strips of panel_tile rows, runs every panel_tile
+// square of a strip as one frame and stitches the masks into uctx.result at
+// the network resolution of a tile. The next strip is read while the current
+// one is computed, returns false when the image cannot be read
+bool detect_defect_panel(unet_context & uctx, const unet_model & model, const char * fname, int panel_tile, float thresh, unet_result & res);